@@ -0,0 +1,600 @@
+// Benchmarks for the UnixFS engine in test.cpp.
+//
+//   g++ -std=c++17 -O2 -pthread bench.cpp -o bench
+//
+//   bench [--filter text] [--quick] [--geometry 1k|4k|64k|all]
+//                                            microbenchmarks
+//   bench --gen churn|deep|wide|large [--ops N] [--seed S]
+//                                            print a workload script
+//   bench --replay script [--image file] [--commit N] [--geometry 1k|4k|64k]
+//                         [--cache MB]
+//                                            run a script, timing every command
+//
+// Results go to stdout as JSON: one record per benchmark with its
+// parameters, operation count, throughput and p50/p99 latency. The volume
+// geometry is a parameter of every record, so runs over several geometries
+// line up side by side. tests.cpp includes this file with
+// UNIXFS_BENCH_NO_MAIN defined to check the workloads.
+
+#define UNIXFS_NO_MAIN
+#include "test.cpp"
+
+#include <chrono>
+
+using Clock = chrono::steady_clock;
+
+struct Result {
+    string name;
+    vector<pair<string, long long>> params;
+    vector<double> lat_ns;
+    double seconds = 0;
+    long long errors = 0;
+};
+
+static double percentile(vector<double> &v, double p) {
+    if (v.empty()) return 0;
+    size_t k = min(v.size() - 1, (size_t)(p * v.size()));
+    nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+static string json_str(const string &s) {
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        if ((unsigned char)c < 0x20) { out += ' '; continue; }
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void print_json(vector<Result> &results, const string &mode) {
+    cout << "{\n  \"mode\": " << json_str(mode) << ",\n";
+    cout << "  \"build\": {\"compiler\": " << json_str(__VERSION__)
+#ifdef __AVX2__
+         << ", \"avx2\": true"
+#else
+         << ", \"avx2\": false"
+#endif
+         << "},\n";
+    cout << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        Result &r = results[i];
+        double ops = r.lat_ns.size();
+        cout << (i ? ",\n" : "\n") << "    {\"name\": " << json_str(r.name) << ", \"params\": {";
+        for (size_t j = 0; j < r.params.size(); ++j)
+            cout << (j ? ", " : "") << json_str(r.params[j].first) << ": " << r.params[j].second;
+        cout << "}, \"ops\": " << (long long)ops << ", \"errors\": " << r.errors << fixed << setprecision(1)
+             << ", \"seconds\": " << setprecision(6) << r.seconds << setprecision(1)
+             << ", \"ops_per_sec\": " << (r.seconds > 0 ? ops / r.seconds : 0)
+             << ", \"p50_ns\": " << percentile(r.lat_ns, 0.50)
+             << ", \"p99_ns\": " << percentile(r.lat_ns, 0.99) << "}";
+        cout.unsetf(ios::floatfield);
+    }
+    cout << "\n  ]\n}\n";
+}
+
+// Puts the geometry of the volume first among the parameters of results
+// [first, end).
+template <class G>
+static void tag_geometry(vector<Result> &results, size_t first) {
+    for (size_t i = first; i < results.size(); ++i)
+        results[i].params.insert(results[i].params.begin(),
+                                 {{"block_size", G::BLOCK_SIZE}, {"volume_mb", G::FS_SIZE >> 20}});
+}
+
+// Times one call of fn and records it; a command that reports an error
+// counts against the result.
+template <class F>
+static void timed(Result &r, F fn) {
+    cur_session->failed = false;
+    auto t0 = Clock::now();
+    fn();
+    double ns = chrono::duration<double, nano>(Clock::now() - t0).count();
+    r.lat_ns.push_back(ns);
+    r.seconds += ns / 1e9;
+    if (cur_session->failed) r.errors++;
+}
+
+// Command output of the benchmarks is discarded.
+struct NullSession {
+    ostream null_out;
+    Session s;
+    NullSession() : null_out(nullptr) {
+        s.out = &null_out;
+        s.out_fd = open("/dev/null", O_WRONLY);
+        cur_session = &s;
+    }
+    ~NullSession() {
+        close(s.out_fd);
+        cur_session = nullptr;
+    }
+};
+
+static const FillEngine ZERO_FILL = {FillPattern::Zeros, 0};
+static const FillEngine LETTER_FILL = {FillPattern::Letters, 42};
+
+// Fills the device to `pct` percent with free blocks scattered at random,
+// the worst case for a next-fit search.
+template <class G>
+static void occupy(FileSystem<G> &fs, int pct, mt19937_64 &rng) {
+    vector<Extent> all;
+    int target = G::NUM_BLOCKS * (int64_t)pct / 100;
+    int got;
+    for (int b; (b = fs.alloc_extent(G::NUM_BLOCKS, got)) >= 0;) all.push_back({b, got});
+    vector<int> blocks;
+    for (const Extent &e : all)
+        for (int i = 0; i < e.len; ++i) blocks.push_back(e.start + i);
+    shuffle(blocks.begin(), blocks.end(), rng);
+    int to_free = max<int>(0, (int)blocks.size() - target);
+    for (int i = 0; i < to_free; ++i) fs.free_block(blocks[i]);
+}
+
+template <class G>
+static void bench_alloc_block(vector<Result> &out, bool quick) {
+    for (int pct : {0, 50, 90, 99}) {
+        NullSession ns;
+        FileSystem<G> fs;
+        mt19937_64 rng(pct);
+        occupy(fs, pct, rng);
+        Result r;
+        r.name = "alloc_block";
+        r.params = {{"occupancy_pct", pct}};
+        int n = min(quick ? 1000 : 10000, G::NUM_BLOCKS * (100 - pct) / 100);
+        vector<int> got;
+        for (int i = 0; i < n; ++i) {
+            int b;
+            timed(r, [&] { b = fs.alloc_block(); });
+            if (b >= 0) got.push_back(b);
+        }
+        for (int b : got) fs.free_block(b);
+        out.push_back(std::move(r));
+    }
+}
+
+template <class G>
+static void bench_lookup(vector<Result> &out, bool quick) {
+    for (int fanout : {10, 1000, 10000}) {
+        NullSession ns;
+        FileSystem<G> fs;
+        fs.cmd_createDir("/d");
+        for (int i = 0; i < fanout; ++i) fs.cmd_createFile("/d/f" + to_string(i), 0, ZERO_FILL);
+        mt19937_64 rng(fanout);
+        int n = quick ? 10000 : 200000;
+        Result hit, miss;
+        hit.name = "lookup_inode";
+        hit.params = {{"fanout", fanout}, {"present", 1}};
+        miss.name = "lookup_inode";
+        miss.params = {{"fanout", fanout}, {"present", 0}};
+        vector<string> names(fanout), absent(1024);
+        for (int i = 0; i < fanout; ++i) names[i] = "/d/f" + to_string(i);
+        for (int i = 0; i < 1024; ++i) absent[i] = "/d/x" + to_string(i);
+        for (int i = 0; i < n; ++i) {
+            const string &p = names[rng() % fanout];
+            timed(hit, [&] { fs.lookup_inode(p); });
+            const string &q = absent[rng() % absent.size()];
+            timed(miss, [&] { fs.lookup_inode(q); });
+        }
+        out.push_back(std::move(hit));
+        out.push_back(std::move(miss));
+    }
+    for (int depth : {1, 8, 32}) {
+        NullSession ns;
+        FileSystem<G> fs;
+        string p;
+        for (int i = 0; i < depth; ++i) fs.cmd_createDir(p += "/d" + to_string(i));
+        string file = p + "/f";
+        fs.cmd_createFile(file, 0, ZERO_FILL);
+        Result r;
+        r.name = "lookup_inode";
+        r.params = {{"depth", depth}};
+        for (int i = 0; i < (quick ? 10000 : 200000); ++i) timed(r, [&] { fs.lookup_inode(file); });
+        out.push_back(std::move(r));
+    }
+}
+
+template <class G>
+static void bench_cp(vector<Result> &out, bool quick) {
+    for (int kb : {1, 64, 4096}) {
+        NullSession ns;
+        FileSystem<G> fs;
+        fs.cmd_createFile("/src", kb, LETTER_FILL);
+        Result r;
+        r.name = "cmd_cp";
+        r.params = {{"file_kb", kb}};
+        int n = quick ? 200 : 2000;
+        for (int i = 0; i < n; ++i) {
+            string dst = "/c" + to_string(i);
+            timed(r, [&] { fs.cmd_cp("/src", dst); });
+        }
+        for (int i = 0; i < n; ++i) fs.cmd_deleteFile("/c" + to_string(i));
+        out.push_back(std::move(r));
+    }
+    for (int fanout : {10, 100, 1000}) {
+        NullSession ns;
+        FileSystem<G> fs;
+        fs.cmd_createDir("/t");
+        for (int d = 0; d < 10; ++d) {
+            string dir = "/t/d" + to_string(d);
+            fs.cmd_createDir(dir);
+            for (int i = 0; i < fanout / 10; ++i) fs.cmd_createFile(dir + "/f" + to_string(i), 1, LETTER_FILL);
+        }
+        Result r;
+        r.name = "cmd_cp_tree";
+        r.params = {{"files", fanout}};
+        int n = quick ? 5 : 20;
+        for (int i = 0; i < n; ++i) {
+            string dst = "/c" + to_string(i);
+            timed(r, [&] { fs.cmd_cp("/t", dst); });
+        }
+        out.push_back(std::move(r));
+    }
+}
+
+template <class G>
+static void bench_cat(vector<Result> &out, bool quick) {
+    for (int kb : {1, 64, 1024, 8192}) {
+        NullSession ns;
+        FileSystem<G> fs;
+        fs.cmd_createFile("/f", kb, LETTER_FILL);
+        Result r;
+        r.name = "cmd_cat";
+        r.params = {{"file_kb", kb}};
+        int n = max(quick ? 50 : 200, (quick ? 2000 : 20000) / kb);
+        for (int i = 0; i < n; ++i) timed(r, [&] { fs.cmd_cat("/f"); });
+        out.push_back(std::move(r));
+    }
+}
+
+// Write-path cost of dedup: the same creates with the index off and on, for
+// unique contents, one repeated template and zero-filled files.
+template <class G>
+static void bench_create(vector<Result> &out, bool quick) {
+    for (int dedup : {0, 1})
+        for (int kb : {4, 256})
+            for (int content : {0, 1, 2}) {
+                NullSession ns;
+                FileSystem<G> fs;
+                fs.set_dedup(dedup);
+                Result r;
+                r.name = "cmd_createFile";
+                r.params = {{"dedup", dedup}, {"file_kb", kb}, {"repeated", content == 1}, {"zeros", content == 2}};
+                int batch = 8192 / kb, n = quick ? 2 * batch : 16 * batch;
+                for (int i = 0; i < n; ++i) {
+                    FillEngine fill = content == 2 ? ZERO_FILL : LETTER_FILL;
+                    if (content == 0) fill.seed = i;
+                    string f = "/f" + to_string(i % batch);
+                    timed(r, [&] { fs.cmd_createFile(f, kb, fill); });
+                    if (i % batch == batch - 1)
+                        for (int j = 0; j < batch; ++j) fs.cmd_deleteFile("/f" + to_string(j));
+                }
+                out.push_back(std::move(r));
+            }
+}
+
+// Listing a large cwd whole and a page at a time from random offsets.
+template <class G>
+static void bench_dir(vector<Result> &out, bool quick) {
+    for (int fanout : {1000, 100000}) {
+        NullSession ns;
+        FileSystem<G> fs;
+        fs.cmd_createDir("/d");
+        for (int i = 0; i < fanout; ++i) fs.cmd_createFile("/d/f" + to_string(i), 0, ZERO_FILL);
+        for (int i = 0; i < fanout / 100; ++i) fs.cmd_createDir("/d/s" + to_string(i));
+        fs.cmd_changeDir("/d");
+        Result whole, page;
+        whole.name = "cmd_dir";
+        whole.params = {{"entries", fanout + fanout / 100}, {"page", 0}};
+        page.name = "cmd_dir";
+        page.params = {{"entries", fanout + fanout / 100}, {"page", 50}};
+        mt19937_64 rng(fanout);
+        for (int i = 0; i < (quick ? 2 : 10); ++i) timed(whole, [&] { fs.cmd_dir(); });
+        for (int i = 0; i < (quick ? 1000 : 10000); ++i) {
+            int64_t off = rng() % fanout;
+            timed(page, [&] { fs.cmd_dir(off, 50); });
+        }
+        out.push_back(std::move(whole));
+        out.push_back(std::move(page));
+    }
+}
+
+// du of a tree read from its totals, and removing the whole tree with one
+// deleteDir -r.
+template <class G>
+static void bench_subtree(vector<Result> &out, bool quick) {
+    for (int files : {100, 1000, 10000}) {
+        NullSession ns;
+        FileSystem<G> fs;
+        Result du, del;
+        du.name = "cmd_du";
+        du.params = {{"files", files}};
+        del.name = "cmd_deleteDir_r";
+        del.params = {{"files", files}};
+        for (int round = 0; round < (quick ? 2 : 5); ++round) {
+            fs.cmd_createDir("/t");
+            for (int d = 0; d < 10; ++d) {
+                string dir = "/t/d" + to_string(d);
+                fs.cmd_createDir(dir);
+                for (int i = 0; i < files / 10; ++i) fs.cmd_createFile(dir + "/f" + to_string(i), 1, ZERO_FILL);
+            }
+            for (int i = 0; i < (quick ? 1000 : 10000); ++i) timed(du, [&] { fs.cmd_du("/t"); });
+            timed(del, [&] { fs.cmd_deleteDir("/t", true); });
+        }
+        out.push_back(std::move(du));
+        out.push_back(std::move(del));
+    }
+}
+
+// Sequential cat of large files written into the holes left by churn, before
+// and after a defrag pass, and the cost of the pass itself.
+template <class G>
+static void bench_defrag(vector<Result> &out, bool quick) {
+    NullSession ns;
+    FileSystem<G> fs;
+    int small = G::NUM_BLOCKS / 8, big = quick ? 4 : 8;
+    int64_t kb = (int64_t)G::NUM_BLOCKS * G::BLOCK_SIZE / 16 / big >> 10;
+    for (int i = 0; i < small; ++i) fs.cmd_createFile("/s" + to_string(i), G::BLOCK_SIZE >> 10, LETTER_FILL);
+    for (int i = 0; i < small; i += 2) fs.cmd_deleteFile("/s" + to_string(i));
+    for (int i = 0; i < big; ++i) fs.cmd_createFile("/b" + to_string(i), kb, LETTER_FILL);
+    fs.commit();
+    Result before, pass, after;
+    before.name = after.name = "cmd_cat";
+    before.params = {{"file_kb", kb}, {"defragged", 0}};
+    after.params = {{"file_kb", kb}, {"defragged", 1}};
+    pass.name = "cmd_defrag";
+    pass.params = {{"files", small / 2 + big}};
+    int n = quick ? 2 : 10;
+    for (int r = 0; r < n; ++r)
+        for (int i = 0; i < big; ++i) timed(before, [&] { fs.cmd_cat("/b" + to_string(i)); });
+    timed(pass, [&] { fs.cmd_defrag(""); });
+    for (int r = 0; r < n; ++r)
+        for (int i = 0; i < big; ++i) timed(after, [&] { fs.cmd_cat("/b" + to_string(i)); });
+    out.push_back(std::move(before));
+    out.push_back(std::move(pass));
+    out.push_back(std::move(after));
+}
+
+static string temp_image() {
+    char buf[] = "/tmp/unixfs-bench-XXXXXX";
+    int fd = mkstemp(buf);
+    if (fd >= 0) close(fd);
+    unlink(buf);
+    return buf;
+}
+
+static void remove_image(const string &img) {
+    unlink(img.c_str());
+    unlink((img + ".journal").c_str());
+}
+
+template <class G>
+static void bench_image(vector<Result> &out, bool quick) {
+    for (int files : {100, 2000, 10000}) {
+        string img = temp_image();
+        {
+            NullSession ns;
+            FileSystem<G> fs;
+            fs.load_image(img);
+            for (int i = 0; i < files; ++i) fs.cmd_createFile("/f" + to_string(i), 1, LETTER_FILL);
+            fs.save_image();
+
+            Result r;
+            r.name = "save_image";
+            r.params = {{"files", files}};
+            for (int i = 0; i < (quick ? 10 : 50); ++i) {
+                fs.cmd_deleteFile("/f" + to_string(i));
+                fs.cmd_createFile("/f" + to_string(i), 1, LETTER_FILL);
+                timed(r, [&] { fs.save_image(); });
+            }
+            out.push_back(std::move(r));
+        }
+        Result r;
+        r.name = "load_image";
+        r.params = {{"files", files}};
+        for (int i = 0; i < (quick ? 5 : 20); ++i) {
+            NullSession ns;
+            FileSystem<G> fs;
+            timed(r, [&] { fs.load_image(img); });
+        }
+        out.push_back(std::move(r));
+        remove_image(img);
+    }
+}
+
+// Workload scripts in the command language of test.cpp.
+static void generate(const string &kind, long long ops, uint64_t seed) {
+    mt19937_64 rng(seed);
+    auto pick = [&](long long n) { return (long long)(rng() % n); };
+    if (kind == "churn") {
+        // create/delete churn over a fixed set of names in a few directories
+        const int DIRS = 8, NAMES = 512;
+        vector<char> live(DIRS * NAMES, 0);
+        for (int d = 0; d < DIRS; ++d) cout << "createDir /c" << d << "\n";
+        for (long long i = 0; i < ops; ++i) {
+            int k = pick(DIRS * NAMES);
+            string p = "/c" + to_string(k / NAMES) + "/f" + to_string(k % NAMES);
+            if (live[k]) cout << "deleteFile " << p << "\n";
+            else cout << "createFile " << p << " " << 1 + pick(8) << "\n";
+            live[k] ^= 1;
+        }
+    } else if (kind == "deep") {
+        // one long chain of directories, files at every level, then reads
+        // from the bottom up
+        int depth = max(1LL, min(ops / 4, 256LL));
+        string p;
+        vector<string> files;
+        for (int d = 0; d < depth; ++d) {
+            p += "/n" + to_string(d);
+            cout << "createDir " << p << "\n";
+            files.push_back(p + "/f");
+            cout << "createFile " << files.back() << " 1\n";
+        }
+        for (long long i = 2 * depth; i < ops; ++i) cout << "cat " << files[pick(depth)] << " 0 64\n";
+    } else if (kind == "wide") {
+        // one directory with many entries, then lookups and removals
+        long long n = max(1LL, ops / 2);
+        cout << "createDir /w\n";
+        for (long long i = 0; i < n; ++i) cout << "createFile /w/f" << i << " 0\n";
+        vector<long long> live(n);
+        iota(live.begin(), live.end(), 0);
+        for (long long i = n; i < ops && !live.empty(); ++i) {
+            long long k = pick(live.size());
+            if (i % 4 == 0) {
+                cout << "deleteFile /w/f" << live[k] << "\n";
+                live[k] = live.back();
+                live.pop_back();
+            } else {
+                cout << "cat /w/f" << live[k] << "\n";
+            }
+        }
+    } else if (kind == "large") {
+        // large files: create, copy, ranged reads, delete
+        const int SLOTS = 4;
+        vector<int> size_kb(SLOTS, 0);
+        for (long long i = 0; i < ops; ++i) {
+            int k = pick(SLOTS);
+            string p = "/big" + to_string(k);
+            if (!size_kb[k]) {
+                size_kb[k] = 512 + pick(2048);
+                cout << "createFile " << p << " " << size_kb[k] << "\n";
+            } else if (i % 7 == 0) {
+                cout << "deleteFile " << p << "\n";
+                size_kb[k] = 0;
+            } else if (i % 5 == 0) {
+                cout << "cp " << p << " " << p << "c" << i << "\n";
+                cout << "deleteFile " << p << "c" << i << "\n";
+            } else {
+                long long off = pick((long long)size_kb[k] * 1024);
+                cout << "cat " << p << " " << off << " " << 64 * 1024 << "\n";
+            }
+        }
+    } else {
+        cerr << "unknown workload " << kind << " (churn, deep, wide, large)\n";
+        exit(2);
+    }
+}
+
+// Replays a script against a scratch image, timing each command; results
+// are grouped by command name, with commits timed separately.
+template <class G>
+static void replay(const string &script, string img, int commit_every, int cache_mb) {
+    int fd = open(script.c_str(), O_RDONLY);
+    if (fd < 0) { cerr << "Cannot open " << script << "\n"; exit(1); }
+    bool scratch = img.empty();
+    if (scratch) img = temp_image();
+
+    map<string, Result> by_cmd;
+    Result total, commits;
+    total.name = "total";
+    commits.name = "commit";
+    {
+        NullSession ns;
+        FileSystem<G> fs;
+        fs.set_cache_budget((size_t)cache_mb << 20);
+        fs.load_image(img);
+        LineReader in(fd);
+        string_view line, tok[1];
+        int pending = 0;
+        while (in.next(line)) {
+            if (tokenize(line, tok, 1) == 0) continue;
+            Result &r = by_cmd[string(tok[0])];
+            double before = r.seconds;
+            timed(r, [&] { fs.execute(ns.s, line); });
+            total.lat_ns.push_back(r.lat_ns.back());
+            total.seconds += r.seconds - before;
+            total.errors += ns.s.failed;
+            if (++pending >= commit_every) {
+                timed(commits, [&] { fs.commit(); });
+                pending = 0;
+            }
+        }
+        timed(commits, [&] { fs.save_image(); });
+    }
+    close(fd);
+    if (scratch) remove_image(img);
+
+    vector<Result> results;
+    for (auto &kv : by_cmd) {
+        kv.second.name = kv.first;
+        results.push_back(std::move(kv.second));
+    }
+    total.params = {{"commit_every", commit_every}, {"cache_mb", cache_mb}};
+    results.push_back(std::move(commits));
+    results.push_back(std::move(total));
+    tag_geometry<G>(results, 0);
+    print_json(results, "replay");
+}
+
+template <class G>
+static void run_micro(vector<Result> &results, const string &filter, bool quick) {
+    struct Bench { const char *name; void (*fn)(vector<Result>&, bool); };
+    const Bench all[] = {
+        {"alloc_block", bench_alloc_block<G>},
+        {"lookup_inode", bench_lookup<G>},
+        {"cmd_cp", bench_cp<G>},
+        {"cmd_cat", bench_cat<G>},
+        {"cmd_createFile", bench_create<G>},
+        {"image", bench_image<G>},
+        {"defrag", bench_defrag<G>},
+        {"subtree", bench_subtree<G>},
+        {"cmd_dir", bench_dir<G>},
+    };
+    for (const Bench &b : all) {
+        if (!filter.empty() && string(b.name).find(filter) == string::npos) continue;
+        cerr << "running " << b.name << " (" << G::BLOCK_SIZE << "-byte blocks)\n";
+        size_t first = results.size();
+        b.fn(results, quick);
+        tag_geometry<G>(results, first);
+    }
+}
+
+#ifndef UNIXFS_BENCH_NO_MAIN
+static void usage(const char *prog) {
+    cerr << "usage: " << prog << " [--filter text] [--quick] [--geometry 1k|4k|64k|all]\n"
+         << "       " << prog << " --gen churn|deep|wide|large [--ops N] [--seed S]\n"
+         << "       " << prog << " --replay script [--image file] [--commit N] [--geometry 1k|4k|64k] [--cache MB]\n";
+}
+
+int main(int argc, char **argv) {
+    string filter, gen, script, image, geometry = "1k";
+    long long ops = 100000;
+    uint64_t seed = 1;
+    int commit_every = 1024, cache_mb = 256;
+    bool quick = false;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        bool more = i + 1 < argc;
+        if (a == "--filter" && more) filter = argv[++i];
+        else if (a == "--quick") quick = true;
+        else if (a == "--gen" && more) gen = argv[++i];
+        else if (a == "--ops" && more) ops = atoll(argv[++i]);
+        else if (a == "--seed" && more) seed = strtoull(argv[++i], nullptr, 10);
+        else if (a == "--replay" && more) script = argv[++i];
+        else if (a == "--image" && more) image = argv[++i];
+        else if (a == "--commit" && more) commit_every = max(1, atoi(argv[++i]));
+        else if (a == "--geometry" && more) geometry = argv[++i];
+        else if (a == "--cache" && more) cache_mb = max(1, atoi(argv[++i]));
+        else { usage(argv[0]); return 2; }
+    }
+    ios::sync_with_stdio(false);
+    if (!gen.empty()) {
+        generate(gen, ops, seed);
+        return 0;
+    }
+    bool all = geometry == "all";
+    if (!all && geometry != "1k" && geometry != "4k" && geometry != "64k") { usage(argv[0]); return 2; }
+    if (!script.empty()) {
+        if (geometry == "4k") replay<Geometry4K>(script, image, commit_every, cache_mb);
+        else if (geometry == "64k") replay<Geometry64K>(script, image, commit_every, cache_mb);
+        else replay<Geometry1K>(script, image, commit_every, cache_mb);
+        return 0;
+    }
+
+    vector<Result> results;
+    if (all || geometry == "1k") run_micro<Geometry1K>(results, filter, quick);
+    if (all || geometry == "4k") run_micro<Geometry4K>(results, filter, quick);
+    if (all || geometry == "64k") run_micro<Geometry64K>(results, filter, quick);
+    print_json(results, quick ? "micro-quick" : "micro");
+    return 0;
+}
+#endif
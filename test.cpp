@@ -5,613 +5,5276 @@
 #include <ctime>
 #include <map>
 #include <sstream>
-#include <fstream>
 #include <algorithm>
 #include <iomanip>  
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <string_view>
+#include <new>
+#include <random>
+#include <charconv>
+#include <cctype>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <csignal>
+#include <cerrno>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__AVX2__) || defined(__BMI2__)
+#include <immintrin.h>
+#endif
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
 using namespace std;
 
-static const int FS_SIZE = 16 * 1024 * 1024;
-static const int BLOCK_SIZE = 1024;
-static const int NUM_BLOCKS = FS_SIZE / BLOCK_SIZE;
-static const int MAX_INODES = 1024;          
-static const int DIRECT_PTRS = 10;
+// Volume geometry: block size and bytes of block storage, both powers of
+// two, and the number of inode slots. Everything sized by them is a template
+// on the geometry, so volumes of different shapes can be built side by side
+// with every size a compile-time constant.
+template <int BlockShift, int VolumeShift, int MaxInodes = 1 << 20>
+struct Geometry {
+    static constexpr int BLOCK_SHIFT = BlockShift;
+    static constexpr int BLOCK_SIZE = 1 << BlockShift;
+    static constexpr int64_t FS_SIZE = (int64_t)1 << VolumeShift;  // bytes of block storage
+    // Unit of packed block storage. A block takes at most 64 granules, so a
+    // block map entry (mode, granule count, first granule) fits in 32 bits.
+    static constexpr int GRANULE_SHIFT = max(6, BlockShift - 6);
+    static constexpr int GRANULE = 1 << GRANULE_SHIFT;
+    static constexpr int GRANULE_BITS = VolumeShift - GRANULE_SHIFT;
+    static constexpr int NUM_GRANULES = 1 << GRANULE_BITS;
+    static constexpr int OVERCOMMIT = 4;                          // logical blocks per stored block
+    static constexpr int NUM_BLOCKS = OVERCOMMIT << (VolumeShift - BlockShift);
+    static constexpr int MAX_INODES = MaxInodes;
 
-inline int addr_to_block(int addr) { return addr >> 10; }
-inline int addr_to_offset(int addr) { return addr & 0x3FF; }
-inline int make_addr(int blk, int off) { return (blk << 10) | off; }
+    static_assert(BlockShift >= 9 && BlockShift <= 16, "block size must be 512 bytes to 64KB");
+    static_assert(VolumeShift - BlockShift >= 10, "volume must hold at least 1024 blocks");
+    static_assert(GRANULE_BITS + 8 <= 32, "volume too large for its block size");
+};
+
+using Geometry1K = Geometry<10, 24>;     // 1KB blocks, 16MB: the classic volume
+using Geometry4K = Geometry<12, 30>;     // 4KB blocks, 1GB
+using Geometry64K = Geometry<16, 32>;    // 64KB blocks, 4GB
+
+static const int INLINE_EXTENTS = 4;
+
+inline uint64_t hash_bytes(const char *p, size_t n) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; ++i) { h ^= (unsigned char)p[i]; h *= 1099511628211ULL; }
+    return h;
+}
+
+inline uint64_t rotl64(uint64_t x, int r) { return x << r | x >> (64 - r); }
+
+// 64-bit content fingerprint for dedup: four independent xxHash64-style lanes
+// over 8-byte words, folded and avalanched. Not collision-proof, so equal
+// fingerprints are confirmed byte for byte before blocks are merged.
+inline uint64_t fingerprint(const char *p, size_t n) {
+    const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t a[4] = {P1 + P2, P2, 0, 0 - P1};
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+        for (int k = 0; k < 4; ++k) {
+            uint64_t w;
+            memcpy(&w, p + i + 8 * k, 8);
+            a[k] = rotl64(a[k] + w * P2, 31) * P1;
+        }
+    uint64_t h = rotl64(a[0], 1) + rotl64(a[1], 7) + rotl64(a[2], 12) + rotl64(a[3], 18) + n;
+    for (; i < n; ++i) h = (h ^ (unsigned char)p[i]) * P1;
+    h ^= h >> 33; h *= P2;
+    h ^= h >> 29; h *= P1;
+    return h ^ h >> 32;
+}
+
+// Fixed-width little-endian fields, so images and journals do not depend on
+// the byte order, type sizes or struct padding of the build that wrote them.
+inline void put_le(char *p, uint64_t v, int n) {
+    for (int i = 0; i < n; ++i) p[i] = (char)(v >> (8 * i));
+}
+inline uint64_t get_le(const char *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i) v |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    return v;
+}
+// Eight bytes at once, for hot loops the byte-wise forms are too slow for.
+inline uint64_t load_le64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? v : __builtin_bswap64(v);
+}
+inline void store_le64(char *p, uint64_t v) {
+    if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__) v = __builtin_bswap64(v);
+    memcpy(p, &v, 8);
+}
+
+// CRC32C (Castagnoli). Built with SSE4.2 it runs on the crc32 instruction,
+// 8 bytes per step; otherwise on slicing-by-8 tables.
+struct Crc32cTables {
+    uint32_t t[8][256];
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+            t[0][i] = c;
+        }
+        for (int i = 0; i < 256; ++i)
+            for (int k = 1; k < 8; ++k) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+    }
+};
+
+inline uint32_t crc32c(const void *data, size_t n, uint32_t crc = 0) {
+    const char *p = static_cast<const char*>(data);
+    crc = ~crc;
+#ifdef __SSE4_2__
+    uint64_t c = crc;
+    for (; n >= 8; p += 8, n -= 8) { uint64_t v; memcpy(&v, p, 8); c = _mm_crc32_u64(c, v); }
+    crc = c;
+    for (; n > 0; --n) crc = _mm_crc32_u8(crc, *p++);
+#else
+    static const Crc32cTables tables;
+    const auto &t = tables.t;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint32_t lo = crc ^ (uint32_t)get_le(p, 4), hi = get_le(p + 4, 4);
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (; n > 0; --n) crc = (crc >> 8) ^ t[0][(crc ^ (unsigned char)*p++) & 0xFF];
+#endif
+    return ~crc;
+}
+
+// Instrumentation. Every thread records into a StatShard of its own, so an
+// update is a relaxed load and store with no shared cache line; readers sum
+// the shards of running threads and what finished threads left behind.
+enum StatCounter {
+    CNT_BLOCKS_ALLOCATED, CNT_BLOCKS_FREED, CNT_BYTES_WRITTEN, CNT_BYTES_COPIED, CNT_BYTES_READ,
+    CNT_DCACHE_HITS, CNT_DCACHE_MISSES, CNT_DIR_LOOKUPS, CNT_DIR_PROBES,
+    CNT_BITMAP_SCANS, CNT_BITMAP_WORDS, CNT_DEDUP_HITS, CNT_DEDUP_MISSES, CNT_DEDUP_COLLISIONS,
+    CNT_BLOCK_CACHE_HITS, CNT_BLOCK_CACHE_MISSES, CNT_BUFFER_HITS, CNT_BUFFER_MISSES,
+    CNT_BUFFER_READAHEAD, CNT_BUFFER_EVICTIONS, CNT_BUFFER_WRITEBACKS, CNT_DEFRAG_MOVED,
+    CNT_DEFRAG_PACKED, NUM_COUNTERS
+};
+static const char *const counter_names[NUM_COUNTERS] = {
+    "blocks_allocated", "blocks_freed", "bytes_written", "bytes_copied", "bytes_read",
+    "dcache_hits", "dcache_misses", "dir_lookups", "dir_probes",
+    "bitmap_scans", "bitmap_words_scanned", "dedup_hits", "dedup_misses", "dedup_collisions",
+    "block_cache_hits", "block_cache_misses", "buffer_hits", "buffer_misses",
+    "buffer_readahead", "buffer_evictions", "buffer_writebacks", "defrag_blocks_moved",
+    "defrag_blocks_packed",
+};
+
+// Latencies in nanoseconds, except probe_length which counts slots.
+enum StatHist {
+    HIST_CREATEDIR, HIST_DELETEDIR, HIST_CHANGEDIR, HIST_DIR, HIST_CREATEFILE, HIST_DELETEFILE,
+    HIST_CP, HIST_SUM, HIST_DU, HIST_CAT, HIST_STATS, HIST_FSCK, HIST_DEFRAG, HIST_OTHER,
+    HIST_ALLOC, HIST_LOOKUP, HIST_COMMIT, HIST_CHECKPOINT, HIST_DEFRAG_STEP, HIST_PROBE_LENGTH, NUM_HISTS
+};
+static const char *const hist_names[NUM_HISTS] = {
+    "createDir", "deleteDir", "changeDir", "dir", "createFile", "deleteFile",
+    "cp", "sum", "du", "cat", "stats", "fsck", "defrag", "other",
+    "alloc_extent", "lookup", "commit", "checkpoint", "defrag_step", "probe_length",
+};
+
+inline void bump(atomic<uint64_t> &a, uint64_t n) {
+    a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Log-linear buckets in the style of HdrHistogram: values below 16 get one
+// each, larger ones 16 per power of two, so a bucket's bounds differ by at
+// most 1/16. Values from 2^40 up share the last bucket.
+struct Histogram {
+    static constexpr int SUB = 16;
+    static constexpr int BUCKETS = (40 - 3) * SUB;
+    atomic<uint64_t> buckets[BUCKETS];
+    atomic<uint64_t> sum;
+
+    static int bucket(uint64_t v) {
+        if (v < (uint64_t)SUB) return v;
+        int msb = 63 - __builtin_clzll(v);
+        if (msb >= 40) return BUCKETS - 1;
+        return (msb - 3) * SUB + (int)(v >> (msb - 4)) - SUB;
+    }
+    static uint64_t lower(int b) {
+        if (b < SUB) return b;
+        return (uint64_t)(b % SUB + SUB) << (b / SUB - 1);
+    }
+
+    void record(uint64_t v, uint64_t n = 1) {
+        bump(buckets[bucket(v)], n);
+        bump(sum, v * n);
+    }
+};
+
+struct StatShard {
+    atomic<uint64_t> counters[NUM_COUNTERS];
+    Histogram hist[NUM_HISTS];
+    uint32_t ticks;     // sampling clock, owner only
+};
+
+// Plain sums of shards, and differences of sums for `stats reset`.
+struct StatTotals {
+    uint64_t counters[NUM_COUNTERS] = {};
+    uint64_t buckets[NUM_HISTS][Histogram::BUCKETS] = {};
+    uint64_t sums[NUM_HISTS] = {};
+
+    void add(const StatShard &s) {
+        for (int c = 0; c < NUM_COUNTERS; ++c) counters[c] += s.counters[c].load(memory_order_relaxed);
+        for (int h = 0; h < NUM_HISTS; ++h) {
+            for (int b = 0; b < Histogram::BUCKETS; ++b)
+                buckets[h][b] += s.hist[h].buckets[b].load(memory_order_relaxed);
+            sums[h] += s.hist[h].sum.load(memory_order_relaxed);
+        }
+    }
+    void subtract(const StatTotals &t) {
+        for (int c = 0; c < NUM_COUNTERS; ++c) counters[c] -= t.counters[c];
+        for (int h = 0; h < NUM_HISTS; ++h) {
+            for (int b = 0; b < Histogram::BUCKETS; ++b) buckets[h][b] -= t.buckets[h][b];
+            sums[h] -= t.sums[h];
+        }
+    }
+
+    uint64_t count(int h) const {
+        uint64_t n = 0;
+        for (uint64_t c : buckets[h]) n += c;
+        return n;
+    }
+    // Midpoint of the bucket holding the p-th fraction of the values; p = 1
+    // gives the top of the range seen.
+    double percentile(int h, double p) const {
+        uint64_t n = count(h), seen = 0;
+        if (n == 0) return 0;
+        uint64_t want = max<uint64_t>(1, (uint64_t)(p * n));
+        for (int b = 0; b < Histogram::BUCKETS; ++b) {
+            seen += buckets[h][b];
+            if (seen >= want) {
+                if (b < Histogram::SUB || b + 1 == Histogram::BUCKETS) return Histogram::lower(b);
+                return (Histogram::lower(b) + Histogram::lower(b + 1)) / 2.0;
+            }
+        }
+        return 0;
+    }
+};
+
+class StatRegistry {
+    mutex mu;
+    set<StatShard*> live;
+    StatTotals retired;
+
+public:
+    StatShard *attach() {
+        StatShard *s = new StatShard();
+        lock_guard<mutex> g(mu);
+        live.insert(s);
+        return s;
+    }
+    void detach(StatShard *s) {
+        lock_guard<mutex> g(mu);
+        retired.add(*s);
+        live.erase(s);
+        delete s;
+    }
+    void snapshot(StatTotals &t) {
+        lock_guard<mutex> g(mu);
+        t = retired;
+        for (StatShard *s : live) t.add(*s);
+    }
+};
+static StatRegistry stat_registry;
+
+struct StatSlot {
+    StatShard *shard = stat_registry.attach();
+    ~StatSlot() { stat_registry.detach(shard); }
+};
+
+inline StatShard &stat_shard() {
+    static thread_local StatSlot slot;
+    return *slot.shard;
+}
+inline void stat_add(StatCounter c, uint64_t n = 1) { bump(stat_shard().counters[c], n); }
+inline void stat_record(StatHist h, uint64_t v, uint64_t n = 1) { stat_shard().hist[h].record(v, n); }
+
+inline uint64_t stat_now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Records its own lifetime in histogram h. Primitives that take about as
+// long as reading the clock twice are timed only once every `every` calls,
+// and that sample then counts `every` times.
+struct StatTimer {
+    StatHist h;
+    uint32_t every;
+    uint64_t t0 = 0;
+    explicit StatTimer(StatHist h_, uint32_t every_ = 1) : h(h_), every(every_) {
+        if (every == 1 || stat_shard().ticks++ % every == 0) t0 = stat_now();
+    }
+    ~StatTimer() {
+        if (t0) stat_record(h, stat_now() - t0, every);
+    }
+};
+
+// One bit per block, 64 blocks per word. A set bit means the block is free,
+// so scans can skip whole words of used blocks and use ctz to find the first
+// free block in a word.
+struct BlockBitmap {
+    vector<uint64_t> words;
+    int nbits;
+
+    explicit BlockBitmap(int n, bool ones = true) : words((n + 63) / 64, ones ? ~0ULL : 0), nbits(n) {
+        if (ones && (n & 63)) words.back() = (1ULL << (n & 63)) - 1;
+    }
+
+    bool test(int i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+    void set(int i)   { words[i >> 6] |= 1ULL << (i & 63); }
+    void clear(int i) { words[i >> 6] &= ~(1ULL << (i & 63)); }
+
+    void clear_range(int start, int len) {
+        while (len > 0) {
+            int off = start & 63;
+            int n = min(len, 64 - off);
+            uint64_t mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << off;
+            words[start >> 6] &= ~mask;
+            start += n;
+            len -= n;
+        }
+    }
 
+    void set_range(int start, int len) {
+        while (len > 0) {
+            int off = start & 63;
+            int n = min(len, 64 - off);
+            uint64_t mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << off;
+            words[start >> 6] |= mask;
+            start += n;
+            len -= n;
+        }
+    }
+
+    int count_free() const {
+        int n = 0;
+        for (uint64_t w : words) n += __builtin_popcountll(w);
+        return n;
+    }
+
+    // First free block in [lo, hi) at or after `from`, wrapping around to
+    // `lo` once. `lo` must be a multiple of 64; hi < 0 means the whole map.
+    int find_free(int from, int lo = 0, int hi = -1) const {
+        if (hi < 0) hi = nbits;
+        int wlo = lo >> 6, whi = (hi + 63) >> 6;
+        int w = from >> 6;
+        uint64_t cur = words[w] & (~0ULL << (from & 63));
+        int k = 0;
+        for (; k <= whi - wlo; ++k) {
+            if (cur) break;
+            w = (w + 1 == whi) ? wlo : w + 1;
+            cur = words[w];
+        }
+        stat_add(CNT_BITMAP_SCANS);
+        stat_add(CNT_BITMAP_WORDS, k + 1);
+        if (!cur) return -1;
+        int b = (w << 6) + __builtin_ctzll(cur);
+        return b < hi ? b : -1;
+    }
+
+    // Number of consecutive free blocks starting at `start`, capped at `max`.
+    int run_length(int start, int max) const {
+        int len = 0;
+        while (len < max && start + len < nbits) {
+            int b = start + len;
+            int avail = 64 - (b & 63);
+            uint64_t used = ~(words[b >> 6] >> (b & 63));
+            int ones = used ? __builtin_ctzll(used) : 64;
+            if (ones > avail) ones = avail;
+            len += ones;
+            if (ones < avail) break;
+        }
+        return min(len, max);
+    }
+};
+
+// Free space is split into shards of consecutive bitmap words, each with its
+// own lock and next-fit cursor. A thread allocates from its home shard and
+// only moves on to the next ones when that is full, so threads allocating at
+// the same time rarely share a lock or a cache line of the bitmap.
+struct AllocShard {
+    mutex mu;
+    int lo, hi;     // blocks [lo, hi)
+    int cursor;
+};
+
+template <class G>
 struct Superblock {
+    static constexpr int NUM_BLOCKS = G::NUM_BLOCKS;
+    static constexpr int SHARDS = 16;
+    static constexpr int SHARD_BLOCKS = (NUM_BLOCKS / SHARDS + 63) / 64 * 64;
     int total_blocks;
-    int free_blocks;
-    vector<bool> block_bitmap;
+    atomic<int> free_blocks;
+    int free_inode_head;
+    BlockBitmap block_bitmap;
+    vector<uint32_t> block_refs;    // inodes referencing each block, updated atomically
+    atomic<long long> logical_blocks;   // sum of block_refs
+    AllocShard shards[SHARDS];
     Superblock()
-        : total_blocks(NUM_BLOCKS), free_blocks(NUM_BLOCKS),
-          block_bitmap(NUM_BLOCKS, true) {}
+        : total_blocks(NUM_BLOCKS), free_blocks(NUM_BLOCKS), free_inode_head(-1),
+          block_bitmap(NUM_BLOCKS), block_refs(NUM_BLOCKS, 0), logical_blocks(0) {
+        for (int i = 0; i < SHARDS; ++i) {
+            shards[i].lo = min(NUM_BLOCKS, i * SHARD_BLOCKS);
+            shards[i].hi = min(NUM_BLOCKS, (i + 1) * SHARD_BLOCKS);
+        }
+        reset_cursors();
+    }
+
+    AllocShard &shard_of(int blk) { return shards[blk / SHARD_BLOCKS]; }
+    void reset_cursors() { for (AllocShard &s : shards) s.cursor = s.lo; }
+};
+
+// Fingerprint index for dedup: maps the fingerprint of a block's contents to
+// the data block holding them. Each block's fingerprint is kept as well (0
+// when the block is not indexed) so that freeing it can drop its entry. An
+// entry is only trusted while its block still has references.
+template <class G>
+struct DedupIndex {
+    static constexpr int SHARDS = 16;
+    struct Shard {
+        mutex mu;
+        unordered_map<uint64_t, int> map;
+    };
+    Shard shards[SHARDS];
+    vector<uint64_t> fp;
+    atomic<bool> on;
+    DedupIndex() : fp(G::NUM_BLOCKS, 0), on(false) {}
+
+    Shard &shard_of(uint64_t h) { return shards[h >> 60]; }
+    void clear() {
+        for (Shard &s : shards) s.map.clear();
+        fill(fp.begin(), fp.end(), 0);
+    }
+};
+
+// A run of `len` consecutive blocks starting at `start`.
+struct Extent {
+    int start;
+    int len;
+};
+
+// Extents that do not fit in the inode are kept in a chain of blocks, each
+// holding a link to the next one and as many records as fit. Like the rest
+// of the image the fields are little-endian:
+//   0 next block, -1 at the end    4 count    8 count x (start, len)
+// An ExtentBlock reads them in place from a block's raw storage.
+template <class G>
+struct ExtentBlock {
+    static constexpr int HEADER = 8, RECORD = 8;
+    static constexpr int CAPACITY = (G::BLOCK_SIZE - HEADER) / RECORD;
+    const char *p;
+
+    explicit operator bool() const { return p; }
+    int next() const { return (int32_t)get_le(p, 4); }
+    int count() const { return (int32_t)get_le(p + 4, 4); }
+    Extent ext(int i) const {
+        uint64_t v = load_le64(p + HEADER + i * RECORD);
+        return {(int32_t)v, (int32_t)(v >> 32)};
+    }
+
+    static void put(char *dst, int next, const Extent *ext, int count) {
+        put_le(dst, (uint32_t)next, 4);
+        put_le(dst + 4, (uint32_t)count, 4);
+        for (int i = 0; i < count; ++i)
+            store_le64(dst + HEADER + i * RECORD, (uint32_t)ext[i].start | (uint64_t)(uint32_t)ext[i].len << 32);
+    }
 };
 
 struct Inode {
     bool used;
-    int size;
+    int64_t size;
     time_t ctime;          
-    int direct[DIRECT_PTRS];
-    int indirect;          
+    Extent ext[INLINE_EXTENTS];
+    int nextents;
+    int ext_block;         // first overflow extent block, -1 if none
     bool is_directory;
-    Inode() : used(false), size(0), ctime(0), indirect(-1), is_directory(false) {
-        memset(direct, -1, sizeof(direct));
+    uint32_t gen;          // bumped every time the slot is freed
+    int next_free;         // free-list link while unused
+    Inode() : used(false), size(0), ctime(0), nextents(0), ext_block(-1), is_directory(false),
+              gen(0), next_free(-1) {
+        memset(ext, -1, sizeof(ext));
     }
 };
 
-struct DirEntry {
-    string name;
-    int inode_idx;
+// On-disk inode record, INODE_RECORD bytes:
+//   0 flags (1 used, 2 directory)   4 gen       8 size     16 ctime
+//  24 nextents   28 ext_block   32 ext[4] as (start, len) pairs
+// The free-list link is not stored; it is rebuilt on load.
+static const int INODE_RECORD = 64;
+static_assert(32 + INLINE_EXTENTS * 8 <= INODE_RECORD, "inode record too small");
+
+inline void encode_inode(const Inode &ino, char *p) {
+    memset(p, 0, INODE_RECORD);
+    p[0] = (ino.used ? 1 : 0) | (ino.is_directory ? 2 : 0);
+    put_le(p + 4, ino.gen, 4);
+    put_le(p + 8, ino.size, 8);
+    put_le(p + 16, ino.ctime, 8);
+    put_le(p + 24, ino.nextents, 4);
+    put_le(p + 28, ino.ext_block, 4);
+    for (int i = 0; i < INLINE_EXTENTS; ++i) {
+        put_le(p + 32 + 8 * i, ino.ext[i].start, 4);
+        put_le(p + 36 + 8 * i, ino.ext[i].len, 4);
+    }
+}
+
+inline void decode_inode(const char *p, Inode &ino) {
+    ino.used = p[0] & 1;
+    ino.is_directory = p[0] & 2;
+    ino.gen = get_le(p + 4, 4);
+    ino.size = get_le(p + 8, 8);
+    ino.ctime = (int64_t)get_le(p + 16, 8);
+    ino.nextents = (int32_t)get_le(p + 24, 4);
+    ino.ext_block = (int32_t)get_le(p + 28, 4);
+    for (int i = 0; i < INLINE_EXTENTS; ++i) {
+        ino.ext[i].start = (int32_t)get_le(p + 32 + 8 * i, 4);
+        ino.ext[i].len = (int32_t)get_le(p + 36 + 8 * i, 4);
+    }
+    ino.next_free = -1;
+}
+
+// Identifies one incarnation of an inode. A handle goes stale as soon as the
+// slot is freed, even if it is reused right away.
+struct InodeHandle {
+    int idx;
+    uint32_t gen;
+};
+
+// Inodes live in fixed-size chunks that are allocated as the table grows, so
+// a large G::MAX_INODES costs nothing up front and Inode references stay valid
+// when new slots are added. grow() must be serialised by the caller; readers
+// of existing slots need no lock on the table itself.
+template <class G>
+class InodeTable {
+    static constexpr int CHUNK = 4096;
+    static constexpr int MAX_INODES = G::MAX_INODES;
+    vector<unique_ptr<Inode[]>> chunks;
+    atomic<int> count;
+
+public:
+    InodeTable() : chunks((MAX_INODES + CHUNK - 1) / CHUNK), count(0) {}
+
+    Inode &operator[](int i) { return chunks[i / CHUNK][i % CHUNK]; }
+    const Inode &operator[](int i) const { return chunks[i / CHUNK][i % CHUNK]; }
+    int size() const { return count; }
+
+    int grow() {
+        if (count == MAX_INODES) return -1;
+        if (!chunks[count / CHUNK]) chunks[count / CHUNK].reset(new Inode[CHUNK]);
+        return count++;
+    }
+
+    void resize(int n) {
+        for (int i = 0; i < n; i += CHUNK)
+            if (!chunks[i / CHUNK]) chunks[i / CHUNK].reset(new Inode[CHUNK]);
+        for (int i = n; i < count; ++i) (*this)[i] = Inode();
+        count = n;
+    }
+};
+
+// The whole block device as one mapping. Blocks are addressed by offset, so
+// consecutive block numbers are consecutive bytes. Until a volume file is
+// attached the mapping is anonymous; afterwards it maps the data region of the
+// image directly and the kernel pages blocks in on first access. Writers go
+// through write_at(), which records the block as dirty so sync() only flushes
+// the ranges that changed. Dirty bits are set atomically, so any thread may
+// write blocks while another one syncs.
+//
+// Over a volume file the mapping doubles as a buffer cache with a fixed
+// budget. Every access goes through read_at() or write_at(), which track
+// which FRAME-sized pieces are in memory. Past the budget, CLOCK picks
+// frames to drop: frames used since the hand last passed get a second
+// chance. A dropped frame is written back first if it is dirty. Then it is
+// unmapped and released from the page cache, and its next access reads it
+// from the file again. Pointers stay valid throughout, because a frame that
+// is in use while it is dropped just faults back in. Dirty bits are only
+// cleared by sync(), so write-back never hides a block from a checkpoint.
+// readahead() starts reading frames ahead of a sequential reader. A
+// volume without a file has nowhere to write frames back to, so it keeps
+// every frame.
+template <class G>
+class BlockArena {
+    static constexpr int BLOCK_SHIFT = G::BLOCK_SHIFT;
+    static constexpr size_t FRAME = 64 << 10;
+    static_assert(FRAME % G::BLOCK_SIZE == 0 && (FRAME >> BLOCK_SHIFT) <= 64,
+                  "a frame's blocks must share one word of the dirty map");
+    enum { F_RESIDENT = 1, F_REF = 2 };
+
+    char *base;
+    size_t bytes;
+    bool file_backed;
+    int fd;
+    off_t file_off;
+    BlockBitmap dirty;
+    mutex sync_mu;
+    vector<uint8_t> frames;         // F_ bits, updated atomically
+    atomic<size_t> resident;
+    size_t budget;                  // frames
+    size_t hand;
+    mutex evict_mu;                 // hand
+
+    // Second-chance CLOCK until the resident frames fit the budget again.
+    void evict() {
+        lock_guard<mutex> g(evict_mu);
+        size_t nf = frames.size();
+        for (size_t k = 0; resident > budget && k < 2 * nf; ++k) {
+            size_t f = hand;
+            hand = hand + 1 == nf ? 0 : hand + 1;
+            uint8_t s = __atomic_load_n(&frames[f], __ATOMIC_RELAXED);
+            if (!(s & F_RESIDENT)) continue;
+            if (s & F_REF) {
+                __atomic_fetch_and(&frames[f], (uint8_t)~F_REF, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (!__atomic_compare_exchange_n(&frames[f], &s, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                continue;
+            --resident;
+            size_t lo = f * FRAME, len = min(FRAME, bytes - lo), blk = lo >> BLOCK_SHIFT;
+            uint64_t mask = len >> BLOCK_SHIFT == 64 ? ~0ULL : ((1ULL << (len >> BLOCK_SHIFT)) - 1) << (blk & 63);
+            if (__atomic_load_n(&dirty.words[blk >> 6], __ATOMIC_RELAXED) & mask) {
+                msync(base + lo, len, MS_SYNC);
+                stat_add(CNT_BUFFER_WRITEBACKS);
+            }
+            madvise(base + lo, len, MADV_DONTNEED);
+            posix_fadvise(fd, file_off + lo, len, POSIX_FADV_DONTNEED);
+            stat_add(CNT_BUFFER_EVICTIONS);
+        }
+    }
+
+    void touch(size_t off, size_t n) {
+        size_t last = min((off + n - 1) / FRAME, frames.size() - 1);
+        for (size_t f = off / FRAME; f <= last; ++f) {
+            uint8_t s = __atomic_load_n(&frames[f], __ATOMIC_RELAXED);
+            if (s & F_RESIDENT) {
+                if (!(s & F_REF)) __atomic_fetch_or(&frames[f], F_REF, __ATOMIC_RELAXED);
+                stat_add(CNT_BUFFER_HITS);
+            } else if (__atomic_fetch_or(&frames[f], F_RESIDENT | F_REF, __ATOMIC_RELAXED) & F_RESIDENT) {
+                stat_add(CNT_BUFFER_HITS);
+            } else {
+                stat_add(CNT_BUFFER_MISSES);
+                if (++resident > budget && file_backed) evict();
+            }
+        }
+    }
+
+public:
+    explicit BlockArena(int nblocks)
+        : base(nullptr), bytes((size_t)nblocks << BLOCK_SHIFT), file_backed(false), fd(-1),
+          file_off(0), dirty(nblocks, false), frames((bytes + FRAME - 1) / FRAME, 0), resident(0),
+          budget(SIZE_MAX), hand(0) {
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (p == MAP_FAILED) throw bad_alloc();
+#ifdef MADV_HUGEPAGE
+            madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+        }
+        base = static_cast<char*>(p);
+    }
+
+    ~BlockArena() { munmap(base, bytes); }
+
+    BlockArena(const BlockArena&) = delete;
+    BlockArena &operator=(const BlockArena&) = delete;
+
+    // Replaces the current contents with the data region of `fd` at `off`.
+    bool attach(int fd_, off_t off) {
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, off);
+        if (p == MAP_FAILED) return false;
+        munmap(base, bytes);
+        base = static_cast<char*>(p);
+        file_backed = true;
+        fd = fd_;
+        file_off = off;
+        dirty.clear_range(0, dirty.nbits);
+        fill(frames.begin(), frames.end(), 0);
+        resident = 0;
+        return true;
+    }
+
+    // Memory the buffer cache may use once a volume file is attached.
+    void set_budget(size_t budget_bytes) { budget = max<size_t>(4, budget_bytes / FRAME); }
+
+    // Bytes [off, off + n) for reading.
+    const char *read_at(size_t off, size_t n) {
+        touch(off, n);
+        return base + off;
+    }
+
+    // Bytes [off, off + n) for writing; marks the blocks they touch dirty.
+    char *write_at(size_t off, size_t n) {
+        touch(off, n);
+        for (size_t blk = off >> BLOCK_SHIFT; blk <= (off + n - 1) >> BLOCK_SHIFT; ++blk)
+            __atomic_fetch_or(&dirty.words[blk >> 6], 1ULL << (blk & 63), __ATOMIC_RELAXED);
+        return base + off;
+    }
+
+    // Starts reading the frames of [off, off + n) that are not in memory;
+    // they count as used once read_at() gets to them.
+    void readahead(size_t off, size_t n) {
+        if (!file_backed || n == 0) return;
+        size_t run = 0, added = 0, start = 0, last = (off + n - 1) / FRAME;
+        for (size_t f = off / FRAME; f <= last + 1; ++f) {
+            if (f <= last && !(__atomic_fetch_or(&frames[f], F_RESIDENT, __ATOMIC_RELAXED) & F_RESIDENT)) {
+                if (!run++) start = f * FRAME;
+                continue;
+            }
+            if (run) madvise(base + start, min(run * FRAME, bytes - start), MADV_WILLNEED);
+            added += run;
+            run = 0;
+        }
+        if (!added) return;
+        stat_add(CNT_BUFFER_READAHEAD, added);
+        if ((resident += added) > budget) evict();
+    }
+
+    // msyncs every run of dirty blocks, widened to page boundaries. Runs
+    // less than SYNC_GAP apart go out as one call; clean pages in between
+    // cost far less than a syscall each.
+    void sync() {
+        if (!file_backed) return;
+        lock_guard<mutex> g(sync_mu);
+        const size_t page = sysconf(_SC_PAGESIZE);
+        const size_t SYNC_GAP = 64 << 10;
+        size_t nw = dirty.words.size();
+        BlockBitmap todo(dirty.nbits, false);
+        for (size_t w = 0; w < nw; ++w)
+            todo.words[w] = __atomic_exchange_n(&dirty.words[w], 0, __ATOMIC_ACQ_REL);
+        size_t run_lo = 0, run_hi = 0;
+        for (size_t w = 0; w < nw; ++w) {
+            while (todo.words[w]) {
+                int start = (w << 6) + __builtin_ctzll(todo.words[w]);
+                int end = start;
+                while (end < todo.nbits && todo.test(end)) ++end;
+                todo.clear_range(start, end - start);
+                size_t lo = ((size_t)start << BLOCK_SHIFT) / page * page;
+                size_t hi = min(bytes, (size_t)end << BLOCK_SHIFT);
+                if (run_hi > run_lo && lo > run_hi + SYNC_GAP) {
+                    msync(base + run_lo, run_hi - run_lo, MS_SYNC);
+                    run_lo = lo;
+                } else if (run_hi == run_lo) {
+                    run_lo = lo;
+                }
+                run_hi = hi;
+                w = (end - 1) >> 6;
+            }
+        }
+        if (run_hi > run_lo) msync(base + run_lo, run_hi - run_lo, MS_SYNC);
+    }
+
+    char *data() const { return base; }
+    size_t size() const { return bytes; }
+    bool is_file_backed() const { return file_backed; }
+    size_t resident_bytes() const { return min(resident.load(), frames.size()) * FRAME; }
+    size_t budget_bytes() const { return file_backed ? min(budget, frames.size()) * FRAME : bytes; }
+};
+
+// Block codec. A data block is stored in the first of these forms that
+// applies:
+//   BM_ZERO     nothing at all: the block is zeros
+//   BM_LETTERS  u16 count - 1, then that many capital letters at 5 bits each,
+//               eight to five bytes; the rest of the block is zeros. This is
+//               what createFile writes; LZ finds nothing to gain in it.
+//   BM_LZ       u16 length, then LZ77 sequences in the LZ4 layout: a token
+//               with 4-bit literal and match lengths (15 continues in bytes
+//               of up to 255), the literals, a u16 offset back into the block
+//               and the match; the last sequence has literals only
+//   BM_RAW      the block as is, when LZ saves less than a granule
+enum BlockMode { BM_ZERO, BM_RAW, BM_LZ, BM_LETTERS };
+
+// Compresses n bytes into dst; returns the size, or 0 if more than `cap`
+// bytes would be needed or nothing repeats early on. Like LZ4 the search
+// skips ahead faster the longer it finds nothing, so incompressible input
+// costs little.
+inline size_t lz_compress(const char *src, size_t n, char *dst, size_t cap) {
+    const int HASH_BITS = 10, MIN_MATCH = 4, LAST_LITERALS = 5;
+    uint16_t table[1 << HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+    auto load32 = [&](size_t i) { uint32_t v; memcpy(&v, src + i, 4); return v; };
+    size_t op = 0, anchor = 0;
+    auto emit = [&](size_t lit, size_t off, size_t match) {
+        size_t need = 1 + lit / 255 + 1 + lit + (match ? 2 + match / 255 + 1 : 0);
+        if (op + need > cap) return false;
+        char *tok = dst + op++;
+        *tok = (char)(min<size_t>(lit, 15) << 4);
+        if (lit >= 15) {
+            size_t l = lit - 15;
+            for (; l >= 255; l -= 255) dst[op++] = (char)255;
+            dst[op++] = (char)l;
+        }
+        memcpy(dst + op, src + anchor, lit);
+        op += lit;
+        if (!match) return true;
+        put_le(dst + op, off, 2);
+        op += 2;
+        size_t m = match - MIN_MATCH;
+        *tok |= (char)min<size_t>(m, 15);
+        if (m >= 15) {
+            for (m -= 15; m >= 255; m -= 255) dst[op++] = (char)255;
+            dst[op++] = (char)m;
+        }
+        return true;
+    };
+    size_t ip = 0, misses = 0;
+    while (ip + MIN_MATCH + LAST_LITERALS <= n) {
+        uint32_t v = load32(ip);
+        uint32_t h = (v * 2654435761u) >> (32 - HASH_BITS);
+        size_t cand = table[h];
+        table[h] = (uint16_t)ip;
+        if (cand == 0xFFFF || load32(cand) != v) {
+            // Nothing repeats in the first quarter: most likely nothing will.
+            if (anchor == 0 && ip > n / 4) return 0;
+            ip += 1 + (misses++ >> 4);
+            continue;
+        }
+        size_t len = MIN_MATCH;
+        while (ip + len < n - LAST_LITERALS && src[cand + len] == src[ip + len]) ++len;
+        if (!emit(ip - anchor, ip - cand, len)) return 0;
+        ip += len;
+        anchor = ip;
+        misses = 0;
+    }
+    if (!emit(n - anchor, 0, 0)) return 0;
+    return op;
+}
+
+// Decodes exactly n bytes; false if the input is malformed.
+inline bool lz_decompress(const char *src, size_t len, char *dst, size_t n) {
+    size_t ip = 0, op = 0;
+    auto more = [&](size_t &v) {
+        unsigned char b;
+        do {
+            if (ip >= len) return false;
+            b = src[ip++];
+            v += b;
+        } while (b == 255);
+        return true;
+    };
+    while (ip < len) {
+        unsigned char tok = src[ip++];
+        size_t lit = tok >> 4, match = (tok & 15) + 4;
+        if (lit == 15 && !more(lit)) return false;
+        if (lit > len - ip || lit > n - op) return false;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == len) break;
+        if (len - ip < 2) return false;
+        size_t off = get_le(src + ip, 2);
+        ip += 2;
+        if (match == 19 && !more(match)) return false;
+        if (off == 0 || off > op || match > n - op) return false;
+        char *d = dst + op;
+        if (off >= match) memcpy(d, d - off, match);
+        else for (size_t i = 0; i < match; ++i) d[i] = d[i - off];
+        op += match;
+    }
+    return op == n;
+}
+
+// Length of the run of capital letters the block starts with if only zeros
+// follow it, else -1.
+inline int letters_prefix(const char *p, int n) {
+    const uint64_t HI = 0x8080808080808080ULL;
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        uint64_t x = load_le64(p + k);
+        uint64_t ge_a = x + 0x3F3F3F3F3F3F3F3FULL, ge_z1 = x + 0x2525252525252525ULL;
+        if ((x & HI) || (ge_a & ~ge_z1 & HI) != HI) break;
+    }
+    while (k < n && (unsigned char)(p[k] - 'A') < 26) ++k;
+    for (int i = k; i < n; ++i)
+        if (p[i]) return -1;
+    return k;
+}
+
+// Eight letters to five bytes: bits 0..4 of each byte, gathered. With BMI2
+// that is one pext (and one pdep back); otherwise shifts and masks. `dst`
+// needs room for three bytes past the packed size.
+inline uint64_t pack8(uint64_t x) {
+    x -= 0x4141414141414141ULL;
+#ifdef __BMI2__
+    return _pext_u64(x, 0x1F1F1F1F1F1F1F1FULL);
+#else
+    return (x & 0x1F) | (x >> 3 & 0x3E0) | (x >> 6 & 0x7C00) | (x >> 9 & 0xF8000) |
+           (x >> 12 & 0x1F00000) | (x >> 15 & 0x3E000000) | (x >> 18 & 0x7C0000000ULL) |
+           (x >> 21 & 0xF800000000ULL);
+#endif
+}
+
+inline size_t pack_letters(const char *src, int k, char *dst) {
+    put_le(dst, k - 1, 2);
+    char *o = dst + 2;
+    int i = 0;
+    for (; i + 8 <= k; i += 8, o += 5) store_le64(o, pack8(load_le64(src + i)));
+    if (i < k) {
+        char tail[8] = {'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A'};
+        memcpy(tail, src + i, k - i);
+        store_le64(o, pack8(load_le64(tail)));
+    }
+    return 2 + (5 * (size_t)k + 7) / 8;
+}
+
+inline bool unpack_letters(const char *src, size_t len, char *dst, int n) {
+    if (len < 2) return false;
+    int k = get_le(src, 2) + 1;
+    if (k > n || len < 2 + (5 * (size_t)k + 7) / 8) return false;
+    const char *in = src + 2;
+    int i = 0;
+    for (; i + 8 <= k; i += 8, in += 5) {
+        uint64_t v = in + 8 <= src + len ? load_le64(in) : get_le(in, 5);
+#ifdef __BMI2__
+        uint64_t x = _pdep_u64(v, 0x1F1F1F1F1F1F1F1FULL);
+#else
+        uint64_t x = (v & 0x1F) | (v << 3 & 0x1F00) | (v << 6 & 0x1F0000) | (v << 9 & 0x1F000000) |
+                     (v << 12 & 0x1F00000000ULL) | (v << 15 & 0x1F0000000000ULL) |
+                     (v << 18 & 0x1F000000000000ULL) | (v << 21 & 0x1F00000000000000ULL);
+#endif
+        store_le64(dst + i, x + 0x4141414141414141ULL);
+    }
+    uint64_t v = get_le(in, (5 * (k - i) + 7) / 8);
+    for (; i < k; ++i, v >>= 5) dst[i] = (char)('A' + (v & 0x1F));
+    memset(dst + k, 0, n - k);
+    return true;
+}
+
+// A small set-associative cache of decoded blocks with a CLOCK bit per way,
+// so repeated reads of hot blocks skip the decoder. Entries are copied in
+// and out under the set's lock. It holds 1MB whatever the block size.
+template <class G>
+class BlockCache {
+    static constexpr int BLOCK_SIZE = G::BLOCK_SIZE;
+    static constexpr int WAYS = 4, SETS = max(1, (1 << 20) / (WAYS * BLOCK_SIZE));
+    struct Set {
+        mutex mu;
+        int tag[WAYS];
+        bool ref[WAYS];
+        int hand = 0;
+        char data[WAYS][BLOCK_SIZE];
+        Set() { fill(tag, tag + WAYS, -1); fill(ref, ref + WAYS, false); }
+    };
+    unique_ptr<Set[]> sets;
+
+public:
+    BlockCache() : sets(new Set[SETS]) {}
+
+    bool get(int b, char *dst) {
+        Set &s = sets[b & (SETS - 1)];
+        lock_guard<mutex> g(s.mu);
+        for (int w = 0; w < WAYS; ++w)
+            if (s.tag[w] == b) {
+                s.ref[w] = true;
+                memcpy(dst, s.data[w], BLOCK_SIZE);
+                return true;
+            }
+        return false;
+    }
+
+    void put(int b, const char *src) {
+        Set &s = sets[b & (SETS - 1)];
+        lock_guard<mutex> g(s.mu);
+        while (s.ref[s.hand]) {
+            s.ref[s.hand] = false;
+            s.hand = (s.hand + 1) % WAYS;
+        }
+        s.tag[s.hand] = b;
+        memcpy(s.data[s.hand], src, BLOCK_SIZE);
+        s.hand = (s.hand + 1) % WAYS;
+    }
+
+    void erase(int b) {
+        Set &s = sets[b & (SETS - 1)];
+        lock_guard<mutex> g(s.mu);
+        for (int w = 0; w < WAYS; ++w)
+            if (s.tag[w] == b) s.tag[w] = -1, s.ref[w] = false;
+    }
+
+    void clear() {
+        for (int i = 0; i < SETS; ++i) {
+            lock_guard<mutex> g(sets[i].mu);
+            fill(sets[i].tag, sets[i].tag + WAYS, -1);
+        }
+    }
+};
+
+// Logical blocks stored compressed, packed into GRANULE-sized pieces of the
+// arena. Each block's map entry holds its mode, first granule and granule
+// count; a block that was never written, or is all zeros, has entry 0 and
+// no storage, so the volume holds OVERCOMMIT times more logical blocks than
+// the arena holds raw ones. Granules are allocated next-fit from shards, as
+// blocks are. Extent blocks are kept raw so they can be updated in place
+// through raw(). A block's storage only changes while it is allocated for
+// the first time or freed, or while defrag moves it with every reader held
+// off, so reads of a block someone references need no lock.
+template <class G>
+class BlockStore {
+    static constexpr int BLOCK_SIZE = G::BLOCK_SIZE, NUM_BLOCKS = G::NUM_BLOCKS;
+    static constexpr int GRANULE = G::GRANULE, NUM_GRANULES = G::NUM_GRANULES;
+    static constexpr int COUNT_SHIFT = G::GRANULE_BITS, MODE_SHIFT = COUNT_SHIFT + 6;
+    static constexpr int SHARDS = 16;
+    static constexpr int SHARD_GRANULES = NUM_GRANULES / SHARDS;
+    BlockArena<G> arena;
+    vector<uint32_t> map;
+    BlockBitmap granules;           // 1 = free
+    BlockBitmap freed_pages;        // pages with granules freed since take_free_pages
+    AllocShard shards[SHARDS];
+    BlockCache<G> cache;
+    atomic<long long> used;         // granules in use
+    mutex retired_mu;
+    vector<pair<int, int>> retired; // (first, count) left by compact() or drop()
+    mutex pin_mu;
+    atomic<int> pins;               // see pin()
+    vector<pair<int, int>> held;    // granules released while pinned
+
+    static uint32_t entry(int mode, int g, int count) {
+        return (uint32_t)mode << MODE_SHIFT | (uint32_t)(count - 1) << COUNT_SHIFT | g;
+    }
+
+    // First run of `count` free granules in [lo, hi), or -1.
+    int scan(int lo, int hi, int count) const {
+        for (int g = lo; g + count <= hi; ) {
+            uint64_t w = granules.words[g >> 6] >> (g & 63);
+            if (!w) { g = (g | 63) + 1; continue; }
+            g += __builtin_ctzll(w);
+            if (g + count > hi) break;
+            int len = granules.run_length(g, count);
+            if (len >= count) return g;
+            g += len;
+        }
+        return -1;
+    }
+
+    int alloc(int count) {
+        static atomic<int> next(0);
+        static thread_local int home = next++ % SHARDS;
+        for (int k = 0; k < SHARDS; ++k) {
+            AllocShard &sh = shards[(home + k) % SHARDS];
+            lock_guard<mutex> g(sh.mu);
+            int at = scan(sh.cursor, sh.hi, count);
+            if (at < 0) at = scan(sh.lo, min(sh.hi, sh.cursor + count - 1), count);
+            if (at < 0) continue;
+            granules.clear_range(at, count);
+            sh.cursor = at + count == sh.hi ? sh.lo : at + count;
+            home = (home + k) % SHARDS;
+            used += count;
+            return at;
+        }
+        return -1;
+    }
+
+    // Takes granules [g, g + count) if they are all free. The run may cross
+    // into the next shards; their locks are taken in order.
+    bool take(int g, int count) {
+        if (g < 0 || count <= 0 || g + count > NUM_GRANULES) return false;
+        int lo = g / SHARD_GRANULES, hi = (g + count - 1) / SHARD_GRANULES;
+        unique_lock<mutex> l[SHARDS];
+        for (int i = lo; i <= hi; ++i) l[i] = unique_lock<mutex>(shards[i].mu);
+        if (granules.run_length(g, count) < count) return false;
+        granules.clear_range(g, count);
+        used += count;
+        return true;
+    }
+
+    void release(int g, int count) {
+        if (pins) {
+            lock_guard<mutex> l(pin_mu);
+            if (pins) {
+                held.emplace_back(g, count);
+                return;
+            }
+        }
+        {
+            lock_guard<mutex> l(shards[g / SHARD_GRANULES].mu);
+            for (int i = 0; i < count; ++i) granules.set(g + i);
+        }
+        for (int p = g / 64; p <= (g + count - 1) / 64; ++p)
+            __atomic_fetch_or(&freed_pages.words[p >> 6], 1ULL << (p & 63), __ATOMIC_RELAXED);
+        used -= count;
+    }
+
+    const char *at(uint32_t e) { return arena.read_at((size_t)first_of(e) * GRANULE, (size_t)count_of(e) * GRANULE); }
+
+public:
+    BlockStore()
+        : arena(G::FS_SIZE >> G::BLOCK_SHIFT), map(NUM_BLOCKS, 0), granules(NUM_GRANULES),
+          freed_pages(NUM_GRANULES / 64, false), used(0), pins(0) {
+        for (int i = 0; i < SHARDS; ++i) {
+            shards[i].lo = shards[i].cursor = i * SHARD_GRANULES;
+            shards[i].hi = (i + 1) * SHARD_GRANULES;
+        }
+    }
+
+    // Bytes of arena covered by one word of the granule bitmap, the unit
+    // take_free_pages() reports in.
+    static constexpr int PAGE_BYTES = 64 * GRANULE;
+
+    static int mode_of(uint32_t e) { return e >> MODE_SHIFT; }
+    static int first_of(uint32_t e) { return e & (NUM_GRANULES - 1); }
+    static int count_of(uint32_t e) { return e ? ((e >> COUNT_SHIFT) & 63) + 1 : 0; }
+
+    // Stores the contents of block b, which has no storage yet. False if the
+    // arena has no room left for it.
+    bool put(int b, const char *src) {
+        char buf[BLOCK_SIZE + 8];
+        int k = letters_prefix(src, BLOCK_SIZE);
+        if (k == 0) return true;
+        int mode = BM_RAW;
+        size_t len = BLOCK_SIZE;
+        if (k > 0) {
+            len = pack_letters(src, k, buf);
+            mode = BM_LETTERS;
+        } else if (size_t lz = lz_compress(src, BLOCK_SIZE, buf + 2, BLOCK_SIZE - GRANULE - 2)) {
+            len = lz + 2;
+            mode = BM_LZ;
+            put_le(buf, lz, 2);
+        }
+        int count = mode == BM_RAW ? BLOCK_SIZE / GRANULE : (int)(len + GRANULE - 1) / GRANULE;
+        int g = alloc(count);
+        if (g < 0) return false;
+        char *dst = arena.write_at((size_t)g * GRANULE, (size_t)count * GRANULE);
+        memcpy(dst, mode == BM_RAW ? src : buf, mode == BM_RAW ? BLOCK_SIZE : len);
+        __atomic_store_n(&map[b], entry(mode, g, count), __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Gives block b raw storage, zeroed, and returns it for writing in place.
+    char *put_raw(int b) {
+        int count = BLOCK_SIZE / GRANULE;
+        int g = alloc(count);
+        if (g < 0) return nullptr;
+        char *dst = arena.write_at((size_t)g * GRANULE, BLOCK_SIZE);
+        memset(dst, 0, BLOCK_SIZE);
+        __atomic_store_n(&map[b], entry(BM_RAW, g, count), __ATOMIC_RELEASE);
+        return dst;
+    }
+
+    // The bytes of a raw block, or nullptr if b is stored some other way.
+    const char *raw(int b) {
+        uint32_t e = __atomic_load_n(&map[b], __ATOMIC_ACQUIRE);
+        return mode_of(e) == BM_RAW ? at(e) : nullptr;
+    }
+
+    // While the store is pinned, granules are held back instead of being
+    // released, so pointers into the arena that raw() handed out stay valid
+    // after the blocks' owners let go. The last unpin() releases them.
+    void pin() {
+        lock_guard<mutex> l(pin_mu);
+        ++pins;
+    }
+
+    void unpin() {
+        vector<pair<int, int>> out;
+        {
+            lock_guard<mutex> l(pin_mu);
+            if (--pins == 0) out.swap(held);
+        }
+        for (const pair<int, int> &x : out) release(x.first, x.second);
+    }
+
+    // Decodes block b into dst; false if its stored form is damaged.
+    bool read(int b, char *dst) {
+        uint32_t e = __atomic_load_n(&map[b], __ATOMIC_ACQUIRE);
+        const char *p = e ? at(e) : nullptr;
+        size_t stored = (size_t)count_of(e) * GRANULE;
+        switch (mode_of(e)) {
+        case BM_ZERO:
+            memset(dst, 0, BLOCK_SIZE);
+            return true;
+        case BM_RAW:
+            memcpy(dst, p, BLOCK_SIZE);
+            return true;
+        case BM_LZ: {
+            size_t len = get_le(p, 2);
+            return len + 2 <= stored && lz_decompress(p + 2, len, dst, BLOCK_SIZE);
+        }
+        case BM_LETTERS:
+            return unpack_letters(p, stored, dst, BLOCK_SIZE);
+        }
+        return false;
+    }
+
+    // read() through the cache of decoded blocks.
+    bool fetch(int b, char *dst) {
+        if (cache.get(b, dst)) {
+            stat_add(CNT_BLOCK_CACHE_HITS);
+            return true;
+        }
+        stat_add(CNT_BLOCK_CACHE_MISSES);
+        uint32_t e = __atomic_load_n(&map[b], __ATOMIC_ACQUIRE);
+        if (!read(b, dst)) return false;
+        if (mode_of(e) == BM_LZ || mode_of(e) == BM_LETTERS) cache.put(b, dst);
+        return true;
+    }
+
+    // Hands the storage of block `from` to block `to`, which has none; the
+    // stored bytes stay where they are.
+    void move_entry(int from, int to) {
+        uint32_t e = __atomic_exchange_n(&map[from], 0, __ATOMIC_ACQ_REL);
+        cache.erase(from);
+        __atomic_store_n(&map[to], e, __ATOMIC_RELEASE);
+    }
+
+    // Claims `count` free granules for compact(): [g, g + count) if g >= 0
+    // and those are free, otherwise wherever a run is long enough. Returns
+    // the first, or -1. unclaim() hands back a claim compact() did not use.
+    int claim(int g, int count) { return g >= 0 ? (take(g, count) ? g : -1) : alloc(count); }
+    void unclaim(int g, int count) { release(g, count); }
+
+    // Copies the stored forms of `blocks`, in order, into the granules
+    // claimed at g. Returns the granule after them. The granules the blocks
+    // leave are retired rather than freed, since the image the last commit
+    // describes still points at them. The caller holds off readers.
+    int compact(const int *blocks, int n, int g) {
+        for (int i = 0; i < n; ++i) {
+            uint32_t e = get_entry(blocks[i]);
+            if (!e) continue;
+            size_t len = (size_t)count_of(e) * GRANULE;
+            memcpy(arena.write_at((size_t)g * GRANULE, len), at(e), len);
+            __atomic_store_n(&map[blocks[i]], entry(mode_of(e), g, count_of(e)), __ATOMIC_RELEASE);
+            retire(first_of(e), count_of(e));
+            g += count_of(e);
+        }
+        return g;
+    }
+
+    // Granules retired since the last call; release_retired() frees them
+    // once a commit no longer refers to them.
+    vector<pair<int, int>> take_retired() {
+        lock_guard<mutex> l(retired_mu);
+        vector<pair<int, int>> out;
+        out.swap(retired);
+        return out;
+    }
+
+    void release_retired(const vector<pair<int, int>> &r) {
+        for (const pair<int, int> &x : r) release(x.first, x.second);
+    }
+
+    // Granules a block no longer uses. With an image behind the arena they
+    // are retired: the last commit may still map them, and writing over them
+    // before the change is committed would lose the old contents in a crash.
+    void retire(int g, int count) {
+        if (!arena.is_file_backed()) return release(g, count);
+        lock_guard<mutex> l(retired_mu);
+        retired.emplace_back(g, count);
+    }
+
+    // Releases the storage of block b; it reads as zeros afterwards.
+    void drop(int b) {
+        uint32_t e = __atomic_exchange_n(&map[b], 0, __ATOMIC_ACQ_REL);
+        if (!e) return;
+        cache.erase(b);
+        retire(first_of(e), count_of(e));
+    }
+
+    // CRC32C of the stored form of block b; 0 for a block without storage.
+    uint32_t crc(int b) {
+        uint32_t e = __atomic_load_n(&map[b], __ATOMIC_ACQUIRE);
+        return e ? crc32c(at(e), (size_t)count_of(e) * GRANULE) : 0;
+    }
+
+    uint32_t get_entry(int b) const { return __atomic_load_n(&map[b], __ATOMIC_ACQUIRE); }
+    void set_entry(int b, uint32_t e) { map[b] = e; }
+
+    // Recomputes the free granules from the map, after it was loaded or
+    // replayed. Entries that overlap or run past the arena are left to fsck.
+    void rebuild() {
+        granules = BlockBitmap(NUM_GRANULES);
+        long long n = 0;
+        for (uint32_t e : map) {
+            if (!e || first_of(e) + count_of(e) > NUM_GRANULES) continue;
+            granules.clear_range(first_of(e), count_of(e));
+            n += count_of(e);
+        }
+        used = n;
+        for (AllocShard &sh : shards) sh.cursor = sh.lo;
+        cache.clear();
+        take_retired();
+    }
+
+    // Pages of the arena whose granules are all free again, collected since
+    // the last call; the caller holds off writers.
+    vector<int> take_free_pages() {
+        vector<int> out;
+        for (size_t w = 0; w < freed_pages.words.size(); ++w)
+            for (uint64_t bits = __atomic_exchange_n(&freed_pages.words[w], 0, __ATOMIC_ACQ_REL); bits; bits &= bits - 1) {
+                int p = (w << 6) + __builtin_ctzll(bits);
+                if (granules.words[p] == ~0ULL) out.push_back(p);
+            }
+        return out;
+    }
+
+    bool attach(int fd, off_t off) {
+        if (!arena.attach(fd, off)) return false;
+        fill(map.begin(), map.end(), 0);
+        rebuild();
+        return true;
+    }
+
+    // Starts reading the stored forms of blocks [b, b + n) ahead of use,
+    // in as few ranges as their granules allow.
+    void readahead(int b, int n) {
+        if (!arena.is_file_backed()) return;
+        size_t lo = 0, hi = 0;
+        for (int i = b; i < b + n; ++i) {
+            uint32_t e = get_entry(i);
+            if (!e) continue;
+            size_t s = (size_t)first_of(e) * GRANULE, t = s + (size_t)count_of(e) * GRANULE;
+            if (hi > lo && (s < lo || s > hi + PAGE_BYTES)) {
+                arena.readahead(lo, hi - lo);
+                hi = lo;
+            }
+            if (hi == lo) lo = s;
+            hi = max(hi, t);
+        }
+        if (hi > lo) arena.readahead(lo, hi - lo);
+    }
+
+    void set_cache_budget(size_t bytes) { arena.set_budget(bytes); }
+    size_t cache_resident() const { return arena.resident_bytes(); }
+    size_t cache_budget() const { return arena.budget_bytes(); }
+
+    void sync() { arena.sync(); }
+    long long used_granules() const { return used; }
 };
 
-class FileSystem {
-private:
-    Superblock sb;
-    vector<Inode> inodes;
-    vector<char*> data_blocks;
-    map<string, vector<DirEntry>> directories; 
-    string cwd;
+// Placement of each section in fs.img. The data region sits at a fixed,
+// page-aligned offset so it can be mapped as the block arena; the inode
+// table has fixed slots too, and the directory map follows the data.
+// Unwritten ranges stay holes and pages whose granules are all freed are
+// punched out again at checkpoints, so the file only occupies what is in
+// use. A checkpoint writes the directory map where it cannot overlap the
+// copy the header still points at: at the start of its area if it fits
+// before the old copy, otherwise right after it.
+//
+// The checksum section holds the bitmap, the block map of the block store, a
+// CRC32C of each block's stored form and one per INODE_CHUNK inode records.
+// It has two slots; a checkpoint writes the one the header does not point
+// at, but only the CSUM_PIECEs changed since that slot was last written,
+// then the table of piece CRCs after it. The header holds the CRC of that
+// table. Inode records and data blocks are updated in place; after a crash
+// the ones the journal rewrites are expected to differ from their checksums.
+//
+// Every field is little-endian and fixed-width; the header records the
+// format version and the geometry the layout derives from, and an image
+// whose magic, version, geometry or checksums do not match is not touched.
+template <class G>
+struct ImageHeader {
+    static constexpr char MAGIC[8] = {'U', 'N', 'I', 'X', 'F', 'S', 'I', 'M'};
+    static constexpr uint32_t VERSION = 5;
+    static constexpr int BYTES = 128;
+
+    uint32_t version;
+    int total_blocks;
+    int free_blocks;
+    int inode_count;
+    int csum_slot;
+    uint32_t csum_crc;
+    uint64_t csum_bytes;
+    uint64_t dir_pos;
+    uint64_t dir_bytes;
+    uint32_t dir_crc;
+
+    //   0 magic   8 version  12 block_size  16 total_blocks  20 free_blocks
+    //  24 inode_count  28 inode_record  32 max_inodes  36 csum_slot
+    //  40 dir_pos  48 dir_bytes  56 dir_crc  60 csum_crc  64 csum_bytes
+    //  72 data_bytes  80 granule
+    // 124 CRC32C of bytes [0, 124)
+    void encode(char *p) const {
+        memset(p, 0, BYTES);
+        memcpy(p, MAGIC, sizeof(MAGIC));
+        put_le(p + 8, VERSION, 4);
+        put_le(p + 12, G::BLOCK_SIZE, 4);
+        put_le(p + 16, total_blocks, 4);
+        put_le(p + 20, free_blocks, 4);
+        put_le(p + 24, inode_count, 4);
+        put_le(p + 28, INODE_RECORD, 4);
+        put_le(p + 32, G::MAX_INODES, 4);
+        put_le(p + 36, csum_slot, 4);
+        put_le(p + 40, dir_pos, 8);
+        put_le(p + 48, dir_bytes, 8);
+        put_le(p + 56, dir_crc, 4);
+        put_le(p + 60, csum_crc, 4);
+        put_le(p + 64, csum_bytes, 8);
+        put_le(p + 72, G::FS_SIZE, 8);
+        put_le(p + 80, G::GRANULE, 4);
+        put_le(p + 124, crc32c(p, 124), 4);
+    }
+
+    // Returns "" if the image is one this build can open, else the reason.
+    string decode(const char *p) {
+        if (memcmp(p, MAGIC, sizeof(MAGIC)) != 0) return "not a UnixFS image";
+        version = get_le(p + 8, 4);
+        if (version != VERSION) return "unsupported format version " + to_string(version);
+        if (get_le(p + 124, 4) != crc32c(p, 124)) return "header checksum mismatch";
+        total_blocks = get_le(p + 16, 4);
+        free_blocks = get_le(p + 20, 4);
+        inode_count = get_le(p + 24, 4);
+        csum_slot = get_le(p + 36, 4);
+        dir_pos = get_le(p + 40, 8);
+        dir_bytes = get_le(p + 48, 8);
+        dir_crc = get_le(p + 56, 4);
+        csum_crc = get_le(p + 60, 4);
+        csum_bytes = get_le(p + 64, 8);
+        uint64_t block_size = get_le(p + 12, 4), data_bytes = get_le(p + 72, 8);
+        if (block_size != (uint64_t)G::BLOCK_SIZE || data_bytes != (uint64_t)G::FS_SIZE ||
+            total_blocks != G::NUM_BLOCKS || get_le(p + 28, 4) != (uint64_t)INODE_RECORD ||
+            get_le(p + 32, 4) != (uint64_t)G::MAX_INODES || get_le(p + 80, 4) != (uint64_t)G::GRANULE)
+            return "geometry differs: image has " + to_string(block_size) + "-byte blocks and " +
+                   to_string(data_bytes >> 20) + "MB of data, this volume " + to_string(G::BLOCK_SIZE) +
+                   "-byte blocks and " + to_string(G::FS_SIZE >> 20) + "MB";
+        if (inode_count < 1 || inode_count > G::MAX_INODES) return "bad inode count";
+        if ((csum_slot & ~1) != 0) return "bad checksum slot";
+        return "";
+    }
+};
+
+template <class G>
+struct ImageLayout {
+    static constexpr int NUM_BLOCKS = G::NUM_BLOCKS, MAX_INODES = G::MAX_INODES;
+    static constexpr off_t PAGE = 4096;
+    static constexpr int INODE_CHUNK = 64;      // inode records per checksum
+    static off_t align(off_t v) { return (v + PAGE - 1) / PAGE * PAGE; }
+    static off_t bitmap_bytes() { return (NUM_BLOCKS + 63) / 64 * sizeof(uint64_t); }
+    static int inode_chunks(int inode_count) { return (inode_count + INODE_CHUNK - 1) / INODE_CHUNK; }
+    // bitmap, block map, block CRCs, inode chunk CRCs
+    static off_t chunk_crc_off() { return bitmap_bytes() + (off_t)NUM_BLOCKS * 8; }
+    static off_t csum_bytes(int inode_count) {
+        return chunk_crc_off() + (off_t)inode_chunks(inode_count) * 4;
+    }
+    // A slot holds the section followed by the CRCs of its pieces.
+    static constexpr int CSUM_PIECE = PAGE;
+    static int csum_pieces(int inode_count) { return (csum_bytes(inode_count) + CSUM_PIECE - 1) / CSUM_PIECE; }
+    static off_t csum_off(int slot) {
+        return PAGE + slot * (align(csum_bytes(MAX_INODES)) + align((off_t)csum_pieces(MAX_INODES) * 4));
+    }
+    static off_t piece_crc_off(int slot) { return csum_off(slot) + align(csum_bytes(MAX_INODES)); }
+    static off_t inode_off() { return csum_off(2); }
+    static off_t data_off() { return align(inode_off() + (off_t)MAX_INODES * INODE_RECORD); }
+    static off_t dir_off() { return data_off() + G::FS_SIZE; }
+};
+
+// Append-only redo log of metadata changes, kept next to the image. Records
+// are buffered until the transaction is sealed, then written in one go,
+// followed by a commit record holding a checksum of the transaction; replay
+// stops at the first transaction that is incomplete or fails its checksum.
+class Journal {
+    int fd;
+    string buf;
+
+public:
+    off_t bytes;
+
+    Journal() : fd(-1), bytes(0) {}
+    ~Journal() { if (fd >= 0) ::close(fd); }
+
+    bool open(const string &path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        bytes = fd >= 0 ? lseek(fd, 0, SEEK_END) : 0;
+        return fd >= 0;
+    }
+
+    bool is_open() const { return fd >= 0; }
+    bool pending() const { return !buf.empty(); }
+
+    void put(const void *p, size_t n) { buf.append((const char*)p, n); }
+    void put_int(int v) { put_u(v, 4); }
+    void put_u(uint64_t v, int n) {
+        char b[8];
+        put_le(b, v, n);
+        put(b, n);
+    }
+    void put_str(const string &str) { put_int(str.size()); put(str.data(), str.size()); }
+    void rec(char type) { buf.push_back(type); }
+
+    static uint64_t checksum(const char *p, size_t n) { return hash_bytes(p, n); }
+
+    // Moves the buffered records out as one transaction with its commit record.
+    string seal() {
+        string out;
+        if (buf.empty()) return out;
+        uint64_t sum = checksum(buf.data(), buf.size());
+        rec('C');
+        put_u(sum, 8);
+        out.swap(buf);
+        return out;
+    }
+
+    bool write(const string &txn) {
+        if (txn.empty() || fd < 0) return true;
+        bool ok = ::write(fd, txn.data(), txn.size()) == (ssize_t)txn.size() && fdatasync(fd) == 0;
+        if (ok) bytes += txn.size();
+        return ok;
+    }
+
+    void discard() { buf.clear(); }
+
+    void truncate() {
+        if (fd < 0) return;
+        if (ftruncate(fd, 0) == 0) fsync(fd);
+        bytes = 0;
+    }
+
+    string read_all() {
+        string out(bytes, '\0');
+        if (fd < 0 || pread(fd, &out[0], out.size(), 0) != (ssize_t)out.size()) out.clear();
+        return out;
+    }
+};
+
+struct JournalReader {
+    const string &s;
+    size_t pos;
+    bool ok;
+
+    JournalReader(const string &str, size_t at) : s(str), pos(at), ok(true) {}
+
+    void get(void *p, size_t n) {
+        if (!ok || pos + n > s.size()) { ok = false; return; }
+        memcpy(p, s.data() + pos, n);
+        pos += n;
+    }
+    uint64_t get_u(int n) {
+        char b[8] = {};
+        get(b, n);
+        return get_le(b, n);
+    }
+    int get_int() { return (int32_t)get_u(4); }
+    string get_str() {
+        int n = get_int();
+        if (!ok || n < 0 || pos + n > s.size()) { ok = false; return string(); }
+        string out = s.substr(pos, n);
+        pos += n;
+        return out;
+    }
+};
+
+struct Directory;
+
+// The kind, ctime and directory of the inode are cached here for listings.
+struct DirEntry {
+    string name;
+    int inode_idx;
+    bool is_dir;
+    time_t ctime;
+    shared_ptr<Directory> sub;      // the directory, if it is one
+    int order_slot;                 // in the listing order of its kind
+};
+
+// Entries of one kind in listing order: by ctime, then by when they were
+// added. Every entry holds a slot; new ones are appended, a removed one
+// leaves a hole, and a Fenwick tree counts the live slots, so the k-th entry
+// is found in O(log n) and a page of a listing costs O(log n + page) however
+// large the directory. Only an entry older than the newest one, after a
+// clock step or a load, makes the directory sort its slots again; holes are
+// squeezed out once they outnumber the entries.
+struct ListOrder {
+    vector<int> pos;                // slot -> position in entries, -1 for a hole
+    vector<int> tree = {0};         // 1-based
+    int live = 0;
+    time_t newest = 0;
+
+    bool fits(time_t ctime) const { return pos.empty() || ctime >= newest; }
+    int holes() const { return (int)pos.size() - live; }
+
+    int push(int p, time_t ctime) {
+        int i = pos.size() + 1, n = 1;
+        for (int j = i - 1, stop = i - (i & -i); j > stop; j -= j & -j) n += tree[j];
+        pos.push_back(p);
+        tree.push_back(n);
+        live++;
+        newest = max(newest, ctime);
+        return i - 1;
+    }
+
+    void erase(int slot) {
+        pos[slot] = -1;
+        for (int i = slot + 1; i < (int)tree.size(); i += i & -i) tree[i]--;
+        live--;
+    }
+
+    // Position in entries of the k-th live slot, 0-based.
+    int at(int k) const {
+        int n = pos.size(), i = 0;
+        for (int step = n ? 1 << (31 - __builtin_clz(n)) : 0; step; step >>= 1)
+            if (i + step <= n && tree[i + step] <= k) k -= tree[i += step];
+        return pos[i];
+    }
+
+    void clear() {
+        pos.clear();
+        tree.assign(1, 0);
+        live = 0;
+        newest = 0;
+    }
+};
+
+// Space taken by an inode or a subtree: file bytes, blocks and inodes.
+struct Usage {
+    int64_t bytes, blocks, inodes;
+    void add(const Usage &o) { bytes += o.bytes, blocks += o.blocks, inodes += o.inodes; }
+    bool operator!=(const Usage &o) const {
+        return bytes != o.bytes || blocks != o.blocks || inodes != o.inodes;
+    }
+};
+
+// Entries of one directory plus an open-addressing index over their names
+// (linear probing, backward-shift deletion, load factor <= 0.7). Removal
+// moves the last entry into the hole, so lookup, insert and remove are all
+// O(1) on average regardless of directory size. `mu` guards the entries;
+// parent and name never change. A deleted directory is marked dead before
+// it leaves the directory map, for threads that still hold a pointer to it.
+// The usage totals cover the subtree rooted here, this directory included;
+// they are atomics so that changes further down can be added in without
+// taking every ancestor's lock. Listings go through `order`, subdirectories
+// first, and the entry count is kept where a parent's listing can read it
+// without this directory's lock.
+struct Directory {
+    int parent;
+    string name;
+    vector<DirEntry> entries;
+    vector<int> slots;      // position in entries, or -1
+    ListOrder order[2];     // files, subdirectories
+    mutable shared_mutex mu;
+    bool dead = false;
+    atomic<int64_t> bytes{0}, blocks{0}, inodes{0};
+    atomic<int> nentries{0};
+
+    Directory(int p = 0, const string &n = "") : parent(p), name(n) {}
+
+    static size_t hash(string_view key) { return hash_bytes(key.data(), key.size()); }
+
+    int find(string_view key) const {
+        int i = find_slot(key);
+        return i < 0 ? -1 : entries[slots[i]].inode_idx;
+    }
+
+    Usage usage() const { return {bytes, blocks, inodes}; }
+
+    void charge(const Usage &u, int sign) {
+        bytes.fetch_add(sign * u.bytes, memory_order_relaxed);
+        blocks.fetch_add(sign * u.blocks, memory_order_relaxed);
+        inodes.fetch_add(sign * u.inodes, memory_order_relaxed);
+    }
+
+    void add(const string &key, int ino, bool is_dir = false, time_t ctime = 0,
+             shared_ptr<Directory> sub = nullptr) {
+        if ((entries.size() + 1) * 10 > slots.size() * 7)
+            rehash(max<size_t>(8, slots.size() * 2));
+        int pos = entries.size();
+        entries.push_back({key, ino, is_dir, ctime, std::move(sub), INT_MAX});
+        place(pos);
+        ListOrder &o = order[is_dir];
+        if (o.fits(ctime)) entries[pos].order_slot = o.push(pos, ctime);
+        else reorder(is_dir);
+        nentries.store(entries.size(), memory_order_relaxed);
+    }
+
+    bool remove(string_view key) {
+        int i = find_slot(key);
+        if (i < 0) return false;
+        int pos = slots[i];
+        erase_slot(i);
+        bool is_dir = entries[pos].is_dir;
+        order[is_dir].erase(entries[pos].order_slot);
+        int last = entries.size() - 1;
+        if (pos != last) {
+            slots[find_slot(entries[last].name)] = pos;
+            order[entries[last].is_dir].pos[entries[last].order_slot] = pos;
+            entries[pos] = std::move(entries[last]);
+        }
+        entries.pop_back();
+        nentries.store(entries.size(), memory_order_relaxed);
+        ListOrder &o = order[is_dir];
+        if (o.holes() > 64 && o.holes() > o.live) reorder(is_dir);
+        return true;
+    }
+
+    // The k-th entry of the listing, 0 <= k < entries.size().
+    const DirEntry &listed(int k) const {
+        int ndirs = order[1].live;
+        return entries[k < ndirs ? order[1].at(k) : order[0].at(k - ndirs)];
+    }
+
+    // Rebuilds the listing order of one kind from the entries' ctimes,
+    // keeping the order of slots between equal ctimes.
+    void reorder(bool is_dir) {
+        vector<int> ps;
+        for (size_t p = 0; p < entries.size(); ++p)
+            if (entries[p].is_dir == is_dir) ps.push_back(p);
+        sort(ps.begin(), ps.end(), [&](int a, int b) {
+            const DirEntry &x = entries[a], &y = entries[b];
+            if (x.ctime != y.ctime) return x.ctime < y.ctime;
+            return x.order_slot != y.order_slot ? x.order_slot < y.order_slot : a < b;
+        });
+        ListOrder &o = order[is_dir];
+        o.clear();
+        for (int p : ps) entries[p].order_slot = o.push(p, entries[p].ctime);
+    }
+
+private:
+    int find_slot(string_view key) const {
+        if (slots.empty()) return -1;
+        size_t mask = slots.size() - 1;
+        int probes = 1, found = -1;
+        for (size_t i = hash(key) & mask; slots[i] >= 0; i = (i + 1) & mask, ++probes)
+            if (entries[slots[i]].name == key) { found = i; break; }
+        stat_add(CNT_DIR_LOOKUPS);
+        stat_add(CNT_DIR_PROBES, probes);
+        stat_record(HIST_PROBE_LENGTH, probes);
+        return found;
+    }
+
+    void place(int pos) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash(entries[pos].name) & mask;
+        while (slots[i] >= 0) i = (i + 1) & mask;
+        slots[i] = pos;
+    }
+
+    void erase_slot(size_t i) {
+        size_t mask = slots.size() - 1;
+        for (size_t j = (i + 1) & mask; slots[j] >= 0; j = (j + 1) & mask) {
+            size_t home = hash(entries[slots[j]].name) & mask;
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = -1;
+    }
+
+    void rehash(size_t n) {
+        slots.assign(n, -1);
+        for (size_t pos = 0; pos < entries.size(); ++pos) place(pos);
+    }
+};
+
+// Reads lines from a file descriptor through one large buffer. The views it
+// returns stay valid until the next call.
+class LineReader {
+    int fd;
+    vector<char> buf;
+    size_t beg, end;
+    bool eof;
+
+public:
+    explicit LineReader(int fd_, size_t cap = 1 << 20)
+        : fd(fd_), buf(cap), beg(0), end(0), eof(false) {}
+
+    bool next(string_view &line) {
+        while (true) {
+            const char *start = buf.data() + beg;
+            const char *nl = static_cast<const char*>(memchr(start, '\n', end - beg));
+            if (nl || (eof && beg < end)) {
+                size_t len = nl ? nl - start : end - beg;
+                beg += nl ? len + 1 : len;
+                if (len > 0 && start[len - 1] == '\r') --len;
+                line = string_view(start, len);
+                return true;
+            }
+            if (eof) return false;
+            memmove(buf.data(), start, end - beg);
+            end -= beg;
+            beg = 0;
+            if (end == buf.size()) buf.resize(buf.size() * 2);
+            ssize_t n = read(fd, buf.data() + end, buf.size() - end);
+            if (n <= 0) eof = true;
+            else end += n;
+        }
+    }
+};
+
+// Splits on whitespace into at most `max` views; returns how many were found.
+inline int tokenize(string_view line, string_view *tok, int max) {
+    int n = 0;
+    size_t i = 0;
+    while (n < max) {
+        while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+        if (i == line.size()) break;
+        size_t j = i;
+        while (j < line.size() && !isspace((unsigned char)line[j])) ++j;
+        tok[n++] = line.substr(i, j - i);
+        i = j;
+    }
+    return n;
+}
+
+template <class T>
+inline bool parse_num(string_view sv, T &out) {
+    auto r = from_chars(sv.data(), sv.data() + sv.size(), out);
+    return r.ec == errc() && r.ptr == sv.data() + sv.size();
+}
+
+// An optional size or offset argument: absent leaves `out` alone, and
+// anything but a non-negative number is an error.
+template <class T>
+inline bool parse_count(string_view sv, T &out) {
+    return sv.empty() || (parse_num(sv, out) && out >= 0);
+}
+
+struct RunOptions {
+    string image = "fs.img";
+    bool batch = false;
+    int in_fd = STDIN_FILENO;
+    int commit_every = 1;   // commands per journal transaction
+    string socket;          // serve clients on this Unix-domain socket
+    bool verify = false;    // check every data block's checksum on load
+    bool dedup = false;     // share data blocks with identical contents
+    int cache_mb = 256;     // buffer cache budget over a volume file
+    string stats_file;      // rewrite statistics here every stats_every seconds
+    int stats_every = 10;
+};
+
+enum class FillPattern { Letters, Zeros };
+
+// wyrand: one 64x64->128 multiply per 64 random bits.
+struct Wyrand {
+    uint64_t s;
+    explicit Wyrand(uint64_t seed) : s(seed) {}
+    uint64_t next() {
+        s += 0xa0761d6478bd642fULL;
+        __uint128_t t = (__uint128_t)s * (s ^ 0xe7037ed1a0b428dbULL);
+        return (uint64_t)(t >> 64) ^ (uint64_t)t;
+    }
+};
+
+// Generates file contents from four xorshift128+ lanes seeded by wyrand. For
+// Letters each random byte b becomes 'A' + (b * 26 >> 8), computed in 16-bit
+// lanes, so one step yields 32 letters. The AVX2 path runs the same lanes in
+// one register, so a seed gives the same bytes with or without it.
+struct FillEngine {
+    FillPattern pattern;
+    uint64_t seed;
+
+    static uint64_t letters8(uint64_t r) {
+        const uint64_t lo = 0x00FF00FF00FF00FFULL;
+        uint64_t even = (((r & lo) * 26) >> 8) & lo;
+        uint64_t odd = (((r >> 8) & lo) * 26) & ~lo;
+        return (even | odd) + 0x4141414141414141ULL;
+    }
+
+    void fill(char *dst, size_t n) const {
+        if (pattern == FillPattern::Zeros) {
+            memset(dst, 0, n);
+            return;
+        }
+        Wyrand rng(seed);
+        uint64_t s0[4], s1[4];
+        for (uint64_t &v : s0) v = rng.next();
+        for (uint64_t &v : s1) v = rng.next();
+        size_t i = 0;
+#ifdef __AVX2__
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s0));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s1));
+        const __m256i lo = _mm256_set1_epi16(0x00FF);
+        const __m256i k26 = _mm256_set1_epi16(26);
+        const __m256i base = _mm256_set1_epi8('A');
+        for (; i + 32 <= n; i += 32) {
+            __m256i x = v0, y = v1;
+            v0 = y;
+            x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 23));
+            v1 = _mm256_xor_si256(_mm256_xor_si256(x, y),
+                                  _mm256_xor_si256(_mm256_srli_epi64(x, 17), _mm256_srli_epi64(y, 26)));
+            __m256i r = _mm256_add_epi64(v1, y);
+            __m256i even = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(r, lo), k26), 8);
+            __m256i odd = _mm256_andnot_si256(lo, _mm256_mullo_epi16(_mm256_srli_epi16(r, 8), k26));
+            __m256i v = _mm256_add_epi8(_mm256_or_si256(even, odd), base);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(s0), v0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(s1), v1);
+#endif
+        for (; i < n; i += 32) {
+            uint64_t out[4];
+            for (int k = 0; k < 4; ++k) {
+                uint64_t x = s0[k], y = s1[k];
+                s0[k] = y;
+                x ^= x << 23;
+                s1[k] = x ^ y ^ (x >> 17) ^ (y >> 26);
+                out[k] = letters8(s1[k] + y);
+            }
+            memcpy(dst + i, out, min<size_t>(32, n - i));
+        }
+    }
+};
+
+// Work-stealing pool. Every thread owns a deque of tasks: it pushes and
+// pops at the back, and when its own runs dry it steals from the front of
+// the others'. The thread calling run() takes queue 0 and works along until
+// every task, including those spawned by other tasks, has finished. A thread
+// that finds nothing to take sleeps until a task is queued or, for the
+// caller of run(), the last one finishes, so one long task does not keep the
+// rest spinning. One run() at a time; concurrent callers wait their turn.
+class TaskPool {
+public:
+    using Task = function<void()>;
+
+    explicit TaskPool(int workers)
+        : queues(workers + 1), pending(0), queued(0), idle(0), stop(false) {
+        for (auto &q : queues) q.reset(new Queue);
+        for (int i = 1; i <= workers; ++i) threads.emplace_back([this, i] { work(i); });
+    }
+
+    ~TaskPool() {
+        {
+            lock_guard<mutex> g(mu);
+            stop = true;
+        }
+        cv.notify_all();
+        for (thread &t : threads) t.join();
+    }
+
+    int size() const { return queues.size(); }
+
+    void spawn(Task t) {
+        Queue &q = *queues[self < 0 ? 0 : self];
+        pending++;
+        {
+            lock_guard<mutex> g(q.mu);
+            q.tasks.push_back(std::move(t));
+            queued++;
+        }
+        // A thread going to sleep counts itself idle before it checks
+        // `queued`, so either it sees this task or it is woken here.
+        if (idle > 0) {
+            { lock_guard<mutex> g(mu); }
+            cv.notify_one();
+        }
+    }
+
+    void run(Task root) {
+        lock_guard<mutex> r(run_mu);
+        int saved = self;
+        self = 0;
+        spawn(std::move(root));
+        drain();
+        self = saved;
+    }
+
+private:
+    struct Queue {
+        mutex mu;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> threads;
+    atomic<int> pending;        // spawned and not yet finished
+    atomic<int> queued;         // spawned and not yet taken
+    atomic<int> idle;           // threads asleep or about to be
+    mutex mu, run_mu;
+    condition_variable cv;
+    bool stop;
+    static thread_local int self;
+
+    bool take(int id, Task &t) {
+        {
+            Queue &q = *queues[id];
+            lock_guard<mutex> g(q.mu);
+            if (!q.tasks.empty()) {
+                t = std::move(q.tasks.back());
+                q.tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); ++k) {
+            Queue &q = *queues[(id + k) % queues.size()];
+            lock_guard<mutex> g(q.mu);
+            if (!q.tasks.empty()) {
+                t = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void finish(Task &t) {
+        t();
+        t = nullptr;
+        if (--pending == 0) {
+            { lock_guard<mutex> g(mu); }
+            cv.notify_all();
+        }
+    }
+
+    // Sleeps until `ready` holds; the caller holds mu.
+    template <class P>
+    void sleep(unique_lock<mutex> &g, P ready) {
+        idle++;
+        cv.wait(g, ready);
+        idle--;
+    }
+
+    // run()'s part: works on tasks, and waits for the ones others are
+    // running, until none is left.
+    void drain() {
+        Task t;
+        while (pending > 0) {
+            if (take(0, t)) {
+                finish(t);
+                continue;
+            }
+            unique_lock<mutex> g(mu);
+            sleep(g, [&] { return pending == 0 || queued > 0; });
+        }
+    }
+
+    void work(int id) {
+        self = id;
+        Task t;
+        unique_lock<mutex> g(mu);
+        while (true) {
+            sleep(g, [&] { return stop || queued > 0; });
+            if (stop) return;
+            g.unlock();
+            while (take(id, t)) finish(t);
+            g.lock();
+        }
+    }
+};
+
+thread_local int TaskPool::self = -1;
+
+// Reader-writer gate that lets a waiting writer in ahead of new readers, so
+// a steady stream of commands cannot starve commits and checkpoints.
+class OpGate {
+    mutex mu;
+    condition_variable cv;
+    int readers = 0, writers_waiting = 0;
+    bool writing = false;
+
+public:
+    void lock_shared() {
+        unique_lock<mutex> g(mu);
+        cv.wait(g, [&] { return !writing && writers_waiting == 0; });
+        ++readers;
+    }
+    void unlock_shared() {
+        lock_guard<mutex> g(mu);
+        if (--readers == 0) cv.notify_all();
+    }
+    void lock() {
+        unique_lock<mutex> g(mu);
+        ++writers_waiting;
+        cv.wait(g, [&] { return !writing && readers == 0; });
+        --writers_waiting;
+        writing = true;
+    }
+    void unlock() {
+        lock_guard<mutex> g(mu);
+        writing = false;
+        cv.notify_all();
+    }
+};
+
+// Output buffer over a file descriptor, used for socket clients.
+class FdOutBuf : public streambuf {
+    int fd;
+    char buf[1 << 16];
+
+    bool drain() {
+        const char *p = pbase();
+        while (p < pptr()) {
+            ssize_t n = ::write(fd, p, pptr() - p);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            p += n;
+        }
+        bool ok = p == pptr();
+        setp(buf, buf + sizeof(buf));
+        return ok;
+    }
+
+protected:
+    int overflow(int c) override {
+        if (!drain()) return EOF;
+        if (c != EOF) { *pptr() = c; pbump(1); }
+        return c == EOF ? 0 : c;
+    }
+    int sync() override { return drain() ? 0 : -1; }
+
+public:
+    explicit FdOutBuf(int fd_) : fd(fd_) { setp(buf, buf + sizeof(buf)); }
+};
+
+// Per-client state: working directory, output and scratch buffers. Commands
+// of different sessions may run at the same time.
+struct Session {
+    string cwd = "/";
+    InodeHandle cwd_ino = {0, 0};
+    ostream *out = &cout;
+    int out_fd = STDOUT_FILENO;
+    bool failed = false;
+    string path_buf;
+    string args[4];
+    string io_buf;          // file contents on their way in or out
+    vector<iovec> iov;      // spans of io_buf and the arena cat writes out
+};
+
+// Session whose command the current thread is running.
+static thread_local Session *cur_session = nullptr;
+
+// The filesystem for one volume geometry G (see Geometry).
+template <class G>
+class FileSystem {
+private:
+    static constexpr int BLOCK_SIZE = G::BLOCK_SIZE, NUM_BLOCKS = G::NUM_BLOCKS;
+    static constexpr int GRANULE = G::GRANULE, NUM_GRANULES = G::NUM_GRANULES;
+    static constexpr int64_t FS_SIZE = G::FS_SIZE;
+    static constexpr int MAX_INODES = G::MAX_INODES;
+    using Superblock = ::Superblock<G>;
+    using DedupIndex = ::DedupIndex<G>;
+    using ExtentBlock = ::ExtentBlock<G>;
+    using InodeTable = ::InodeTable<G>;
+    using BlockStore = ::BlockStore<G>;
+    using ImageHeader = ::ImageHeader<G>;
+    using ImageLayout = ::ImageLayout<G>;
+    static constexpr int EXTENTS_PER_BLOCK = ExtentBlock::CAPACITY;
+
+    Superblock sb;
+    DedupIndex dedup;
+    InodeTable inodes;
+    BlockStore data_blocks;
+    unordered_map<int, shared_ptr<Directory>> directories;
+    unordered_map<string, InodeHandle> dcache;
+    Session console;
+    int image_fd;
+    Journal journal;
+    set<int> txn_inodes, txn_words;
+    set<int> ckpt_inodes, ckpt_words;
+    bool ckpt_dirs;
+    int commits_since_ckpt;
+    ImageHeader image;
+    vector<uint32_t> block_crc;     // as of the last checkpoint
+    vector<uint32_t> inode_crc;     // per INODE_CHUNK records, likewise
+    string csum;                    // the checksum section, likewise
+    vector<uint32_t> piece_crc;     // per CSUM_PIECE of it
+    set<int> csum_stale[2];         // pieces changed since each slot was written
+    // Blocks freed by commands whose transaction is not yet durable. They
+    // are journaled as free but only go back to the bitmap once the commit
+    // is written, so nothing the last commit maps is overwritten before then.
+    BlockBitmap freed;
+    vector<int> freed_list;
+    mutex freed_mu;
+    atomic<long long> freed_pending;    // freed, not yet back in the bitmap
+    atomic<uint64_t> fill_seed;
+
+    // Lock order: ops, then directories parent before child, then one inode
+    // lock; the remaining mutexes are leaves. Commands hold ops shared for
+    // their whole run, commits and checkpoints hold it exclusively.
+    OpGate ops;
+    shared_mutex dirs_mu;           // the directories map itself
+    mutex inode_mu;                 // inode free list and table growth
+    mutex dcache_mu;
+    mutex txn_mu;                   // journal buffer and txn sets
+    mutex journal_mu;               // journal file and commit counter
+    static constexpr int INODE_LOCKS = 256;
+    shared_mutex inode_locks[INODE_LOCKS];
+
+    mutex commit_mu;
+    condition_variable commit_cv;
+    uint64_t commits_started, commits_done;
+
+    unique_ptr<TaskPool> pool;
+    once_flag pool_once;
+
+    mutex stats_mu;                 // stats_base
+    unique_ptr<StatTotals> stats_base;
+    thread dumper;
+    mutex dump_mu;
+    condition_variable dump_cv;
+    bool dump_stop;
+
+    static constexpr size_t DCACHE_MAX = 1 << 16;
+    static constexpr size_t CAT_DIRECT_BYTES = 64 << 10;
+    static constexpr int READAHEAD_BLOCKS = max(1, (256 << 10) / BLOCK_SIZE);
+    static constexpr int RUN_GOAL = READAHEAD_BLOCKS, RUN_PROBES = 8;
+    static constexpr uint64_t DEFRAG_SLICE_NS = 5000000;
+    static constexpr int DEFRAG_CHUNK = 1024;
+    static constexpr int DEFRAG_PACK_BYTES = min<int64_t>(1 << 20, FS_SIZE >> 8);
+    static constexpr int DEFRAG_MOVE_BYTES = min<int64_t>(4 << 20, FS_SIZE >> 5);
+    static constexpr int64_t FILL_CHUNK = 64 << 10;
+    static constexpr int CHECKPOINT_COMMITS = 256;
+    static constexpr off_t CHECKPOINT_JOURNAL_BYTES = 4 << 20;
+
+public:
+    FileSystem()
+        : image_fd(-1), ckpt_dirs(false), commits_since_ckpt(0), image(),
+          block_crc(NUM_BLOCKS), freed(NUM_BLOCKS, false), freed_pending(0),
+          fill_seed(random_device{}() ^ (uint64_t)time(nullptr) << 32),
+          commits_started(0), commits_done(0), dump_stop(false) {
+        init_root();
+    }
+
+    ~FileSystem() {
+        if (image_fd >= 0) close(image_fd);
+    }
+
+    void init_root() {
+        if (inodes.size() == 0) inodes.grow();
+        Inode &root = inodes[0];
+        root.used = true;
+        root.is_directory = true;
+        root.ctime = time(nullptr);
+        directories[0] = make_shared<Directory>();
+        directories[0]->charge(usage_of(root), 1);
+        txn_inodes.insert(0);
+    }
+
+    Session &sess() { return cur_session ? *cur_session : console; }
+    ostream &out() { return *sess().out; }
+
+    // Error output: marks the running command as failed for the batch status.
+    ostream &err() {
+        sess().failed = true;
+        return out();
+    }
+
+    shared_mutex &inode_lock(int i) { return inode_locks[i & (INODE_LOCKS - 1)]; }
+
+    void mark_inode(int i) {
+        lock_guard<mutex> g(txn_mu);
+        txn_inodes.insert(i);
+    }
+
+    void mark_bitmap(int start, int len) {
+        lock_guard<mutex> g(txn_mu);
+        for (int w = start >> 6; w <= (start + len - 1) >> 6; ++w) txn_words.insert(w);
+    }
+
+    shared_ptr<Directory> dir_ptr(int ino) {
+        shared_lock<shared_mutex> g(dirs_mu);
+        auto it = directories.find(ino);
+        return it == directories.end() ? nullptr : it->second;
+    }
+
+    shared_ptr<Directory> dir_create(int ino, int parent, const string &name) {
+        shared_ptr<Directory> d = make_shared<Directory>(parent, name);
+        {
+            unique_lock<shared_mutex> g(dirs_mu);
+            directories[ino] = d;
+        }
+        lock_guard<mutex> g(txn_mu);
+        journal.rec('D');
+        journal.put_int(ino);
+        journal.put_int(parent);
+        journal.put_str(name);
+        return d;
+    }
+
+    void dir_erase(int ino) {
+        {
+            unique_lock<shared_mutex> g(dirs_mu);
+            directories.erase(ino);
+        }
+        lock_guard<mutex> g(txn_mu);
+        journal.rec('R');
+        journal.put_int(ino);
+    }
+
+    // dir_add and dir_remove expect d.mu to be held exclusively.
+    void dir_add(Directory &d, int dir, const string &name, int ino) {
+        const Inode &in = inodes[ino];
+        d.add(name, ino, in.is_directory, in.ctime, in.is_directory ? dir_ptr(ino) : nullptr);
+        lock_guard<mutex> g(txn_mu);
+        journal.rec('A');
+        journal.put_int(dir);
+        journal.put_str(name);
+        journal.put_int(ino);
+    }
+
+    void dir_remove(Directory &d, int dir, const string &name) {
+        d.remove(name);
+        lock_guard<mutex> g(txn_mu);
+        journal.rec('X');
+        journal.put_int(dir);
+        journal.put_str(name);
+    }
+
+    // An inode's own share of the usage totals: a file's size and data
+    // blocks, or a directory's block.
+    Usage usage_of(const Inode &ino) {
+        if (ino.is_directory) return {0, ino.nextents > 0, 1};
+        return {ino.size, (ino.size + BLOCK_SIZE - 1) / BLOCK_SIZE, 1};
+    }
+
+    // Adds `u` to the totals of directory `dir` and of each directory above
+    // it. The caller holds the lock of the directory whose entries changed,
+    // so a recursive delete, which takes that lock before reading the totals,
+    // never misses a change.
+    void charge(int dir, const Usage &u, int sign) {
+        for (int at = dir; ; ) {
+            shared_ptr<Directory> d = dir_ptr(at);
+            if (!d) return;
+            d->charge(u, sign);
+            if (at == 0) return;
+            at = d->parent;
+        }
+    }
+
+    // Usage totals of every directory reachable from the root, counted from
+    // the entries: each directory's own files first, then each subtree added
+    // to its parent, deepest first. The caller holds ops exclusively.
+    unordered_map<int, Usage> count_usage() {
+        unordered_map<int, Usage> sub;
+        vector<pair<int, int>> order = {{0, -1}};     // (directory, parent), top down
+        for (size_t k = 0; k < order.size(); ++k) {
+            int d = order[k].first;
+            Usage &u = sub[d] = usage_of(inodes[d]);
+            auto it = directories.find(d);
+            if (it == directories.end()) continue;
+            for (const DirEntry &e : it->second->entries) {
+                int i = e.inode_idx;
+                if (i < 0 || i >= inodes.size() || !inodes[i].used) continue;
+                if (!inodes[i].is_directory) u.add(usage_of(inodes[i]));
+                else if (!sub.count(i)) order.push_back({i, d}), sub[i] = {0, 0, 0};
+            }
+        }
+        for (size_t k = order.size(); k-- > 1; ) sub[order[k].second].add(sub[order[k].first]);
+        return sub;
+    }
+
+    // Neither are the kinds, ctimes and directories cached in the entries;
+    // they are filled in from the inodes after load and replay, and each
+    // directory's listing order is rebuilt from them.
+    void rebuild_listings() {
+        for (auto &kv : directories) {
+            Directory &d = *kv.second;
+            for (DirEntry &e : d.entries) {
+                bool ok = e.inode_idx >= 0 && e.inode_idx < inodes.size();
+                e.is_dir = ok && inodes[e.inode_idx].is_directory;
+                e.ctime = ok ? inodes[e.inode_idx].ctime : 0;
+                auto it = e.is_dir ? directories.find(e.inode_idx) : directories.end();
+                e.sub = it == directories.end() ? nullptr : it->second;
+            }
+            d.reorder(false);
+            d.reorder(true);
+        }
+    }
+
+    // The totals are not stored in the image; they are recounted after load
+    // and journal replay.
+    void rebuild_usage() {
+        for (const auto &kv : count_usage()) {
+            auto it = directories.find(kv.first);
+            if (it == directories.end()) continue;
+            Directory &d = *it->second;
+            d.bytes = kv.second.bytes;
+            d.blocks = kv.second.blocks;
+            d.inodes = kv.second.inodes;
+        }
+    }
+
+    int alloc_inode() {
+        int i;
+        {
+            lock_guard<mutex> g(inode_mu);
+            i = sb.free_inode_head;
+            if (i >= 0) sb.free_inode_head = inodes[i].next_free;
+            else if ((i = inodes.grow()) < 0) return -1;
+        }
+        {
+            unique_lock<shared_mutex> il(inode_lock(i));
+            inodes[i].used = true;
+            inodes[i].next_free = -1;
+            inodes[i].ctime = time(nullptr);
+        }
+        mark_inode(i);
+        return i;
+    }
+
+    // Takes `n` inodes in one pass over the free list; all of them or none.
+    bool alloc_inodes(int n, vector<int> &out) {
+        out.clear();
+        {
+            lock_guard<mutex> g(inode_mu);
+            while ((int)out.size() < n) {
+                int i = sb.free_inode_head;
+                if (i >= 0) sb.free_inode_head = inodes[i].next_free;
+                else if ((i = inodes.grow()) < 0) break;
+                out.push_back(i);
+            }
+            if ((int)out.size() < n) {
+                for (int i : out) {
+                    inodes[i].next_free = sb.free_inode_head;
+                    sb.free_inode_head = i;
+                }
+                out.clear();
+                return false;
+            }
+        }
+        time_t now = time(nullptr);
+        for (int i : out) {
+            unique_lock<shared_mutex> il(inode_lock(i));
+            inodes[i].used = true;
+            inodes[i].next_free = -1;
+            inodes[i].ctime = now;
+        }
+        lock_guard<mutex> g(txn_mu);
+        txn_inodes.insert(out.begin(), out.end());
+        return true;
+    }
+
+    // The caller holds inode_lock(i) exclusively.
+    void free_inode(int i) {
+        uint32_t gen = inodes[i].gen + 1;
+        inodes[i] = Inode();
+        inodes[i].gen = gen;
+        {
+            lock_guard<mutex> g(inode_mu);
+            inodes[i].next_free = sb.free_inode_head;
+            sb.free_inode_head = i;
+        }
+        mark_inode(i);
+    }
+
+    void rebuild_inode_free_list() {
+        sb.free_inode_head = -1;
+        for (int i = inodes.size() - 1; i > 0; --i) {
+            if (inodes[i].used) continue;
+            inodes[i].next_free = sb.free_inode_head;
+            sb.free_inode_head = i;
+        }
+    }
+
+    // Returns the inode behind `h`, or nullptr if it was freed since. The
+    // caller holds inode_lock(h.idx).
+    Inode *resolve(const InodeHandle &h) {
+        if (h.idx < 0 || h.idx >= inodes.size()) return nullptr;
+        Inode &ino = inodes[h.idx];
+        return (ino.used && ino.gen == h.gen) ? &ino : nullptr;
+    }
+
+    bool is_live(const InodeHandle &h, bool *is_dir = nullptr) {
+        if (h.idx < 0 || h.idx >= inodes.size()) return false;
+        shared_lock<shared_mutex> il(inode_lock(h.idx));
+        Inode *ino = resolve(h);
+        if (ino && is_dir) *is_dir = ino->is_directory;
+        return ino != nullptr;
+    }
+
+    // Shard the calling thread allocates from; threads start out spread
+    // over the shards and each moves on as its shard fills up.
+    static int &home_shard() {
+        static atomic<int> next(0);
+        static thread_local int home = next++ % Superblock::SHARDS;
+        return home;
+    }
+
+    // Marks [start, start + len) allocated with one reference each. The
+    // caller holds the shard's lock and calls count_run() once it is dropped.
+    void take_run(int start, int len) {
+        sb.block_bitmap.clear_range(start, len);
+        for (int b = start; b < start + len; ++b)
+            __atomic_store_n(&sb.block_refs[b], 1u, __ATOMIC_RELAXED);
+    }
+
+    void count_run(int start, int len) {
+        sb.free_blocks -= len;
+        sb.logical_blocks += len;
+        stat_add(CNT_BLOCKS_ALLOCATED, len);
+        mark_bitmap(start, len);
+    }
+
+    // Next-fit per shard: allocates a free run starting at or after the
+    // shard's cursor, up to `want` blocks long and not past the shard's end.
+    // A run shorter than RUN_GOAL blocks would split the file, so up to
+    // RUN_PROBES further runs are looked at for one that is long enough and
+    // the longest seen is taken; the short ones are left for small files and
+    // for when the cursor wraps. A shard with nothing left past its cursor is
+    // rewound and the thread moves on to the next one, so a single thread
+    // sweeps the whole device as one next-fit cursor would; only when every
+    // shard has been passed are the rewound ranges searched. Returns the
+    // first block and stores the run length in `got`.
+    int alloc_extent(int want, int &got) {
+        StatTimer t(HIST_ALLOC, 16);
+        got = 0;
+        if (want <= 0 || sb.free_blocks == 0) return -1;
+        int &home = home_shard();
+        int goal = min(want, RUN_GOAL);
+        for (int k = 0; k < 2 * Superblock::SHARDS; ++k) {
+            int idx = (home + k) % Superblock::SHARDS;
+            AllocShard &sh = sb.shards[idx];
+            if (sh.lo == sh.hi) continue;
+            int start;
+            {
+                lock_guard<mutex> g(sh.mu);
+                start = sb.block_bitmap.find_free(sh.cursor, sh.lo, sh.hi);
+                if (start < 0 || (k < Superblock::SHARDS && start < sh.cursor)) {
+                    sh.cursor = sh.lo;
+                    continue;
+                }
+                got = sb.block_bitmap.run_length(start, min(want, sh.hi - start));
+                for (int p = 0, at = start + got; p < RUN_PROBES && got < goal && at < sh.hi; ++p) {
+                    at = sb.block_bitmap.find_free(at, sh.lo, sh.hi);
+                    if (at <= start) break;
+                    int len = sb.block_bitmap.run_length(at, min(want, sh.hi - at));
+                    if (len > got) start = at, got = len;
+                    at += len;
+                }
+                take_run(start, got);
+                sh.cursor = start + got == sh.hi ? sh.lo : start + got;
+            }
+            home = idx;
+            count_run(start, got);
+            return start;
+        }
+        return -1;
+    }
+
+    // Takes up to `want` free blocks starting exactly at `b`, so a file's
+    // last run can grow in place; -1 if b is in use.
+    int alloc_at(int b, int want, int &got) {
+        got = 0;
+        if (b < 0 || b >= NUM_BLOCKS || want <= 0) return -1;
+        AllocShard &sh = sb.shard_of(b);
+        {
+            lock_guard<mutex> g(sh.mu);
+            got = sb.block_bitmap.run_length(b, min(want, sh.hi - b));
+            take_run(b, got);
+        }
+        if (got == 0) return -1;
+        count_run(b, got);
+        return b;
+    }
+
+    int alloc_block() {
+        int got;
+        return alloc_extent(1, got);
+    }
+
+    // Allocates `n` blocks as a sequence of extents, appending them to `out`.
+    // They read as zeros until written. On failure nothing stays allocated.
+    bool alloc_extents(int64_t n, vector<Extent> &out) {
+        if (n > sb.free_blocks) return false;
+        size_t mark = out.size();
+        while (n > 0) {
+            int got;
+            int start = alloc_extent(n, got);
+            if (start < 0) {
+                for (size_t i = mark; i < out.size(); ++i) free_extent(out[i]);
+                out.resize(mark);
+                return false;
+            }
+            out.push_back({start, got});
+            n -= got;
+        }
+        return true;
+    }
+
+    // Adds a reference to a block that another inode already owns.
+    void share_block(int idx) {
+        if (idx < 0) return;
+        __atomic_add_fetch(&sb.block_refs[idx], 1, __ATOMIC_RELAXED);
+        sb.logical_blocks++;
+    }
+
+    // Drops one reference. With the last one the block's storage and dedup
+    // entry go too, true is returned, and the caller returns the block to the
+    // bitmap.
+    bool unref_block(int idx) {
+        if (idx < 0) return false;
+        uint32_t refs = __atomic_load_n(&sb.block_refs[idx], __ATOMIC_RELAXED);
+        do {
+            if (refs == 0) return false;
+        } while (!__atomic_compare_exchange_n(&sb.block_refs[idx], &refs, refs - 1, true,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        sb.logical_blocks--;
+        if (refs > 1) return false;
+        if (uint64_t h = __atomic_load_n(&dedup.fp[idx], __ATOMIC_RELAXED)) {
+            typename DedupIndex::Shard &ds = dedup.shard_of(h);
+            lock_guard<mutex> g(ds.mu);
+            auto it = ds.map.find(h);
+            if (it != ds.map.end() && it->second == idx) ds.map.erase(it);
+            __atomic_store_n(&dedup.fp[idx], 0, __ATOMIC_RELAXED);
+        }
+        data_blocks.drop(idx);
+        return true;
+    }
+
+    // Drops one reference; the block goes back to the bitmap with the last,
+    // or with an image, once the transaction freeing it is committed.
+    void free_block(int idx) {
+        if (!unref_block(idx)) return;
+        stat_add(CNT_BLOCKS_FREED);
+        mark_bitmap(idx, 1);
+        if (image_fd >= 0) {
+            __atomic_fetch_or(&freed.words[idx >> 6], 1ULL << (idx & 63), __ATOMIC_RELAXED);
+            lock_guard<mutex> g(freed_mu);
+            freed_list.push_back(idx);
+            freed_pending++;
+            return;
+        }
+        {
+            lock_guard<mutex> g(sb.shard_of(idx).mu);
+            sb.block_bitmap.set(idx);
+        }
+        sb.free_blocks++;
+    }
+
+    // free_block over many blocks at once.
+    void free_block_batch(const vector<int> &blocks) {
+        vector<int> last;
+        for (int b : blocks)
+            if (unref_block(b)) last.push_back(b);
+        stat_add(CNT_BLOCKS_FREED, last.size());
+        if (image_fd >= 0) {
+            for (int b : last) {
+                mark_bitmap(b, 1);
+                __atomic_fetch_or(&freed.words[b >> 6], 1ULL << (b & 63), __ATOMIC_RELAXED);
+            }
+            lock_guard<mutex> g(freed_mu);
+            freed_list.insert(freed_list.end(), last.begin(), last.end());
+            freed_pending += last.size();
+            return;
+        }
+        for (const Extent &r : release_blocks_to_bitmap(last)) mark_bitmap(r.start, r.len);
+    }
+
+    // Returns `blocks` to the bitmap: sorted, a run at a time, each shard's
+    // lock taken once. Returns the runs.
+    vector<Extent> release_blocks_to_bitmap(vector<int> &last) {
+        sort(last.begin(), last.end());
+        vector<Extent> runs;
+        for (int b : last) {
+            if (!runs.empty() && runs.back().start + runs.back().len == b &&
+                &sb.shard_of(b) == &sb.shard_of(runs.back().start))
+                runs.back().len++;
+            else
+                runs.push_back({b, 1});
+        }
+        for (size_t i = 0; i < runs.size(); ) {
+            AllocShard &sh = sb.shard_of(runs[i].start);
+            lock_guard<mutex> g(sh.mu);
+            for (; i < runs.size() && runs[i].start < sh.hi; ++i) {
+                sb.block_bitmap.set_range(runs[i].start, runs[i].len);
+                for (int b = runs[i].start; b < runs[i].start + runs[i].len; ++b)
+                    __atomic_fetch_and(&freed.words[b >> 6], ~(1ULL << (b & 63)), __ATOMIC_RELAXED);
+            }
+        }
+        sb.free_blocks += last.size();
+        return runs;
+    }
+
+    // Blocks freed since the last call, for release_freed() once the
+    // transaction that frees them is durable. Called as it is sealed.
+    vector<int> take_freed() {
+        lock_guard<mutex> g(freed_mu);
+        vector<int> out;
+        out.swap(freed_list);
+        return out;
+    }
+
+    void release_freed(vector<int> &blocks) {
+        if (blocks.empty()) return;
+        release_blocks_to_bitmap(blocks);
+        freed_pending -= blocks.size();
+    }
+
+    void share_extent(const Extent &e) {
+        for (int i = 0; i < e.len; ++i) share_block(e.start + i);
+    }
+
+    void free_extent(const Extent &e) {
+        for (int i = 0; i < e.len; ++i) free_block(e.start + i);
+    }
+
+    // Like share_block, but fails once the last reference is gone.
+    bool try_share(int idx) {
+        uint32_t refs = __atomic_load_n(&sb.block_refs[idx], __ATOMIC_RELAXED);
+        do {
+            if (refs == 0) return false;
+        } while (!__atomic_compare_exchange_n(&sb.block_refs[idx], &refs, refs + 1, true,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        sb.logical_blocks++;
+        return true;
+    }
+
+    // Stores `p` as the contents of the newly allocated block `b` and returns
+    // the block that holds them, or -1 if there is no room. With dedup on, a
+    // block already holding the same bytes gains a reference instead and `b`
+    // is freed; otherwise `b` is stored and indexed. An entry's block cannot
+    // be reused while its shard lock is held, since freeing takes that lock
+    // first; an entry whose block has lost its last reference is replaced.
+    int store_block(int b, const char *p) {
+        if (!dedup.on) return data_blocks.put(b, p) ? b : -1;
+        uint64_t h = fingerprint(p, BLOCK_SIZE);
+        if (h == 0) h = 1;
+        typename DedupIndex::Shard &ds = dedup.shard_of(h);
+        char cur[BLOCK_SIZE];
+        int found = -1;
+        bool collided = false;
+        {
+            lock_guard<mutex> g(ds.mu);
+            auto it = ds.map.find(h);
+            if (it != ds.map.end()) {
+                int d = it->second;
+                if (!data_blocks.read(d, cur) || memcmp(cur, p, BLOCK_SIZE) != 0) collided = true;
+                else if (try_share(d)) found = d;
+            }
+        }
+        if (found >= 0) {
+            free_block(b);
+            stat_add(CNT_DEDUP_HITS);
+            return found;
+        }
+        stat_add(collided ? CNT_DEDUP_COLLISIONS : CNT_DEDUP_MISSES);
+        if (!data_blocks.put(b, p)) return -1;
+        lock_guard<mutex> g(ds.mu);
+        auto r = ds.map.emplace(h, b);
+        if (r.second || __atomic_load_n(&sb.block_refs[r.first->second], __ATOMIC_RELAXED) == 0) {
+            r.first->second = b;
+            __atomic_store_n(&dedup.fp[b], h, __ATOMIC_RELAXED);
+        }
+        return b;
+    }
+
+    // Rebuilds the fingerprint index from the data blocks of every file.
+    // Blocks written before dedup was on keep their duplicates; only later
+    // writes are merged against them.
+    void index_blocks() {
+        dedup.clear();
+        if (!dedup.on) return;
+        vector<int> blocks;
+        for (int i = 0; i < inodes.size(); ++i)
+            if (inodes[i].used && !inodes[i].is_directory)
+                for (int b : file_blocks(inodes[i]))
+                    if (b >= 0 && b < NUM_BLOCKS && !dedup.fp[b]) dedup.fp[b] = 1;
+        for (int b = 0; b < NUM_BLOCKS; ++b)
+            if (dedup.fp[b]) blocks.push_back(b);
+        parallel_for(blocks.size(), 1024, [&](int lo, int hi) {
+            char buf[BLOCK_SIZE];
+            for (int i = lo; i < hi; ++i) {
+                data_blocks.read(blocks[i], buf);
+                uint64_t h = fingerprint(buf, BLOCK_SIZE);
+                dedup.fp[blocks[i]] = h ? h : 1;
+            }
+        });
+        for (int b : blocks) {
+            auto r = dedup.shard_of(dedup.fp[b]).map.emplace(dedup.fp[b], b);
+            if (!r.second) dedup.fp[b] = 0;
+        }
+    }
+
+    // Memory the buffer cache may hold of the volume file; takes effect
+    // once one is attached.
+    void set_cache_budget(size_t bytes) { data_blocks.set_cache_budget(bytes); }
+
+    void set_dedup(bool on) {
+        unique_lock<OpGate> g(ops);
+        dedup.on = on;
+        index_blocks();
+    }
+
+    // The overflow extent block b; false if b has no raw storage.
+    ExtentBlock extent_block(int b) {
+        return ExtentBlock{data_blocks.raw(b)};
+    }
+
+    // Calls fn(extent) in file order until it returns false, reading the
+    // overflow chain only as far as needed.
+    template <class F>
+    void for_each_extent(const Inode &ino, F fn) {
+        for (int i = 0; i < min(ino.nextents, INLINE_EXTENTS); ++i)
+            if (!fn(ino.ext[i])) return;
+        ExtentBlock eb;
+        for (int b = ino.ext_block; b >= 0 && (eb = extent_block(b)); ) {
+            for (int i = 0, n = eb.count(); i < n; ++i)
+                if (!fn(eb.ext(i))) return;
+            b = eb.next();
+        }
+    }
+
+    vector<Extent> file_extents(const Inode &ino) {
+        vector<Extent> out;
+        for_each_extent(ino, [&](const Extent &e) { out.push_back(e); return true; });
+        return out;
+    }
+
+    // Blocks holding the inode's overflow extent records.
+    vector<int> extent_chain(const Inode &ino) {
+        vector<int> out;
+        ExtentBlock eb;
+        for (int b = ino.ext_block; b >= 0 && (eb = extent_block(b)); b = eb.next()) out.push_back(b);
+        return out;
+    }
+
+    vector<int> file_blocks(const Inode &ino) {
+        vector<int> out;
+        for (const Extent &e : file_extents(ino))
+            for (int i = 0; i < e.len; ++i) out.push_back(e.start + i);
+        return out;
+    }
+
+    // Stores `ext` as the inode's mapping, merging adjacent runs and spilling
+    // into newly allocated extent blocks past INLINE_EXTENTS. Returns false if
+    // those blocks cannot be allocated.
+    bool set_extents(Inode &ino, const vector<Extent> &ext) {
+        vector<Extent> merged;
+        for (const Extent &e : ext) {
+            if (!merged.empty() && merged.back().start + merged.back().len == e.start)
+                merged.back().len += e.len;
+            else
+                merged.push_back(e);
+        }
+        int n = merged.size();
+        int overflow = max(0, n - INLINE_EXTENTS);
+        int nblocks = (overflow + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+        vector<int> chain;
+        vector<char*> ebs;
+        for (int i = 0; i < nblocks; ++i) {
+            int b = alloc_block();
+            char *p = b < 0 ? nullptr : data_blocks.put_raw(b);
+            if (!p) {
+                if (b >= 0) free_block(b);
+                for (int c : chain) free_block(c);
+                return false;
+            }
+            chain.push_back(b);
+            ebs.push_back(p);
+        }
+
+        memset(ino.ext, -1, sizeof(ino.ext));
+        for (int i = 0; i < min(n, INLINE_EXTENTS); ++i) ino.ext[i] = merged[i];
+        ino.nextents = n;
+        ino.ext_block = chain.empty() ? -1 : chain[0];
+        int pos = INLINE_EXTENTS;
+        for (int i = 0; i < nblocks; ++i) {
+            int count = min(EXTENTS_PER_BLOCK, n - pos);
+            ExtentBlock::put(ebs[i], i + 1 < nblocks ? chain[i + 1] : -1, &merged[pos], count);
+            pos += count;
+        }
+        return true;
+    }
+
+    // Drops the inode's references to its data and extent blocks.
+    void release_blocks(const Inode &ino) {
+        for (const Extent &e : file_extents(ino)) free_extent(e);
+        for (int b : extent_chain(ino)) free_block(b);
+    }
+
+    // Reference counts are not stored in the image; they follow from the
+    // inodes, so they are recomputed after load and journal replay.
+    void rebuild_block_refs() {
+        fill(sb.block_refs.begin(), sb.block_refs.end(), 0);
+        sb.logical_blocks = 0;
+        for (int i = 0; i < inodes.size(); ++i) {
+            const Inode &ino = inodes[i];
+            if (!ino.used) continue;
+            vector<int> blocks = file_blocks(ino);
+            vector<int> chain = extent_chain(ino);
+            blocks.insert(blocks.end(), chain.begin(), chain.end());
+            for (int b : blocks) {
+                if (b < 0 || b >= NUM_BLOCKS) continue;
+                sb.block_refs[b]++;
+                sb.logical_blocks++;
+            }
+        }
+    }
+
+    string abs_path(const string &path) {
+        if (!path.empty() && path[0] == '/') return path;
+        cwd_dir();
+        const string &cwd = sess().cwd;
+        if (path.empty()) return cwd;
+        if (cwd == "/") return "/" + path;
+        return cwd + "/" + path;
+    }
+
+    // The session's cwd. Another session may have deleted it, and its inode
+    // may have been reused since; then the session is moved back to the root
+    // and told so.
+    int cwd_dir() {
+        Session &s = sess();
+        if (s.cwd_ino.idx == 0) return 0;
+        bool is_dir = false;
+        if (is_live(s.cwd_ino, &is_dir) && is_dir) return s.cwd_ino.idx;
+        s.cwd_ino = {0, 0};
+        s.cwd = "/";
+        out() << "Current directory was deleted, back at /\n";
+        return 0;
+    }
+
+    string dir_path(int ino) {
+        string out;
+        while (ino != 0) {
+            shared_ptr<Directory> d = dir_ptr(ino);
+            if (!d) break;
+            out.insert(0, "/" + d->name);
+            ino = d->parent;
+        }
+        return out.empty() ? "/" : out;
+    }
+
+    static string parent_of(const string &ap) {
+        string parent = ap.substr(0, ap.find_last_of('/'));
+        return parent.empty() ? "/" : parent;
+    }
+
+    // Looks up one path component in `d`, directory number `dir`. The caller
+    // holds d.mu.
+    static int child(const Directory &d, int dir, string_view comp) {
+        if (comp.empty() || comp == ".") return dir;
+        if (comp == "..") return d.parent;
+        return d.find(comp);
+    }
+
+    // Looks up one path component in directory `dir` under its read lock.
+    // The entry pins the inode while the lock is held, so its handle and type
+    // are read there too.
+    InodeHandle step(int dir, string_view comp, bool *is_dir = nullptr) {
+        shared_ptr<Directory> d = dir_ptr(dir);
+        if (!d) return {-1, 0};
+        shared_lock<shared_mutex> g(d->mu);
+        int ino = d->dead ? -1 : child(*d, dir, comp);
+        if (ino < 0) return {-1, 0};
+        if (is_dir) *is_dir = inodes[ino].is_directory;
+        return {ino, inodes[ino].gen};
+    }
+
+    // Walks every component of `path` but the last, starting at the root or
+    // the cwd, and returns the directory holding the last one (stored in
+    // `leaf`). Returns -1 if an intermediate directory does not exist.
+    int resolve_parent(const string &path, string_view &leaf) {
+        string_view p(path);
+        int dir = (!p.empty() && p[0] == '/') ? 0 : cwd_dir();
+        while (p.size() > 1 && p.back() == '/') p.remove_suffix(1);
+        size_t pos = 0;
+        while (true) {
+            while (pos < p.size() && p[pos] == '/') ++pos;
+            size_t end = p.find('/', pos);
+            if (end == string_view::npos) {
+                leaf = p.substr(pos);
+                return dir;
+            }
+            bool is_dir = false;
+            dir = step(dir, p.substr(pos, end - pos), &is_dir).idx;
+            if (dir < 0 || !is_dir) return -1;
+            pos = end;
+        }
+    }
+
+    // True if no component of `path` is "." or "..".
+    static bool plain_path(string_view path) {
+        for (size_t pos = 0; pos < path.size(); ) {
+            size_t end = min(path.find('/', pos), path.size());
+            string_view comp = path.substr(pos, end - pos);
+            if (comp == "." || comp == "..") return false;
+            pos = end + 1;
+        }
+        return true;
+    }
+
+    // Path lookups first consult the dentry cache, keyed by absolute path.
+    // Entries hold an InodeHandle, so one whose inode was freed (or freed and
+    // reused) is recognised as stale and dropped. That also vouches for every
+    // directory on the way, since none goes while it holds a live entry, but
+    // not through "." or "..": such paths are walked every time instead.
+    InodeHandle lookup_handle(const string &path, bool *is_dir = nullptr) {
+        StatTimer t(HIST_LOOKUP, 16);
+        Session &s = sess();
+        string &key = s.path_buf;
+        if (path.empty() || path[0] != '/') {
+            cwd_dir();
+            key = s.cwd;
+            if (s.cwd != "/") key += '/';
+            key += path;
+        } else {
+            key = path;
+        }
+        bool cached = plain_path(key);
+        InodeHandle h = {-1, 0};
+        if (cached) {
+            lock_guard<mutex> g(dcache_mu);
+            auto it = dcache.find(key);
+            if (it != dcache.end()) h = it->second;
+        }
+        if (h.idx >= 0) {
+            if (is_live(h, is_dir)) {
+                stat_add(CNT_DCACHE_HITS);
+                return h;
+            }
+            lock_guard<mutex> g(dcache_mu);
+            dcache.erase(key);
+        }
+        stat_add(CNT_DCACHE_MISSES);
+
+        string_view leaf;
+        int dir = resolve_parent(path, leaf);
+        h = dir < 0 ? InodeHandle{-1, 0} : step(dir, leaf, is_dir);
+        if (h.idx >= 0 && cached) {
+            lock_guard<mutex> g(dcache_mu);
+            if (dcache.size() >= DCACHE_MAX) dcache.clear();
+            dcache.emplace(key, h);
+        }
+        return h;
+    }
+
+    int lookup_inode(const string &path) { return lookup_handle(path).idx; }
+
+    int lookup_dir(const string &path) {
+        bool is_dir = false;
+        int ino = lookup_handle(path, &is_dir).idx;
+        return (ino >= 0 && is_dir) ? ino : -1;
+    }
+
+    void dcache_erase(const string &ap) {
+        lock_guard<mutex> g(dcache_mu);
+        dcache.erase(ap);
+    }
+
+    void cmd_createDir(const string &path) {
+        string ap = abs_path(path);
+        string_view leaf;
+        int parent = resolve_parent(path, leaf);
+        shared_ptr<Directory> pd = parent < 0 ? nullptr : dir_ptr(parent);
+        unique_lock<shared_mutex> pg;
+        if (pd) pg = unique_lock<shared_mutex>(pd->mu);
+        if (!pd || pd->dead) {
+            err() << "Error: Parent directory '" << parent_of(ap) << "' does not exist\n";
+            return;
+        }
+        int existing = child(*pd, parent, leaf);
+        if (existing >= 0) {
+            if (inodes[existing].is_directory) err() << "Directory already exists\n";
+            else err() << "Error: A file or directory with the name '" << leaf << "' already exists\n";
+            return;
+        }
+
+        int ino = alloc_inode();
+
+        if (ino < 0) { err() << "No free inode\n"; return; }
+        Inode &din = inodes[ino];
+        din.used = true;
+        din.is_directory = true;
+        din.ctime = time(nullptr);
+        
+        int block = alloc_block();
+        
+        if (block < 0) { 
+            err() << "No space for directory block\n"; 
+            unique_lock<shared_mutex> il(inode_lock(ino));
+            free_inode(ino);
+            return; 
+        }
+        din.ext[0] = {block, 1};
+        din.nextents = 1;
+
+        string name(leaf);
+        dir_create(ino, parent, name);
+        dir_add(*pd, parent, name, ino);
+        charge(ino, usage_of(din), 1);
+        out() << "Directory created: " << ap << "\n";
+    }
+
+    // Marks the directories below `d` dead, parents first, and lists them
+    // in `dirs` and their files in `files`. The caller holds d.mu exclusively
+    // and d is dead already. Each directory below is locked only while it is
+    // marked; once dead its entries can no longer change.
+    void doom_subtree(Directory &d, vector<int> &dirs, vector<int> &files) {
+        vector<shared_ptr<Directory>> todo;
+        auto take = [&](const Directory &at) {
+            for (const DirEntry &e : at.entries) {
+                if (!inodes[e.inode_idx].is_directory) {
+                    files.push_back(e.inode_idx);
+                    continue;
+                }
+                dirs.push_back(e.inode_idx);
+                if (shared_ptr<Directory> sub = dir_ptr(e.inode_idx)) todo.push_back(sub);
+            }
+        };
+        take(d);
+        while (!todo.empty()) {
+            shared_ptr<Directory> sub = std::move(todo.back());
+            todo.pop_back();
+            unique_lock<shared_mutex> g(sub->mu);
+            sub->dead = true;
+            take(*sub);
+        }
+    }
+
+    // deleteDir [-r] path. With -r the whole subtree goes: its directories
+    // are marked dead top down, then every inode is freed and all their
+    // blocks are returned to the bitmap in one sorted pass.
+    void cmd_deleteDir(const string &path, bool recursive = false) {
+        string ap = abs_path(path);
+        int ino = lookup_dir(path);
+        if (ino < 0) { err() << "Directory not found\n"; return; }
+        if (ino == 0) { err() << "Cannot delete root directory\n"; return; }
+        for (int at = cwd_dir(); at != 0; ) {
+            if (at == ino) {
+                err() << "Cannot delete current directory\n";
+                return;
+            }
+            shared_ptr<Directory> cd = recursive ? dir_ptr(at) : nullptr;
+            if (!cd) break;
+            at = cd->parent;
+        }
+        shared_ptr<Directory> d = dir_ptr(ino);
+        shared_ptr<Directory> pd = d ? dir_ptr(d->parent) : nullptr;
+        if (!pd) { err() << "Directory not found\n"; return; }
+        int parent = d->parent;
+        string name = d->name;
+        unique_lock<shared_mutex> pg(pd->mu);
+        if (pd->dead || pd->find(name) != ino) { err() << "Directory not found\n"; return; }
+        unique_lock<shared_mutex> g(d->mu);
+        if (!recursive && !d->entries.empty()) { err() << "Directory not empty\n"; return; }
+        d->dead = true;
+        vector<int> dirs = {ino}, files;
+        if (recursive) doom_subtree(*d, dirs, files);
+        charge(parent, d->usage(), -1);
+        vector<int> blocks;
+        auto drop = [&](int i) {
+            unique_lock<shared_mutex> il(inode_lock(i));
+            vector<int> data = file_blocks(inodes[i]), chain = extent_chain(inodes[i]);
+            blocks.insert(blocks.end(), data.begin(), data.end());
+            blocks.insert(blocks.end(), chain.begin(), chain.end());
+            free_inode(i);
+        };
+        for (int i : files) drop(i);
+        for (int i : dirs) {
+            drop(i);
+            dir_erase(i);
+        }
+        free_block_batch(blocks);
+        dir_remove(*pd, parent, name);
+        dcache_erase(ap);
+        out() << "Directory deleted: " << ap;
+        if (recursive) out() << " (" << dirs.size() - 1 << " directories, " << files.size() << " files below)";
+        out() << "\n";
+    }
+
+    void cmd_changeDir(const string &path) {
+        Session &s = sess();
+        if (path == "..") {
+        int cwd = cwd_dir();
+        if (cwd == 0) {
+            err() << "Already at root directory\n";
+            return;
+        }
+
+        shared_ptr<Directory> d = dir_ptr(cwd);
+        if (!d) { err() << "Directory not found\n"; return; }
+        s.cwd_ino = {d->parent, inodes[d->parent].gen};
+        s.cwd = dir_path(d->parent);
+        out() << "Current directory: " << s.cwd << "\n";
+        } else {
+        bool is_dir = false;
+        InodeHandle h = lookup_handle(path, &is_dir);
+        if (h.idx < 0 || !is_dir) { 
+            err() << "Directory not found\n"; 
+            return; 
+        }
+
+        s.cwd_ino = h;
+        s.cwd = dir_path(h.idx);
+        out() << "Current directory: " << s.cwd << "\n";
+        }
+    }
+
+    // dir [offset [count]]: the entries of the cwd, subdirectories first, each
+    // kind oldest first. Entries are read straight from the listing order, so
+    // a page costs the same wherever it starts.
+    void cmd_dir(int64_t offset = 0, int64_t count = INT64_MAX) {
+        shared_ptr<Directory> cur = dir_ptr(cwd_dir());
+        if (!cur) { err() << "Directory not found\n"; return; }
+        shared_lock<shared_mutex> g(cur->mu);
+        if (cur->dead) { err() << "Directory not found\n"; return; }
+        int64_t total = cur->entries.size();
+        int64_t first = min(max<int64_t>(offset, 0), total);
+        int64_t end = first + min(max<int64_t>(count, 0), total - first);
+
+        ostream &os = out();
+        char tbuf[32];
+        for (int64_t k = first; k < end; ++k) {
+            const DirEntry &e = cur->listed(k);
+            os << (e.is_dir ? "[DIR]  " : "[FILE] ") << std::setw(20) << std::left << e.name;
+            if (e.is_dir) os << " entries = " << (e.sub ? e.sub->nentries.load(memory_order_relaxed) : 0);
+            else os << " size = " << inodes[e.inode_idx].size << "B";
+            os << ", created = " << ctime_r(&e.ctime, tbuf);
+        }
+        if (offset != 0 || count != INT64_MAX)
+            os << "Entries " << first << " to " << end << " of " << total << "\n";
+    }
+
+
+    // Seed for a file created without an explicit one: distinct for every
+    // file, including several created within the same second.
+    uint64_t next_fill_seed() { return Wyrand(fill_seed++).next(); }
+
+    // The blocks are allocated and filled before the parent is write-locked,
+    // so only the name check and the insert are serialised per directory.
+    void cmd_createFile(const string &path, int size_kb, FillEngine fill) {
+        int64_t size_bytes = (int64_t)size_kb * 1024;
+        int64_t needed = (size_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (needed > NUM_BLOCKS) { 
+            err() << "Exceeds max file size\n"; 
+            return; 
+        }
+        string ap = abs_path(path);
+
+        string_view leaf;
+        int parent = resolve_parent(path, leaf);
+        shared_ptr<Directory> pd = parent < 0 ? nullptr : dir_ptr(parent);
+        string name(leaf);
+        int existing = -1;
+        if (pd) {
+            shared_lock<shared_mutex> g(pd->mu);
+            if (pd->dead) pd = nullptr;
+            else existing = child(*pd, parent, leaf);
+        }
+        if (!pd) {
+            err() << "Error: Parent directory '" << parent_of(ap) << "' does not exist\n";
+            return;
+        }
+        if (existing >= 0) {
+            err() << "Error: A file or directory with the name '" << name << "' already exists\n";
+            return;
+        }
+
+        int ino_idx = alloc_inode();
+        if (ino_idx < 0) { err() << "No free inode\n"; return; }
+        Inode &fin = inodes[ino_idx]; 
+        fin.used = true; 
+        fin.size = size_bytes; 
+        fin.ctime = time(nullptr);
+
+        auto discard = [&] {
+            unique_lock<shared_mutex> il(inode_lock(ino_idx));
+            release_blocks(fin);
+            free_inode(ino_idx);
+        };
+        vector<Extent> extents;
+        if (!alloc_extents(needed, extents)) {
+            err() << "No space\n";
+            discard();
+            return;
+        }
+
+        // Contents are generated FILL_CHUNK bytes at a time, each chunk a
+        // stream seeded from the file seed and its offset, and stored block by
+        // block. Zero-filled files are done: new blocks already read as zeros.
+        if (fill.pattern != FillPattern::Zeros) {
+            vector<int> blocks;
+            for (const Extent &e : extents)
+                for (int i = 0; i < e.len; ++i) blocks.push_back(e.start + i);
+            string &buf = sess().io_buf;
+            buf.resize(FILL_CHUNK);
+            for (int64_t i = 0; i < needed; ++i) {
+                int64_t at = i * BLOCK_SIZE, k = at % FILL_CHUNK;
+                if (k == 0) {
+                    int64_t n = min<int64_t>(FILL_CHUNK, size_bytes - at);
+                    FillEngine part = {fill.pattern, fill.seed ^ (uint64_t)at};
+                    part.fill(&buf[0], n);
+                    memset(&buf[n], 0, FILL_CHUNK - n);
+                }
+                int b = store_block(blocks[i], &buf[k]);
+                if (b < 0) {
+                    err() << "No space\n";
+                    for (int c : blocks) free_block(c);
+                    discard();
+                    return;
+                }
+                blocks[i] = b;
+            }
+            extents.clear();
+            for (int b : blocks) {
+                if (!extents.empty() && extents.back().start + extents.back().len == b) extents.back().len++;
+                else extents.push_back({b, 1});
+            }
+        }
+        if (!set_extents(fin, extents)) {
+            err() << "No space\n";
+            for (const Extent &e : extents) free_extent(e);
+            discard();
+            return;
+        }
+
+        unique_lock<shared_mutex> pg(pd->mu);
+        if (pd->dead) {
+            pg.unlock();
+            err() << "Error: Parent directory '" << parent_of(ap) << "' does not exist\n";
+            discard();
+            return;
+        }
+        if (child(*pd, parent, leaf) >= 0) {
+            pg.unlock();
+            err() << "Error: A file or directory with the name '" << name << "' already exists\n";
+            discard();
+            return;
+        }
+        dir_add(*pd, parent, name, ino_idx);
+        charge(parent, usage_of(fin), 1);
+        pg.unlock();
+        stat_add(CNT_BYTES_WRITTEN, size_bytes);
+        out() << "File created: " << ap << " " << size_kb << "KB\n";
+    }
+
+    void cmd_deleteFile(const string &path) {
+        string ap = abs_path(path);
+        string_view leaf;
+        int parent = resolve_parent(path, leaf);
+        shared_ptr<Directory> pd = parent < 0 ? nullptr : dir_ptr(parent);
+        unique_lock<shared_mutex> pg;
+        if (pd) pg = unique_lock<shared_mutex>(pd->mu);
+        int ino_idx = (!pd || pd->dead) ? -1 : child(*pd, parent, leaf);
+        if (ino_idx < 0) { err() << "File not found\n"; return; }
+        if (inodes[ino_idx].is_directory) {
+            err() << "Error: '" << ap << "' is a directory\n";
+            return;
+        }
+        string name(leaf);
+
+        Usage u;
+        {
+            unique_lock<shared_mutex> il(inode_lock(ino_idx));
+            u = usage_of(inodes[ino_idx]);
+            release_blocks(inodes[ino_idx]);
+            free_inode(ino_idx);
+        }
+        dir_remove(*pd, parent, name);
+        charge(parent, u, -1);
+        pg.unlock();
+        dcache_erase(ap);
+
+        out() << "File deleted: " << ap << "\n";
+    }
+
+    void cmd_cp(const string &src, const string &dst) {
+        bool src_dir = false;
+        InodeHandle sh = lookup_handle(src, &src_dir);
+        int sidx = sh.idx;
+        if (sidx < 0) {
+            err() << "Source not found\n";
+            return;
+        }
+
+        string abs_src = abs_path(src);
+        string abs_dst = abs_path(dst);
+
+        string_view leaf;
+        int parent = resolve_parent(dst, leaf);
+        shared_ptr<Directory> pd = parent < 0 ? nullptr : dir_ptr(parent);
+        if (!pd) {
+            err() << "Error: Parent directory '" << parent_of(abs_dst) << "' does not exist\n";
+            return;
+        }
+        string name(leaf);
+
+        if (src_dir) {
+            for (int d = parent; ; ) {
+                if (d == sidx) {
+                    err() << "Error: Cannot copy a directory into its subdirectory\n";
+                    return;
+                }
+                shared_ptr<Directory> dp = d == 0 ? nullptr : dir_ptr(d);
+                if (!dp) break;
+                d = dp->parent;
+            }
+            copy_tree(sh, parent, leaf, pd, abs_src, abs_dst);
+            return;
+        }
+
+        unique_lock<shared_mutex> pg(pd->mu);
+        if (pd->dead) {
+            err() << "Error: Parent directory '" << parent_of(abs_dst) << "' does not exist\n";
+            return;
+        }
+        if (child(*pd, parent, leaf) >= 0) {
+            err() << "Error: Target '" << name << "' already exists\n";
+            return;
+        }
+
+        // Copy-on-write: the new inode maps the same data and extent blocks and
+        // only their reference counts change.
+        int didx = alloc_inode();
+        if (didx < 0) {
+            err() << "No free inode\n";
+            return;
+        }
+
+        Inode &din = inodes[didx];
+        bool copied = false;
+        {
+            shared_lock<shared_mutex> il(inode_lock(sidx));
+            if (Inode *sin = resolve(sh)) {
+                din.used = true;
+                din.size = sin->size;
+                din.ctime = time(nullptr);
+                memcpy(din.ext, sin->ext, sizeof(din.ext));
+                din.nextents = sin->nextents;
+                din.ext_block = sin->ext_block;
+                for (const Extent &e : file_extents(*sin))
+                    share_extent(e);
+                for (int b : extent_chain(*sin))
+                    share_block(b);
+                copied = true;
+            }
+        }
+        if (!copied) {
+            unique_lock<shared_mutex> il(inode_lock(didx));
+            free_inode(didx);
+            err() << "Source not found\n";
+            return;
+        }
+
+        dir_add(*pd, parent, name, didx);
+        charge(parent, usage_of(din), 1);
+        pg.unlock();
+        stat_add(CNT_BYTES_COPIED, din.size);
+        out() << "Copied " << src << " to " << dst << "\n";
+    }
+
+    TaskPool &task_pool() {
+        call_once(pool_once, [&] {
+            int n = thread::hardware_concurrency();
+            pool.reset(new TaskPool(max(0, n - 1)));
+        });
+        return *pool;
+    }
+
+    // One inode of a tree being copied. Nodes are listed in pre-order.
+    struct CopyNode {
+        InodeHandle src;
+        bool is_dir;
+        int64_t blocks;         // data blocks of a file
+        int parent;             // index of the parent node, -1 for the top
+        string name, rel;       // rel is the path below the top, "" for the top
+        vector<int> children;
+        int ino, block;         // reserved inode and directory block
+        shared_ptr<Directory> dir;
+        bool done;              // directory created or file blocks shared
+    };
+
+    // Lists the subtree below node `at`. Each directory is read under its
+    // own lock; the handles let the copy notice anything deleted meanwhile.
+    bool plan_tree(vector<CopyNode> &nodes, int at) {
+        shared_ptr<Directory> d = dir_ptr(nodes[at].src.idx);
+        if (!d) return false;
+        vector<CopyNode> kids;
+        {
+            shared_lock<shared_mutex> g(d->mu);
+            if (d->dead) return false;
+            for (const DirEntry &e : d->entries) {
+                const Inode &in = inodes[e.inode_idx];
+                kids.push_back({{e.inode_idx, in.gen}, in.is_directory, (in.size + BLOCK_SIZE - 1) / BLOCK_SIZE,
+                                at, e.name, nodes[at].rel + "/" + e.name, {}, -1, -1, nullptr, false});
+            }
+        }
+        for (CopyNode &k : kids) {
+            nodes[at].children.push_back(nodes.size());
+            nodes.push_back(std::move(k));
+            if (nodes.back().is_dir && !plan_tree(nodes, nodes.size() - 1)) return false;
+        }
+        return true;
+    }
+
+    void copy_link(vector<CopyNode> &nodes, int i) {
+        CopyNode &n = nodes[i];
+        CopyNode &p = nodes[n.parent];
+        unique_lock<shared_mutex> g(p.dir->mu);
+        dir_add(*p.dir, p.ino, n.name, n.ino);
+    }
+
+    bool copy_dir_node(vector<CopyNode> &nodes, int i, int parent_ino) {
+        CopyNode &n = nodes[i];
+        if (!is_live(n.src)) return false;
+        Inode &din = inodes[n.ino];
+        din.is_directory = true;
+        din.ext[0] = {n.block, 1};
+        din.nextents = 1;
+        n.dir = dir_create(n.ino, parent_ino, n.name);
+        n.done = true;
+        return true;
+    }
+
+    bool copy_file_node(vector<CopyNode> &nodes, int i) {
+        CopyNode &n = nodes[i];
+        Inode &din = inodes[n.ino];
+        {
+            shared_lock<shared_mutex> il(inode_lock(n.src.idx));
+            Inode *sin = resolve(n.src);
+            if (!sin) return false;
+            din.size = sin->size;
+            memcpy(din.ext, sin->ext, sizeof(din.ext));
+            din.nextents = sin->nextents;
+            din.ext_block = sin->ext_block;
+            for (const Extent &e : file_extents(*sin))
+                share_extent(e);
+            for (int b : extent_chain(*sin))
+                share_block(b);
+            n.done = true;
+        }
+        stat_add(CNT_BYTES_COPIED, din.size);
+        copy_link(nodes, i);
+        return true;
+    }
+
+    // Creates the children of directory node `i`. Subdirectories become
+    // tasks of their own, large files too, and small files go in batches.
+    void copy_children(vector<CopyNode> &nodes, int i, atomic<bool> &failed, TaskPool &tp) {
+        static constexpr int FILE_BATCH = 64;
+        static constexpr int64_t LARGE_FILE_BLOCKS = 1024;
+        auto copy_files = [this, &nodes, &failed](vector<int> batch) {
+            for (int c : batch)
+                if (failed || !copy_file_node(nodes, c)) { failed = true; return; }
+        };
+        vector<int> batch;
+        for (int c : nodes[i].children) {
+            if (failed) return;
+            if (nodes[c].is_dir) {
+                tp.spawn([this, &nodes, &failed, &tp, c, i] {
+                    if (failed) return;
+                    if (!copy_dir_node(nodes, c, nodes[i].ino)) { failed = true; return; }
+                    copy_link(nodes, c);
+                    copy_children(nodes, c, failed, tp);
+                });
+            } else if (nodes[c].blocks >= LARGE_FILE_BLOCKS) {
+                tp.spawn([copy_files, c] { copy_files({c}); });
+            } else {
+                batch.push_back(c);
+                if ((int)batch.size() == FILE_BATCH) {
+                    tp.spawn([copy_files, batch] { copy_files(batch); });
+                    batch.clear();
+                }
+            }
+        }
+        copy_files(batch);
+    }
+
+    // Recursive copy of a directory. The source subtree is listed first, and
+    // inodes and directory blocks for all of it are reserved in one go, so
+    // the workers never go to the allocators. Directories and files are then
+    // created as tasks on the pool. The copy is linked into the destination
+    // only once it is complete; if any part fails everything is undone, so
+    // other sessions see either the whole copy or nothing.
+    void copy_tree(InodeHandle src, int parent, string_view leaf, shared_ptr<Directory> pd,
+                   const string &abs_src, const string &abs_dst) {
+        string name(leaf);
+        {
+            shared_lock<shared_mutex> g(pd->mu);
+            if (child(*pd, parent, leaf) >= 0) {
+                err() << "Error: Target '" << name << "' already exists\n";
+                return;
+            }
+        }
+        vector<CopyNode> nodes;
+        nodes.push_back({src, true, 0, -1, name, "", {}, -1, -1, nullptr, false});
+        if (!plan_tree(nodes, 0)) {
+            err() << "Source not found\n";
+            return;
+        }
+
+        vector<int> inos;
+        if (!alloc_inodes(nodes.size(), inos)) {
+            err() << "No free inode\n";
+            return;
+        }
+        int ndirs = 0;
+        for (const CopyNode &n : nodes) ndirs += n.is_dir;
+        vector<Extent> dir_blocks;
+        if (!alloc_extents(ndirs, dir_blocks)) {
+            for (int i : inos) {
+                unique_lock<shared_mutex> il(inode_lock(i));
+                free_inode(i);
+            }
+            err() << "No space for directory block\n";
+            return;
+        }
+        size_t ext = 0;
+        int off = 0;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            nodes[i].ino = inos[i];
+            if (!nodes[i].is_dir) continue;
+            nodes[i].block = dir_blocks[ext].start + off;
+            if (++off == dir_blocks[ext].len) ++ext, off = 0;
+        }
+
+        atomic<bool> failed(!copy_dir_node(nodes, 0, parent));
+        if (!failed) {
+            TaskPool &tp = task_pool();
+            tp.run([&] { copy_children(nodes, 0, failed, tp); });
+        }
+        // The copy is not linked yet, so its totals can be set directly,
+        // bottom up; its parents are charged once it is linked.
+        vector<Usage> sub(nodes.size(), Usage{0, 0, 0});
+        if (!failed) {
+            for (size_t i = nodes.size(); i-- > 0; ) {
+                sub[i].add(usage_of(inodes[nodes[i].ino]));
+                if (nodes[i].parent >= 0) sub[nodes[i].parent].add(sub[i]);
+                if (nodes[i].is_dir) nodes[i].dir->charge(sub[i], 1);
+            }
+        }
+        bool exists = false;
+        unique_lock<shared_mutex> pg(pd->mu);
+        if (!failed) {
+            exists = pd->dead || child(*pd, parent, leaf) >= 0;
+            if (!exists) {
+                dir_add(*pd, parent, name, nodes[0].ino);
+                charge(parent, sub[0], 1);
+            }
+        }
+        pg.unlock();
+
+        if (failed || exists) {
+            for (size_t i = nodes.size(); i-- > 0; ) {
+                CopyNode &n = nodes[i];
+                if (n.done && n.is_dir) dir_erase(n.ino);
+                unique_lock<shared_mutex> il(inode_lock(n.ino));
+                if (n.done && !n.is_dir) release_blocks(inodes[n.ino]);
+                free_inode(n.ino);
+            }
+            for (const Extent &e : dir_blocks) free_extent(e);
+            if (exists) err() << "Error: Target '" << name << "' already exists\n";
+            else err() << "Error: Source changed during copy, nothing copied\n";
+            return;
+        }
 
-public:
-    FileSystem()
-        : inodes(MAX_INODES), data_blocks(NUM_BLOCKS, nullptr), cwd("/") {
-        for (int i = 0; i < NUM_BLOCKS; ++i)
-            data_blocks[i] = new char[BLOCK_SIZE];
-        init_root();
+        ostream &os = out();
+        for (const CopyNode &n : nodes) {
+            if (n.is_dir) os << "Directory created: " << abs_dst << n.rel << "\n";
+            else os << "Copied " << abs_src << n.rel << " to " << abs_dst << n.rel << "\n";
+        }
     }
 
-    ~FileSystem() {
-        for (auto ptr : data_blocks)
-            delete[] ptr;
+    // Blocks freed by a transaction that is not committed yet are still
+    // used, but no file references them; they count as pending, not as
+    // physical.
+    void cmd_sum() {
+        long long total = sb.total_blocks, free_blocks = sb.free_blocks, logical = sb.logical_blocks;
+        long long pending = freed_pending;
+        ostream &os = out();
+        os << "Total blocks: " << total
+           << " Used: " << (total - free_blocks)
+           << " Free: " << free_blocks;
+        if (pending) os << " Pending free: " << pending;
+        os << "\n";
+        long long physical = max(0LL, total - free_blocks - pending);
+        os << "Logical: " << logical << " blocks ("
+           << logical * BLOCK_SIZE / 1024 << "KB)"
+           << " Physical: " << physical << " blocks ("
+           << physical * BLOCK_SIZE / 1024 << "KB)"
+           << " Shared savings: " << max(0LL, logical - physical) << " blocks\n";
+        long long stored = data_blocks.used_granules() * GRANULE;
+        os << "Stored: " << stored / 1024 << "KB of " << FS_SIZE / 1024 << "KB, compression "
+           << fixed << setprecision(2) << (stored ? (double)physical * BLOCK_SIZE / stored : 0.0) << "x\n";
+        os.unsetf(ios::floatfield);
+        os << setprecision(6);
+        // Free blocks are logical, OVERCOMMIT per stored one; what can still
+        // be written depends on how well it compresses. Data that does not
+        // compress takes a whole block of the arena each.
+        long long room = (long long)NUM_GRANULES * GRANULE - stored;
+        long long incompressible = min<long long>(free_blocks, room / BLOCK_SIZE);
+        os << "Capacity: " << room / 1024 << "KB stored free, room for " << incompressible << " of the "
+           << free_blocks << " free blocks if incompressible\n";
     }
 
-    void init_root() {
-        Inode &root = inodes[0];
-        root.used = true;
-        root.is_directory = true;
-        root.ctime = time(nullptr);
-        directories["/"] = {};
+    // du [path]: bytes, blocks and inodes of a subtree, read from the totals
+    // its directory keeps, or of a single file.
+    void cmd_du(const string &path) {
+        bool is_dir = false;
+        InodeHandle h = lookup_handle(path, &is_dir);
+        Usage u = {0, 0, 0};
+        bool found = false;
+        if (h.idx >= 0 && is_dir) {
+            shared_ptr<Directory> d = dir_ptr(h.idx);
+            if (d && !d->dead) u = d->usage(), found = true;
+        } else if (h.idx >= 0) {
+            shared_lock<shared_mutex> il(inode_lock(h.idx));
+            if (Inode *ino = resolve(h)) u = usage_of(*ino), found = true;
+        }
+        if (!found) { err() << "File not found\n"; return; }
+        out() << abs_path(path) << ": " << u.bytes << "B in " << u.blocks << " blocks ("
+              << u.blocks * BLOCK_SIZE / 1024 << "KB), " << u.inodes << " inodes\n";
     }
 
-    int alloc_inode() {
-        for (int i = 0; i < MAX_INODES; ++i) {
-            if (!inodes[i].used) {
-                inodes[i].used = true;
-                inodes[i].ctime = time(nullptr);
-                return i;
+    // Writes all of `iov` to fd, gathered with writev up to IOV_MAX spans at a
+    // time; false if the descriptor fails.
+    static bool writev_all(int fd, vector<iovec> &iov) {
+        for (size_t i = 0; i < iov.size(); ) {
+            ssize_t k = writev(fd, &iov[i], min<size_t>(iov.size() - i, IOV_MAX));
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) return false;
+            for (; i < iov.size() && (size_t)k >= iov[i].iov_len; ++i) k -= iov[i].iov_len;
+            if (i < iov.size()) {
+                iov[i].iov_base = (char *)iov[i].iov_base + k;
+                iov[i].iov_len -= k;
             }
         }
-        return -1;
+        return true;
     }
 
-    int alloc_block() {
-        for (int i = 0; i < NUM_BLOCKS; ++i) {
-            if (sb.block_bitmap[i]) {
-                sb.block_bitmap[i] = false;
-                sb.free_blocks--;
-                memset(data_blocks[i], 0, BLOCK_SIZE);
-                return i;
+    // Bytes [from, to) of the file as spans, with the arena behind the next
+    // READAHEAD_BLOCKS read ahead. Raw blocks are used where they lie in the
+    // arena; the others are decoded through the block cache into buf. Returns
+    // the bytes covered; a block that cannot be decoded ends the range early
+    // and is reported in `bad`. The caller holds the inode's lock, and pins
+    // the store before letting go of it if any span is in the arena.
+    size_t read_spans(const Inode &ino, int64_t from, int64_t to, char *buf, vector<iovec> &spans,
+                      bool &in_arena, int64_t &bad) {
+        int64_t ra_end = min<int64_t>(ino.size, from + (int64_t)READAHEAD_BLOCKS * BLOCK_SIZE);
+        int64_t pos = 0;
+        size_t total = 0, used = 0;
+        char tmp[BLOCK_SIZE];
+        spans.clear();
+        auto add = [&](const char *p, size_t n) {
+            iovec *last = spans.empty() ? nullptr : &spans.back();
+            if (last && (const char *)last->iov_base + last->iov_len == p) last->iov_len += n;
+            else spans.push_back({const_cast<char *>(p), n});
+            total += n;
+        };
+        for_each_extent(ino, [&](const Extent &e) {
+            int64_t ext_end = pos + (int64_t)e.len * BLOCK_SIZE;
+            if (ext_end > from) {
+                int first = max<int64_t>(0, (from - pos) / BLOCK_SIZE);
+                int ahead = min<int64_t>(e.len, (ra_end - pos + BLOCK_SIZE - 1) / BLOCK_SIZE);
+                if (ahead > first) data_blocks.readahead(e.start + first, ahead - first);
+                for (int i = first; i < e.len; ++i) {
+                    int64_t at = pos + (int64_t)i * BLOCK_SIZE;
+                    if (at >= to) break;
+                    int64_t lo = max(from, at) - at, hi = min(to, at + BLOCK_SIZE) - at;
+                    if (const char *p = data_blocks.raw(e.start + i)) {
+                        in_arena = true;
+                        add(p + lo, hi - lo);
+                        continue;
+                    }
+                    bool whole = lo == 0 && hi == BLOCK_SIZE;
+                    if (!data_blocks.fetch(e.start + i, whole ? buf + used : tmp)) {
+                        bad = e.start + i;
+                        break;
+                    }
+                    if (!whole) memcpy(buf + used, tmp + lo, hi - lo);
+                    add(buf + used, hi - lo);
+                    used += hi - lo;
+                }
             }
+            pos = ext_end;
+            return pos < to && bad < 0;
+        });
+        return total;
+    }
+
+    // Bytes [off, off + len) of the file, clamped to its size, sent out a
+    // CAT_DIRECT_BYTES chunk at a time. Each chunk's spans are gathered with
+    // ops and the inode read-locked and written once both are dropped, so a
+    // reader that stops draining its socket holds up nobody else; the store
+    // stays pinned meanwhile, so raw blocks go out straight from the arena.
+    // Small reads go through the output stream; larger ones are written to
+    // the session's descriptor with writev. A file deleted between chunks
+    // ends the output with an error.
+    void cmd_cat(const string &path, int64_t off = 0, int64_t len = INT64_MAX) {
+        InodeHandle h;
+        {
+            shared_lock<OpGate> g(ops);
+            h = lookup_handle(path);
         }
-        return -1;
+        if (h.idx < 0) { err() << "File not found\n"; return; }
+        ostream &os = out();
+        string &buf = sess().io_buf;
+        buf.resize(CAT_DIRECT_BYTES);
+        vector<iovec> &iov = sess().iov;
+        int64_t cur = off, end = -1, bad = -1;
+        bool direct = false, ok = true;
+        do {
+            size_t used = 0;
+            bool pinned = false;
+            {
+                shared_lock<OpGate> g(ops);
+                shared_lock<shared_mutex> il(inode_lock(h.idx));
+                Inode *ino = resolve(h);
+                if (!ino) {
+                    err() << (end < 0 ? "File not found\n" : "\nError: file was deleted while being read\n");
+                    return;
+                }
+                if (end < 0) {
+                    end = off + min(len, max<int64_t>(ino->size - off, 0));
+                    direct = off >= 0 && end - off >= (int64_t)CAT_DIRECT_BYTES;
+                    if (off < 0 || off >= end) break;
+                    stat_add(CNT_BYTES_READ, end - off);
+                }
+                used = read_spans(*ino, cur, min<int64_t>(end, cur + CAT_DIRECT_BYTES), &buf[0], iov, pinned, bad);
+                if (pinned) data_blocks.pin();
+            }
+            cur += used;
+            if (direct) {
+                os.flush();
+                ok = writev_all(sess().out_fd, iov);
+            } else {
+                for (const iovec &v : iov) os.write((const char *)v.iov_base, v.iov_len);
+            }
+            if (pinned) data_blocks.unpin();
+        } while (ok && bad < 0 && cur < end);
+        if (bad >= 0) err() << "\nError: block " << bad << " cannot be decoded";
+        os << "\n";
     }
 
-    void free_block(int idx) {
-        if (idx < 0) return;
-        sb.block_bitmap[idx] = true;
-        sb.free_blocks++;
+    struct Fragmentation {
+        int free_runs = 0, largest_free = 0;
+        long long files = 0, extents = 0, fragmented = 0;
+    };
+
+    // Free-space runs and extents per file; the caller holds ops exclusively.
+    Fragmentation fragmentation() {
+        Fragmentation f;
+        const BlockBitmap &bm = sb.block_bitmap;
+        for (int b = 0; b < NUM_BLOCKS; ) {
+            if (!bm.test(b)) { ++b; continue; }
+            int len = bm.run_length(b, NUM_BLOCKS - b);
+            f.free_runs++;
+            f.largest_free = max(f.largest_free, len);
+            b += len;
+        }
+        for (int i = 0; i < (int)inodes.size(); ++i) {
+            const Inode &ino = inodes[i];
+            if (!ino.used || ino.is_directory) continue;
+            f.files++;
+            f.extents += ino.nextents;
+            if (ino.nextents > 1) f.fragmented++;
+        }
+        return f;
     }
 
-    string abs_path(const string &path) {
-        if (path.empty()) return cwd;
-        if (path[0] == '/') return path;
-        if (cwd == "/") return "/" + path;
-        return cwd + "/" + path;
+    // A file's extents and the runs its blocks' stored forms make in the
+    // arena, taken in file order.
+    struct FileLayout {
+        long long extents = 0, runs = 0, fragmented = 0;
+        void add(const FileLayout &o) { extents += o.extents, runs += o.runs, fragmented += o.fragmented; }
+    };
+
+    FileLayout layout(const Inode &ino) {
+        FileLayout l;
+        l.extents = ino.nextents;
+        l.fragmented = ino.nextents > 1;
+        int next = -1;
+        for_each_extent(ino, [&](const Extent &e) {
+            for (int i = 0; i < e.len; ++i) {
+                uint32_t m = data_blocks.get_entry(e.start + i);
+                if (!m) continue;
+                if (BlockStore::first_of(m) != next) l.runs++;
+                next = BlockStore::first_of(m) + BlockStore::count_of(m);
+            }
+            return true;
+        });
+        return l;
     }
 
-    int lookup_inode(const string &path) {
-        string ap = abs_path(path);
-        string parent = ap.substr(0, ap.find_last_of('/'));
-        if (parent.empty()) parent = "/";
-        string name = ap.substr(ap.find_last_of('/') + 1);
-        for (auto &e : directories[parent]) {
-            if (e.name == name) return e.inode_idx;
+    // Where a defrag pass stands between steps. The file in progress is
+    // held by handle, so one deleted in between is dropped.
+    struct DefragPass {
+        int next = 1, last = 0;     // inodes still to look at
+        InodeHandle h = {-1, 0};    // file in progress
+        int pos = 0;                // its blocks placed so far
+        int placed = -1;            // block after the last one placed
+        int pack = 0;               // its blocks whose storage is packed
+        int stored = -1;            // granule after the last of them
+        FileLayout was, before, after;
+        long long files = 0, rewritten = 0, moved = 0, repacked = 0;
+    };
+
+    // Moves the only reference to block `from`, with its storage and dedup
+    // entry, to the newly allocated block `to`. `from` stays allocated until
+    // the caller frees it.
+    void move_block(int from, int to) {
+        data_blocks.move_entry(from, to);
+        if (uint64_t h = __atomic_load_n(&dedup.fp[from], __ATOMIC_RELAXED)) {
+            typename DedupIndex::Shard &ds = dedup.shard_of(h);
+            lock_guard<mutex> g(ds.mu);
+            auto it = ds.map.find(h);
+            if (it != ds.map.end() && it->second == from) {
+                it->second = to;
+                __atomic_store_n(&dedup.fp[to], h, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&dedup.fp[from], 0, __ATOMIC_RELAXED);
         }
-        return -1;
     }
 
-    void cmd_createDir(const string &path) {
-        string ap = abs_path(path);
-        if (directories.count(ap)) {
-            cout << "Directory already exists\n";
-            return;
+    // Works on file p.h until `until`, at least one chunk per call. First
+    // its runs are moved, up to DEFRAG_CHUNK blocks at a time, to follow the
+    // blocks placed before them; a run that is at least as long as the room
+    // found stays put, and so do blocks another file shares. The extents are
+    // rewritten before returning. Then the stored forms of its blocks are
+    // packed in file order, DEFRAG_PACK_BYTES at a time, each move taken only
+    // if it leaves the file in fewer runs, so repeated passes settle. True
+    // once the file is done. The caller holds ops exclusively.
+    bool defrag_file(DefragPass &p, Inode &ino, uint64_t until) {
+        vector<int> blocks = file_blocks(ino);
+        int n = blocks.size();
+        vector<pair<int, int>> moved;
+        bool any = false;
+        auto sole = [&](int b) { return __atomic_load_n(&sb.block_refs[b], __ATOMIC_RELAXED) == 1; };
+        for (; p.pos < n && (!any || stat_now() < until); any = true) {
+            int b = blocks[p.pos], len = 1, want = 0;
+            while (p.pos + len < n && len < DEFRAG_CHUNK && blocks[p.pos + len] == b + len) ++len;
+            while (p.pos + want < n && want < DEFRAG_CHUNK && sole(blocks[p.pos + want])) ++want;
+            int got = 0, at = -1;
+            if (b != p.placed && want > 0) {
+                at = alloc_at(p.placed, want, got);
+                if (at < 0 && len < want) at = alloc_extent(want, got);
+                if (at >= 0 && got <= len && !(at == p.placed && got == len)) {
+                    free_extent({at, got});
+                    at = -1;
+                }
+            }
+            if (at < 0) {
+                p.pos += len;
+                p.placed = b + len;
+                continue;
+            }
+            for (int i = 0; i < got; ++i) {
+                move_block(blocks[p.pos + i], at + i);
+                moved.emplace_back(blocks[p.pos + i], at + i);
+                blocks[p.pos + i] = at + i;
+            }
+            p.pos += got;
+            p.placed = at + got;
         }
-
-        size_t lastSlash = ap.find_last_of('/');
-        string parent = ap.substr(0, lastSlash);
-        if (parent.empty()) parent = "/";
-        if (!directories.count(parent)) {
-            cout << "Error: Parent directory '" << parent << "' does not exist\n";
-            return;
+        if (!moved.empty()) {
+            vector<int> chain = extent_chain(ino);
+            vector<Extent> ext;
+            for (int b : blocks) ext.push_back({b, 1});
+            if (set_extents(ino, ext)) {
+                for (const pair<int, int> &m : moved) free_block(m.first);
+                for (int c : chain) free_block(c);
+                mark_inode(p.h.idx);
+                p.moved += moved.size();
+                stat_add(CNT_DEFRAG_MOVED, moved.size());
+            } else {
+                for (auto it = moved.rbegin(); it != moved.rend(); ++it) {
+                    move_block(it->second, it->first);
+                    free_block(it->second);
+                }
+                blocks = file_blocks(ino);
+                p.pos = n;
+            }
         }
-
-        int ino = alloc_inode();
-
-        if (ino < 0) { cout << "No free inode\n"; return; }
-        Inode &din = inodes[ino];
-        din.used = true;
-        din.is_directory = true;
-        din.ctime = time(nullptr);
-        
-        int block = alloc_block();
-        
-        if (block < 0) { 
-            cout << "No space for directory block\n"; 
-            inodes[ino] = Inode();
-            return; 
+        auto first = [&](int i) { return BlockStore::first_of(data_blocks.get_entry(blocks[i])); };
+        auto count = [&](int i) { return BlockStore::count_of(data_blocks.get_entry(blocks[i])); };
+        auto repack = [&](int k, int at) {
+            p.stored = data_blocks.compact(&blocks[p.pack], k, at);
+            for (int i = 0; i < k; ++i) {
+                p.repacked += (int64_t)count(p.pack + i) * GRANULE;
+                mark_bitmap(blocks[p.pack + i], 1);
+            }
+            stat_add(CNT_DEFRAG_PACKED, k);
+            p.pack += k;
+        };
+        // A file of up to DEFRAG_MOVE_BYTES in several runs moves whole into
+        // one if there is room for it anywhere.
+        if (p.pos >= n && p.pack == 0 && layout(ino).runs > 1) {
+            int total = 0;
+            for (int i = 0; i < n; ++i) total += count(i);
+            int at = total <= DEFRAG_MOVE_BYTES / GRANULE ? data_blocks.claim(-1, total) : -1;
+            if (at >= 0) repack(n, at);
+        }
+        for (; p.pos >= n && p.pack < n && (!any || stat_now() < until); any = true) {
+            // blocks already stored after the previous ones stay put
+            for (; p.pack < n && (!count(p.pack) || first(p.pack) == p.stored); ++p.pack)
+                if (count(p.pack)) p.stored = first(p.pack) + count(p.pack);
+            if (p.pack >= n) break;
+            int k = 0, lead = 0, total = 0, end = p.stored;
+            for (; p.pack + k < n && k < DEFRAG_CHUNK; ++k) {
+                int c = count(p.pack + k);
+                if (k > 0 && total + c > DEFRAG_PACK_BYTES / GRANULE) break;
+                if (c && lead == k && (k == 0 || first(p.pack + k) == end)) lead = k + 1;
+                if (c) end = first(p.pack + k) + c;
+                total += c;
+            }
+            // The chunk moves only if the file ends up in fewer runs: after
+            // the previous blocks if there is room, otherwise anywhere. If it
+            // cannot, smaller chunks are tried, down to its leading run.
+            int at = -1;
+            for (;;) {
+                int starts = 0, next = p.stored, after = -1;
+                total = 0;
+                for (int i = p.pack; i < p.pack + k; ++i) {
+                    if (!count(i)) continue;
+                    starts += first(i) != next;
+                    next = first(i) + count(i);
+                    total += count(i);
+                }
+                for (int i = p.pack + k; i < n && after < 0; ++i)
+                    if (count(i)) after = first(i);
+                int was = starts + (after >= 0 && next != after);
+                auto gain = [&](int g) { return (g != p.stored) + (after >= 0 && g + total != after) < was; };
+                if (p.stored >= 0 && (at = data_blocks.claim(p.stored, total)) >= 0 && !gain(at))
+                    data_blocks.unclaim(at, total), at = -1;
+                if (at < 0 && was > 1 && (at = data_blocks.claim(-1, total)) >= 0 && !gain(at))
+                    data_blocks.unclaim(at, total), at = -1;
+                if (at >= 0 || k <= lead) break;
+                k = max(lead, k / 2);
+            }
+            if (at >= 0) {
+                repack(k, at);
+            } else {
+                p.stored = first(p.pack + lead - 1) + count(p.pack + lead - 1);
+                p.pack += lead;
+            }
         }
-        din.direct[0] = block;
+        return p.pos >= n && p.pack >= n;
+    }
 
-        directories[ap] = {};
-        string name = ap.substr(lastSlash + 1);
-        directories[parent].push_back({name, ino});
-        cout << "Directory created: " << ap << "\n";
+    // Works through the files of pass p until `until`; false once it is over.
+    bool defrag_step(DefragPass &p, uint64_t until) {
+        do {
+            if (p.h.idx < 0) {
+                while (p.next < p.last && (!inodes[p.next].used || inodes[p.next].is_directory)) ++p.next;
+                if (p.next >= p.last) return false;
+                p.h = {p.next, inodes[p.next].gen};
+                p.next++;
+                p.pos = p.pack = 0;
+                p.placed = p.stored = -1;
+                p.was = layout(inodes[p.h.idx]);
+            }
+            Inode *ino = resolve(p.h);
+            if (ino && p.was.extents <= 1 && p.was.runs <= 1) {
+                p.files++;
+                p.before.add(p.was);
+                p.after.add(p.was);
+            } else if (ino) {
+                if (!defrag_file(p, *ino, until)) return true;
+                FileLayout now = layout(*ino);
+                p.files++;
+                p.rewritten += now.extents < p.was.extents || now.runs < p.was.runs;
+                p.before.add(p.was);
+                p.after.add(now);
+            }
+            p.h.idx = -1;
+        } while (stat_now() < until);
+        return true;
     }
 
-    void cmd_deleteDir(const string &path) {
-        string ap = abs_path(path);
-        if (ap == cwd) {
-            cout << "Cannot delete current directory\n";
-            return;
+    // defrag [file]: moves the blocks of each fragmented file, or of the one
+    // named, into contiguous runs and packs their stored forms in file order.
+    // It runs in steps of DEFRAG_SLICE_NS that each hold commands off and end
+    // with a commit, so other sessions get to run in between and a crash
+    // loses at most the step in progress.
+    void cmd_defrag(const string &path) {
+        DefragPass p;
+        {
+            shared_lock<OpGate> g(ops);
+            p.last = inodes.size();
+            if (!path.empty()) {
+                bool is_dir = false;
+                InodeHandle h = lookup_handle(path, &is_dir);
+                if (h.idx < 0 || is_dir) { err() << "File not found\n"; return; }
+                p.next = h.idx;
+                p.last = h.idx + 1;
+            }
         }
-        auto it = directories.find(ap);
-        if (it == directories.end()) { cout << "Directory not found\n"; return; }
-        if (!it->second.empty()) { cout << "Directory not empty\n"; return; }
-        int ino = lookup_inode(path);
-        Inode &din = inodes[ino];
-        free_block(din.direct[0]);
-        inodes[ino] = Inode();
-        directories.erase(it);
-        string parent = ap.substr(0, ap.find_last_of('/'));
-        if (parent.empty()) parent = "/";
-        string name = ap.substr(ap.find_last_of('/') + 1);
-        auto &pe = directories[parent];
-        pe.erase(remove_if(pe.begin(), pe.end(), [&](const DirEntry &d) {
-            return d.name == name;
-        }), pe.end());
-        cout << "Directory deleted: " << ap << "\n";
+        int steps = 0;
+        for (bool more = true; more; ++steps) {
+            {
+                unique_lock<OpGate> x(ops);
+                uint64_t t0 = stat_now();
+                more = defrag_step(p, t0 + DEFRAG_SLICE_NS);
+                stat_record(HIST_DEFRAG_STEP, stat_now() - t0);
+            }
+            commit();
+        }
+        ostream &os = out();
+        os << "Defrag: " << p.rewritten << " of " << p.files << " files rewritten in " << steps
+           << " steps, " << p.moved << " blocks moved, " << (p.repacked >> 10) << "KB repacked\n";
+        os << "Extents " << p.before.extents << " -> " << p.after.extents << ", fragmented files "
+           << p.before.fragmented << " -> " << p.after.fragmented << ", stored runs "
+           << p.before.runs << " -> " << p.after.runs << "\n";
     }
 
-    void cmd_changeDir(const string &path) {
-        if (path == "..") {
-        if (cwd == "/") {
-            cout << "Already at root directory\n";
-            return;
-        }
-    
-        size_t last_slash = cwd.find_last_of('/');
-        string parent = cwd.substr(0, last_slash);
-        if (parent.empty()) parent = "/";
-        if (!directories.count(parent)) {
-            cout << "Parent directory not found\n";
-            return;
+    // Counters and histograms since the last `stats reset`.
+    unique_ptr<StatTotals> stat_totals() {
+        unique_ptr<StatTotals> t(new StatTotals);
+        stat_registry.snapshot(*t);
+        lock_guard<mutex> g(stats_mu);
+        if (stats_base) t->subtract(*stats_base);
+        return t;
+    }
+
+    void write_stats(ostream &os, bool json) {
+        unique_ptr<StatTotals> t = stat_totals();
+        Fragmentation f;
+        long long free_blocks;
+        {
+            unique_lock<OpGate> x(ops);
+            f = fragmentation();
+            free_blocks = sb.free_blocks;
         }
+        const uint64_t *c = t->counters;
+        auto ratio = [](double a, double b) { return b > 0 ? a / b : 0.0; };
+        double probe_mean = ratio(c[CNT_DIR_PROBES], c[CNT_DIR_LOOKUPS]);
+        double scan_mean = ratio(c[CNT_BITMAP_WORDS], c[CNT_BITMAP_SCANS]);
+        double hit_rate = ratio(c[CNT_DCACHE_HITS], c[CNT_DCACHE_HITS] + c[CNT_DCACHE_MISSES]);
+        double block_hit_rate = ratio(c[CNT_BLOCK_CACHE_HITS], c[CNT_BLOCK_CACHE_HITS] + c[CNT_BLOCK_CACHE_MISSES]);
+        double buffer_hit_rate = ratio(c[CNT_BUFFER_HITS], c[CNT_BUFFER_HITS] + c[CNT_BUFFER_MISSES]);
+        size_t resident = data_blocks.cache_resident(), budget = data_blocks.cache_budget();
+        double ext_mean = ratio(f.extents, f.files);
+        double free_frag = free_blocks > 0 ? 1 - ratio(f.largest_free, free_blocks) : 0.0;
+        os << fixed << setprecision(2);
 
-        cwd = parent;
-        cout << "Current directory: " << cwd << "\n";
+        if (json) {
+            os << "{\"time\": " << time(nullptr) << ", \"counters\": {";
+            for (int i = 0; i < NUM_COUNTERS; ++i)
+                os << (i ? ", " : "") << '"' << counter_names[i] << "\": " << c[i];
+            os << ", \"mean_probe_length\": " << probe_mean
+               << ", \"bitmap_words_per_scan\": " << scan_mean
+               << ", \"dcache_hit_rate\": " << hit_rate
+               << ", \"block_cache_hit_rate\": " << block_hit_rate
+               << ", \"buffer_hit_rate\": " << buffer_hit_rate << "}, \"buffer_cache\": {\"resident_bytes\": "
+               << resident << ", \"budget_bytes\": " << budget << "}, \"histograms\": {";
+            bool first = true;
+            for (int h = 0; h < NUM_HISTS; ++h) {
+                uint64_t n = t->count(h);
+                if (n == 0) continue;
+                os << (first ? "" : ", ") << '"' << hist_names[h] << "\": {\"count\": " << n
+                   << ", \"mean\": " << ratio(t->sums[h], n)
+                   << ", \"p50\": " << t->percentile(h, 0.50)
+                   << ", \"p90\": " << t->percentile(h, 0.90)
+                   << ", \"p99\": " << t->percentile(h, 0.99)
+                   << ", \"max\": " << t->percentile(h, 1) << "}";
+                first = false;
+            }
+            os << "}, \"fragmentation\": {\"free_blocks\": " << free_blocks
+               << ", \"free_runs\": " << f.free_runs
+               << ", \"largest_free_run\": " << f.largest_free
+               << ", \"free_space_fragmentation\": " << free_frag
+               << ", \"files\": " << f.files
+               << ", \"extents\": " << f.extents
+               << ", \"fragmented_files\": " << f.fragmented
+               << ", \"extents_per_file\": " << ext_mean << "}}\n";
         } else {
-        string ap = abs_path(path);
-        if (!directories.count(ap)) { 
-            cout << "Directory not found\n"; 
-            return; 
+            os << "Counters:\n";
+            for (int i = 0; i < NUM_COUNTERS; ++i)
+                os << "  " << left << setw(24) << counter_names[i] << right << c[i] << "\n";
+            os << "  mean probe length " << probe_mean << ", bitmap words per scan " << scan_mean
+               << ", dentry cache hit rate " << hit_rate * 100 << "%\n";
+            os << "  block cache hit rate " << block_hit_rate * 100 << "%, buffer cache hit rate "
+               << buffer_hit_rate * 100 << "% with " << (resident >> 10) << "KB of " << (budget >> 10)
+               << "KB resident\n";
+            os << "Latency (us):          count        mean         p50         p90         p99         max\n";
+            for (int h = 0; h < NUM_HISTS; ++h) {
+                uint64_t n = t->count(h);
+                if (n == 0) continue;
+                double scale = h == HIST_PROBE_LENGTH ? 1 : 1e-3;
+                if (h == HIST_PROBE_LENGTH) os << "Probe length (slots):\n";
+                os << "  " << left << setw(14) << hist_names[h] << right << setw(10) << n
+                   << setw(12) << ratio(t->sums[h], n) * scale;
+                for (double p : {0.50, 0.90, 0.99, 1.0}) os << setw(12) << t->percentile(h, p) * scale;
+                os << "\n";
+            }
+            os << "Fragmentation:\n"
+               << "  free blocks " << free_blocks << " in " << f.free_runs << " runs, largest "
+               << f.largest_free << " (" << free_frag * 100 << "% fragmented)\n"
+               << "  files " << f.files << ", extents " << f.extents << ", fragmented files "
+               << f.fragmented << ", " << ext_mean << " extents per file\n";
         }
+        os.unsetf(ios::floatfield);
+        os << setprecision(6);
+    }
 
-        cwd = ap;
-        cout << "Current directory: " << cwd << "\n";
+    // stats [json|reset]: counters, latency histograms and fragmentation since
+    // start-up or the last reset.
+    void cmd_stats(string_view mode) {
+        if (mode == "reset") {
+            unique_ptr<StatTotals> t(new StatTotals);
+            stat_registry.snapshot(*t);
+            lock_guard<mutex> g(stats_mu);
+            stats_base = std::move(t);
+            out() << "Statistics reset\n";
+        } else if (mode.empty() || mode == "json") {
+            write_stats(out(), mode == "json");
+        } else {
+            err() << "Usage: stats [json|reset]\n";
         }
     }
 
-    void cmd_dir() {
-        const auto& entries = directories[cwd];
-        std::vector<DirEntry> dirs, files;
-        for (const auto& e : entries) {
-            Inode& ino = inodes[e.inode_idx];
-            if (ino.is_directory) dirs.push_back(e);
-            else                 files.push_back(e);
+    // Index size, write-path hits since start (or the last `stats reset`)
+    // and what sharing indexed blocks saves right now. Shares made by cp of
+    // an indexed block count too; `sum` gives the total saved either way.
+    void cmd_dedup_stats() {
+        unique_ptr<StatTotals> t = stat_totals();
+        const uint64_t *c = t->counters;
+        size_t entries = 0;
+        for (typename DedupIndex::Shard &ds : dedup.shards) {
+            lock_guard<mutex> g(ds.mu);
+            entries += ds.map.size();
+        }
+        long long shared = 0, saved = 0;
+        for (int b = 0; b < NUM_BLOCKS; ++b) {
+            if (!__atomic_load_n(&dedup.fp[b], __ATOMIC_RELAXED)) continue;
+            uint32_t refs = __atomic_load_n(&sb.block_refs[b], __ATOMIC_RELAXED);
+            if (refs > 1) shared++, saved += refs - 1;
         }
+        uint64_t looked = c[CNT_DEDUP_HITS] + c[CNT_DEDUP_MISSES] + c[CNT_DEDUP_COLLISIONS];
+        ostream &os = out();
+        os << "Dedup: " << (dedup.on ? "on" : "off") << ", " << entries << " blocks indexed\n";
+        os << "Writes: " << looked << " blocks looked up, " << c[CNT_DEDUP_HITS] << " duplicates ("
+           << fixed << setprecision(1) << (looked ? 100.0 * c[CNT_DEDUP_HITS] / looked : 0.0)
+           << "%), " << c[CNT_DEDUP_COLLISIONS] << " fingerprint collisions\n";
+        os.unsetf(ios::floatfield);
+        os << setprecision(6);
+        os << "Shared: " << shared << " indexed blocks hold " << (shared + saved)
+           << " references, saving " << saved << " blocks (" << saved * BLOCK_SIZE / 1024 << "KB)\n";
+    }
 
-        auto cmp_ctime = [&](const DirEntry& a, const DirEntry& b) {
-            return inodes[a.inode_idx].ctime < inodes[b.inode_idx].ctime;
+    // Cross-checks the volume while commands are held off. Every directory
+    // entry must name a live inode that no other entry names, every block an
+    // inode maps must be allocated with a matching reference count, every
+    // allocated block must be mapped, and blocks must match their checksums.
+    // With an image, a checkpoint runs first so that blocks written since the
+    // last one have checksums too. Inodes and blocks are checked in parallel,
+    // by range.
+    void cmd_fsck() {
+        if (image_fd >= 0) checkpoint();
+        unique_lock<OpGate> x(ops);
+        int count = inodes.size();
+        vector<string> problems;
+        atomic<long long> nproblems(0);
+        mutex prob_mu;
+        auto problem = [&](const string &msg) {
+            nproblems++;
+            lock_guard<mutex> g(prob_mu);
+            if (problems.size() < 20) problems.push_back(msg);
         };
 
-        std::sort(dirs.begin(),  dirs.end(), cmp_ctime);
-        std::sort(files.begin(), files.end(), cmp_ctime);
+        vector<char> seen(count, 0);
+        vector<int> stack = {0};
+        long long ndirs = 0;
+        seen[0] = 1;
+        while (!stack.empty()) {
+            int d = stack.back();
+            stack.pop_back();
+            ndirs++;
+            auto it = directories.find(d);
+            if (it == directories.end()) {
+                problem("directory inode " + to_string(d) + " has no entries");
+                continue;
+            }
+            for (const DirEntry &e : it->second->entries) {
+                int i = e.inode_idx;
+                string where = "entry '" + e.name + "' of directory inode " + to_string(d);
+                if (i < 0 || i >= count || !inodes[i].used) {
+                    problem(where + " names free inode " + to_string(i));
+                } else if (seen[i]) {
+                    problem(where + " names inode " + to_string(i) + " a second time");
+                } else {
+                    seen[i] = 1;
+                    if (!inodes[i].is_directory) continue;
+                    auto sub = directories.find(i);
+                    if (sub != directories.end() && sub->second->parent != d)
+                        problem("directory inode " + to_string(i) + " records the wrong parent");
+                    stack.push_back(i);
+                }
+            }
+        }
+        for (const auto &kv : directories)
+            if (kv.first >= count || !inodes[kv.first].used || !inodes[kv.first].is_directory)
+                problem("entries kept for inode " + to_string(kv.first) + ", which is not a directory");
+        for (const auto &kv : count_usage()) {
+            auto it = directories.find(kv.first);
+            if (it == directories.end()) continue;
+            Usage u = it->second->usage(), want = kv.second;
+            if (u != want)
+                problem("directory inode " + to_string(kv.first) + " records " + to_string(u.bytes) + "B, " +
+                        to_string(u.blocks) + " blocks, " + to_string(u.inodes) + " inodes below it, expected " +
+                        to_string(want.bytes) + "B, " + to_string(want.blocks) + " blocks, " +
+                        to_string(want.inodes) + " inodes");
+        }
 
-        auto print_entry = [&](const DirEntry& e) {
-            Inode& ino = inodes[e.inode_idx];
-            cout << (ino.is_directory ? "[DIR]  " : "[FILE] ")
-                << std::setw(20) << std::left << e.name;
-            if (ino.is_directory) {
-                int cnt = directories[abs_path(e.name)].size();
-                cout << " entries = " << cnt;
-            } else {
-                cout << " size = " << ino.size << "B";
+        // Walks extents and overflow chains without trusting them.
+        vector<uint32_t> refs(NUM_BLOCKS, 0);
+        atomic<long long> files(0);
+        parallel_for(count, 1024, [&](int lo, int hi) {
+            for (int i = lo; i < hi; ++i) {
+                const Inode &ino = inodes[i];
+                if (!ino.used) continue;
+                auto what = [i] { return "inode " + to_string(i); };
+                if (!seen[i]) problem(what() + " is in use but in no directory");
+                if (!ino.is_directory) files++;
+                int64_t blocks = 0;
+                int next = 0;
+                auto ref = [&](int b) {
+                    if (b < 0 || b >= NUM_BLOCKS) return false;
+                    __atomic_add_fetch(&refs[b], 1, __ATOMIC_RELAXED);
+                    return true;
+                };
+                auto extent = [&](const Extent &e) {
+                    ++next;
+                    if (e.len <= 0 || e.start < 0 || e.start > NUM_BLOCKS - e.len) {
+                        problem(what() + " has an extent out of range");
+                        return;
+                    }
+                    for (int b = e.start; b < e.start + e.len; ++b) ref(b);
+                    blocks += e.len;
+                };
+                for (int k = 0; k < min(ino.nextents, INLINE_EXTENTS); ++k) extent(ino.ext[k]);
+                int hops = 0;
+                for (int b = ino.ext_block; b >= 0; ) {
+                    if (!ref(b) || ++hops > NUM_BLOCKS) {
+                        problem(what() + " has a broken extent chain");
+                        break;
+                    }
+                    ExtentBlock eb = extent_block(b);
+                    if (!eb || eb.count() < 0 || eb.count() > EXTENTS_PER_BLOCK) {
+                        problem(what() + " has a broken extent chain");
+                        break;
+                    }
+                    for (int k = 0; k < eb.count(); ++k) extent(eb.ext(k));
+                    b = eb.next();
+                }
+                if (next != ino.nextents) problem(what() + " records " + to_string(ino.nextents) +
+                                                  " extents but maps " + to_string(next));
+                if (ino.size > blocks * BLOCK_SIZE) problem(what() + " is larger than its blocks");
             }
-            cout << ", created = " << ctime(&ino.ctime);
-        };
+        });
 
-        for (const auto& d : dirs)   print_entry(d);
-        for (const auto& f : files)  print_entry(f);
-    }
+        atomic<long long> used(0);
+        parallel_for(NUM_BLOCKS, 4096, [&](int lo, int hi) {
+            long long n = 0;
+            for (int b = lo; b < hi; ++b) {
+                bool is_free = sb.block_bitmap.test(b) || freed.test(b);
+                n += !is_free;
+                auto what = [b] { return "block " + to_string(b); };
+                if (refs[b] && is_free) problem(what() + " is mapped but marked free");
+                else if (!refs[b] && !is_free) problem(what() + " is allocated but not mapped");
+                if (refs[b] != sb.block_refs[b])
+                    problem(what() + " has reference count " + to_string(sb.block_refs[b]) +
+                            ", expected " + to_string(refs[b]));
+            }
+            used += n;
+        });
+        long long pending;
+        {
+            lock_guard<mutex> g(freed_mu);
+            pending = freed_list.size();
+        }
+        if (NUM_BLOCKS - used != sb.free_blocks + pending)
+            problem("free block count is " + to_string(sb.free_blocks) + " with " + to_string(pending) +
+                    " awaiting commit, bitmap has " + to_string(NUM_BLOCKS - used));
 
+        // Block store: entries within the arena, no granule stored twice, the
+        // count in use right, and every stored block decodable.
+        BlockBitmap claimed(NUM_GRANULES, false);
+        long long granules = 0;
+        vector<int> stored;
+        for (int b = 0; b < NUM_BLOCKS; ++b) {
+            uint32_t e = data_blocks.get_entry(b);
+            if (!e) continue;
+            int g = BlockStore::first_of(e), n = BlockStore::count_of(e);
+            auto what = [b] { return "block " + to_string(b); };
+            if (sb.block_bitmap.test(b)) problem(what() + " is free but still stored");
+            if (BlockStore::mode_of(e) > BM_LETTERS || n > BLOCK_SIZE / GRANULE || g + n > NUM_GRANULES) {
+                problem(what() + " has a bad storage entry");
+                continue;
+            }
+            bool overlap = false;
+            for (int k = g; k < g + n; ++k) {
+                overlap |= claimed.test(k);
+                claimed.set(k);
+            }
+            if (overlap) problem(what() + " is stored over another block");
+            granules += n;
+            stored.push_back(b);
+        }
+        if (granules != data_blocks.used_granules())
+            problem("granules in use is " + to_string(data_blocks.used_granules()) + ", block map has " +
+                    to_string(granules));
+        parallel_for(stored.size(), 1024, [&](int lo, int hi) {
+            char buf[BLOCK_SIZE];
+            for (int i = lo; i < hi; ++i)
+                if (!data_blocks.read(stored[i], buf))
+                    problem("block " + to_string(stored[i]) + " cannot be decoded");
+        });
 
-    void cmd_createFile(const string &path, int size_kb) {
-        int size_bytes = size_kb * 1024;
-        int needed = (size_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        if (needed > DIRECT_PTRS + (BLOCK_SIZE / sizeof(int))) { 
-            cout << "Exceeds max file size\n"; 
-            return; 
+        ostream &os = out();
+        os << "fsck: " << ndirs << " directories, " << files << " files, " << used << " of "
+           << NUM_BLOCKS << " blocks in use, " << granules * GRANULE / 1024 << "KB stored\n";
+        if (image_fd >= 0) {
+            int pending = 0;
+            vector<int> bad = verify_blocks(&pending);
+            for (int b : bad) problem("block " + to_string(b) + " fails its checksum");
+            os << "fsck: " << used - pending << " blocks verified against their checksums";
+            if (pending) os << ", " << pending << " written since the last checkpoint";
+            os << "\n";
         }
-        string ap = abs_path(path);
+        for (const string &p : problems) os << "  " << p << "\n";
+        if (nproblems > (long long)problems.size())
+            os << "  ... and " << nproblems - problems.size() << " more\n";
+        if (nproblems == 0) os << "fsck: no problems found\n";
+        else err() << "fsck: " << nproblems << " problems found\n";
+    }
 
-        string parent = ap.substr(0, ap.find_last_of('/'));
-        if (parent.empty()) parent = "/";
-        string name = ap.substr(ap.find_last_of('/') + 1);
+    // Rewrites `file` with the JSON statistics every `secs` seconds until
+    // stop_stats_dump(), replacing it atomically each time.
+    void start_stats_dump(const string &file, int secs) {
+        dump_stop = false;
+        dumper = thread([this, file, secs] {
+            unique_lock<mutex> g(dump_mu);
+            do {
+                g.unlock();
+                dump_stats(file);
+                g.lock();
+            } while (!dump_cv.wait_for(g, chrono::seconds(secs), [&] { return dump_stop; }));
+        });
+    }
 
-        for (const auto& entry : directories[parent]) {
-            if (entry.name == name) {
-                cout << "Error: A file or directory with the name '" << name << "' already exists\n";
-                return;
-            }
+    void stop_stats_dump(const string &file) {
+        if (!dumper.joinable()) return;
+        {
+            lock_guard<mutex> g(dump_mu);
+            dump_stop = true;
         }
+        dump_cv.notify_all();
+        dumper.join();
+        dump_stats(file);
+    }
 
-        int ino_idx = alloc_inode();
-        if (ino_idx < 0) { cout << "No free inode\n"; return; }
-        Inode &fin = inodes[ino_idx]; 
-        fin.used = true; 
-        fin.size = size_bytes; 
-        fin.ctime = time(nullptr);
+    void dump_stats(const string &file) {
+        ostringstream os;
+        write_stats(os, true);
+        string data = os.str(), tmp = file + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return;
+        bool ok = ::write(fd, data.data(), data.size()) == (ssize_t)data.size();
+        close(fd);
+        if (ok) rename(tmp.c_str(), file.c_str());
+        else unlink(tmp.c_str());
+    }
 
-        vector<int> blocks;
-        for (int i = 0; i < min(needed, DIRECT_PTRS); ++i) {
-            int b = alloc_block(); 
-            if (b < 0) { 
-                cout << "No space\n"; 
-                for (int blk : blocks) free_block(blk);
-                inodes[ino_idx] = Inode();
-                return; 
-            }
-            fin.direct[i] = b;
-            blocks.push_back(b);
-        }
-
-        if (needed > DIRECT_PTRS) {
-            int ib = alloc_block();
-            if (ib < 0) { 
-                cout << "No space\n"; 
-                for (int blk : blocks) free_block(blk);
-                inodes[ino_idx] = Inode();
-                return; 
-            }
-
-            fin.indirect = ib;
-            int *ptrs = reinterpret_cast<int*>(data_blocks[ib]);
-            for (int i = 0; i < needed - DIRECT_PTRS; ++i) {
-                int b = alloc_block(); 
-                if (b < 0) { 
-                    cout << "No space\n"; 
-                    free_block(ib);
-                    for (int blk : blocks) free_block(blk);
-                    inodes[ino_idx] = Inode();
-                    return; 
-                }
-                ptrs[i] = b;
-                blocks.push_back(b);
+    // Directory map section: the number of directories, then for each its
+    // inode, parent, name and entries (name, inode), in the journal's record
+    // encoding.
+    string encode_directories() {
+        string out;
+        auto put_int = [&](int v) { char b[4]; put_le(b, v, 4); out.append(b, 4); };
+        auto put_str = [&](const string &str) { put_int(str.size()); out += str; };
+        put_int(directories.size());
+        for (const auto& pair : directories) {
+            const Directory& d = *pair.second;
+            put_int(pair.first);
+            put_int(d.parent);
+            put_str(d.name);
+            // In listing order, so entries created within the same second
+            // keep their order across a load.
+            put_int(d.entries.size());
+            for (size_t k = 0; k < d.entries.size(); ++k) {
+                const DirEntry &e = d.listed(k);
+                put_str(e.name);
+                put_int(e.inode_idx);
             }
         }
+        return out;
+    }
 
-        srand(time(nullptr));
-        int written = 0;
-        for (int b : blocks) {
-            for (int i = 0; i < BLOCK_SIZE && written < size_bytes; ++i, ++written)
-                data_blocks[b][i] = 'A' + rand() % 26;
+    void decode_directories(const string &dirs) {
+        JournalReader in(dirs, 0);
+        int dirCount = in.get_int();
+        directories.clear();
+        dcache.clear();
+        for (int i = 0; i < dirCount && in.ok; ++i) {
+            int ino = in.get_int();
+            int parent = in.get_int();
+            string name = in.get_str();
+            if (!in.ok) break;
+            Directory &d = *(directories[ino] = make_shared<Directory>(parent, name));
+            int entryCount = in.get_int();
+            for (int j = 0; j < entryCount && in.ok; ++j) {
+                string name = in.get_str();
+                int inode_idx = in.get_int();
+                if (in.ok) d.add(name, inode_idx);
+            }
         }
-
-        directories[parent].push_back({name, ino_idx});
-        cout << "File created: " << ap << " " << size_kb << "KB\n";
+        if (!directories.count(0)) directories[0] = make_shared<Directory>();
     }
 
-    void cmd_deleteFile(const string &path) {
-        string ap = abs_path(path);
-        int ino_idx = lookup_inode(path);
-        if (ino_idx < 0) { cout << "File not found\n"; return; }
+    // Seals the running transaction: the buffered directory records plus the
+    // current value of every inode and bitmap word changed since the last
+    // one. All sessions' commands join the same transaction, so this runs
+    // with ops held exclusively and sees no command half done.
+    string seal_txn() {
+        if (!journal.is_open()) {
+            journal.discard();
+            txn_inodes.clear();
+            txn_words.clear();
+            return string();
+        }
+        if (journal.pending()) ckpt_dirs = true;
+        for (int i : txn_inodes) {
+            char rec[INODE_RECORD];
+            encode_inode(inodes[i], rec);
+            journal.rec('I');
+            journal.put_int(i);
+            journal.put(rec, sizeof(rec));
+            ckpt_inodes.insert(i);
+        }
+        for (int w : txn_words) {
+            journal.rec('B');
+            journal.put_int(w);
+            journal.put_u(sb.block_bitmap.words[w] | freed.words[w], 8);
+            for (int b = w * 64; b < w * 64 + 64; ++b) journal.put_u(data_blocks.get_entry(b), 4);
+            ckpt_words.insert(w);
+        }
+        txn_inodes.clear();
+        txn_words.clear();
+        return journal.seal();
+    }
 
-        Inode &fin = inodes[ino_idx];
-        for (int i = 0; i < DIRECT_PTRS; ++i) 
-            free_block(fin.direct[i]);
+    // Ends the running transaction. Commands are held off only while it is
+    // sealed; the data blocks it wrote are then msynced and its records go to
+    // the journal while commands run again. The blocks and granules it frees
+    // are reused only after that. Every so often the accumulated changes are
+    // checkpointed into the image and the journal starts over.
+    void commit() {
+        uint64_t t0 = stat_now();
+        string txn;
+        vector<pair<int, int>> retired;
+        vector<int> blocks;
+        unique_lock<mutex> jg(journal_mu, defer_lock);
+        {
+            unique_lock<OpGate> x(ops);
+            txn = seal_txn();
+            if (txn.empty()) return;
+            retired = data_blocks.take_retired();
+            blocks = take_freed();
+            jg.lock();
+        }
+        data_blocks.sync();
+        if (!journal.write(txn)) cout << "Warning: journal write failed\n";
+        release_freed(blocks);
+        data_blocks.release_retired(retired);
+        bool full = ++commits_since_ckpt >= CHECKPOINT_COMMITS || journal.bytes >= CHECKPOINT_JOURNAL_BYTES;
+        jg.unlock();
+        stat_record(HIST_COMMIT, stat_now() - t0);
+        if (full) checkpoint();
+    }
 
-        if (fin.indirect >= 0) {
-            int *ptrs = reinterpret_cast<int*>(data_blocks[fin.indirect]);
-            for (int i = 0; i < BLOCK_SIZE / sizeof(int); ++i) {
-                if (ptrs[i] <= 0) break;
-                free_block(ptrs[i]);
+    // Group commit for concurrent sessions: returns once a commit that began
+    // after the call has finished. Whoever finds no commit running performs
+    // one on behalf of everyone waiting.
+    void commit_sync() {
+        unique_lock<mutex> g(commit_mu);
+        uint64_t want = commits_started + 1;
+        while (commits_done < want) {
+            if (commits_started == commits_done) {
+                ++commits_started;
+                g.unlock();
+                commit();
+                g.lock();
+                ++commits_done;
+                commit_cv.notify_all();
+            } else {
+                commit_cv.wait(g);
             }
-            free_block(fin.indirect);
         }
+    }
 
-        inodes[ino_idx] = Inode();
-        string parent = ap.substr(0, ap.find_last_of('/'));
+    // Writes the inodes, bitmap words and directory map changed since the
+    // last checkpoint into their slots in the image, then empties the journal.
+    void checkpoint() {
+        unique_lock<OpGate> x(ops);
+        lock_guard<mutex> jg(journal_mu);
+        if (image_fd < 0) return;
+        StatTimer t(HIST_CHECKPOINT);
+        string txn = seal_txn();
+        data_blocks.sync();
+        if (!journal.write(txn)) cout << "Warning: journal write failed\n";
+        vector<int> blocks = take_freed();
+        release_freed(blocks);
+        data_blocks.release_retired(data_blocks.take_retired());
 
-        if (parent.empty()) parent = "/";
-        string name = ap.substr(ap.find_last_of('/') + 1);
-        auto &pe = directories[parent];
-        pe.erase(remove_if(pe.begin(), pe.end(), [&](const DirEntry &d) { 
-            return d.name == name; 
-        }), pe.end());
+        // Blocks only change while they are allocated for the first time since
+        // being free, so the ones in changed bitmap words are all that need
+        // new checksums.
+        vector<int> words(ckpt_words.begin(), ckpt_words.end());
+        parallel_for(words.size(), 16, [&](int lo, int hi) {
+            for (int k = lo; k < hi; ++k)
+                for (int b = words[k] * 64; b < min(NUM_BLOCKS, words[k] * 64 + 64); ++b)
+                    block_crc[b] = data_blocks.crc(b);
+        });
+        punch_free();
 
-        cout << "File deleted: " << ap << "\n";
-    }
+        int count = inodes.size();
+        set<int> chunks;
+        string run;
+        for (auto it = ckpt_inodes.begin(); it != ckpt_inodes.end(); ) {
+            int first = *it, last = first;
+            while (++it != ckpt_inodes.end() && *it == last + 1) last = *it;
+            run.resize((size_t)(last - first + 1) * INODE_RECORD);
+            for (int i = first; i <= last; ++i) encode_inode(inodes[i], &run[(size_t)(i - first) * INODE_RECORD]);
+            pwrite(image_fd, run.data(), run.size(), ImageLayout::inode_off() + (off_t)first * INODE_RECORD);
+            for (int c = first / ImageLayout::INODE_CHUNK; c <= last / ImageLayout::INODE_CHUNK; ++c) chunks.insert(c);
+        }
+        inode_crc.resize(ImageLayout::inode_chunks(count));
+        chunks.insert(inode_crc.size() - 1);
+        for (int c : chunks) inode_crc[c] = inode_chunk_crc(c, count);
 
-    void cmd_cp(const string &src, const string &dst) {
-        int sidx = lookup_inode(src);
-        if (sidx < 0) {
-            cout << "Source not found\n";
-            return;
+        ImageHeader h = image;
+        h.total_blocks = sb.total_blocks;
+        h.free_blocks = sb.free_blocks;
+        h.inode_count = count;
+        h.csum_slot = image.csum_slot ^ 1;
+        h.csum_bytes = ImageLayout::csum_bytes(count);
+        h.csum_crc = write_checksums(h.csum_slot, words, chunks);
+        if (ckpt_dirs) {
+            string dirs = encode_directories();
+            uint64_t base = ImageLayout::dir_off();
+            bool fits = image.dir_pos >= base + dirs.size();
+            h.dir_pos = fits ? base : max(base, image.dir_pos) + ImageLayout::align(image.dir_bytes);
+            h.dir_bytes = dirs.size();
+            h.dir_crc = crc32c(dirs.data(), dirs.size());
+            pwrite(image_fd, dirs.data(), dirs.size(), h.dir_pos);
         }
+        fsync(image_fd);
+        char hb[ImageHeader::BYTES];
+        h.encode(hb);
+        pwrite(image_fd, hb, sizeof(hb), 0);
+        fsync(image_fd);
+        if (h.dir_pos == (uint64_t)ImageLayout::dir_off())
+            ftruncate(image_fd, h.dir_pos + h.dir_bytes);
+        image = h;
 
-        Inode &sin = inodes[sidx];
-        string abs_src = abs_path(src);
-        string abs_dst = abs_path(dst);
+        journal.truncate();
+        ckpt_inodes.clear();
+        ckpt_words.clear();
+        ckpt_dirs = false;
+        commits_since_ckpt = 0;
+    }
 
-        if (sin.is_directory) {
-            if (abs_dst == abs_src || abs_dst.find(abs_src + "/") == 0) {
-            cout << "Error: Cannot copy a directory into its subdirectory\n";
-            return;
-            }
-            cmd_createDir(dst);
+    uint32_t inode_chunk_crc(int c, int count) {
+        char rec[INODE_RECORD];
+        uint32_t crc = 0;
+        int end = min(count, (c + 1) * ImageLayout::INODE_CHUNK);
+        for (int i = c * ImageLayout::INODE_CHUNK; i < end; ++i) {
+            encode_inode(inodes[i], rec);
+            crc = crc32c(rec, sizeof(rec), crc);
+        }
+        return crc;
+    }
 
-            for (auto &entry : directories[abs_src]) {
-                string child_name = entry.name;
-                string child_src = abs_src + "/" + child_name;
-                string child_dst = abs_dst + "/" + child_name;
-                cmd_cp(child_src, child_dst);
+    // Brings the checksum section up to date for the bitmap words and inode
+    // chunks changed since the last checkpoint, and writes the pieces slot
+    // `slot` lacks along with its table of piece CRCs. Returns the CRC of
+    // that table.
+    uint32_t write_checksums(int slot, const vector<int> &words, const set<int> &chunks) {
+        const size_t PIECE = ImageLayout::CSUM_PIECE;
+        size_t was = csum.size(), bytes = ImageLayout::csum_bytes(inodes.size());
+        set<int> changed;
+        auto put = [&](size_t off, uint64_t v, int n) {
+            put_le(&csum[off], v, n);
+            changed.insert(off / PIECE);
+            changed.insert((off + n - 1) / PIECE);
+        };
+        csum.resize(bytes);
+        for (size_t p = min(was, bytes) / PIECE; p < (bytes + PIECE - 1) / PIECE; ++p) changed.insert(p);
+        const size_t map_off = ImageLayout::bitmap_bytes(), crc_off = map_off + (size_t)NUM_BLOCKS * 4;
+        for (int w : words) {
+            put((size_t)w * 8, sb.block_bitmap.words[w], 8);
+            for (int b = w * 64; b < min(NUM_BLOCKS, w * 64 + 64); ++b) {
+                put(map_off + (size_t)b * 4, data_blocks.get_entry(b), 4);
+                put(crc_off + (size_t)b * 4, block_crc[b], 4);
             }
-            return;
         }
+        for (int c : chunks) put(ImageLayout::chunk_crc_off() + (size_t)c * 4, inode_crc[c], 4);
 
-        int didx = alloc_inode();
-        if (didx < 0) {
-            cout << "No free inode\n";
-            return;
+        piece_crc.resize((bytes + PIECE - 1) / PIECE);
+        for (int p : changed) {
+            size_t lo = p * PIECE;
+            piece_crc[p] = crc32c(&csum[lo], min(PIECE, bytes - lo));
+            csum_stale[0].insert(p);
+            csum_stale[1].insert(p);
         }
+        set<int> &stale = csum_stale[slot];
+        for (auto it = stale.begin(); it != stale.end(); ) {
+            int first = *it, last = first;
+            while (++it != stale.end() && *it == last + 1) last = *it;
+            size_t lo = first * PIECE, hi = min(bytes, (last + 1) * PIECE);
+            if (lo < hi) pwrite(image_fd, &csum[lo], hi - lo, ImageLayout::csum_off(slot) + lo);
+        }
+        stale.clear();
+        string table(piece_crc.size() * 4, '\0');
+        for (size_t p = 0; p < piece_crc.size(); ++p) put_le(&table[p * 4], piece_crc[p], 4);
+        pwrite(image_fd, table.data(), table.size(), ImageLayout::piece_crc_off(slot));
+        return crc32c(table.data(), table.size());
+    }
 
-        Inode &din = inodes[didx];
-        din.used = true;
-        din.size = sin.size;
-        din.ctime = time(nullptr);
+    // Checks the checksum section read from a slot against its table of
+    // piece CRCs and that table against the header's CRC.
+    static bool check_checksums(const string &in, const string &table, uint32_t crc) {
+        const size_t PIECE = ImageLayout::CSUM_PIECE;
+        if (crc32c(table.data(), table.size()) != crc) return false;
+        for (size_t lo = 0, p = 0; lo < in.size(); lo += PIECE, ++p)
+            if (crc32c(&in[lo], min(PIECE, in.size() - lo)) != get_le(&table[p * 4], 4)) return false;
+        return true;
+    }
 
-        for (int i = 0; i < DIRECT_PTRS; ++i) {
-            if (sin.direct[i] < 0) break;
-            int nb = alloc_block();
-            if (nb < 0) {
-                cout << "No space during copy\n";
-                inodes[didx] = Inode();
-                return;
-            }
+    void decode_checksums(const string &in, const string &table, int slot) {
+        csum = in;
+        piece_crc.resize(table.size() / 4);
+        for (size_t p = 0; p < piece_crc.size(); ++p) piece_crc[p] = get_le(&table[p * 4], 4);
+        csum_stale[slot].clear();
+        csum_stale[slot ^ 1].clear();
+        for (size_t p = 0; p < piece_crc.size(); ++p) csum_stale[slot ^ 1].insert(p);
+        const char *p = in.data();
+        for (uint64_t &w : sb.block_bitmap.words) w = get_le(p, 8), p += 8;
+        for (int b = 0; b < NUM_BLOCKS; ++b) data_blocks.set_entry(b, get_le(p, 4)), p += 4;
+        for (uint32_t &c : block_crc) c = get_le(p, 4), p += 4;
+        data_blocks.rebuild();
+        for (uint32_t &c : inode_crc) c = get_le(p, 4), p += 4;
+    }
 
-            memcpy(data_blocks[nb], data_blocks[sin.direct[i]], BLOCK_SIZE);
-            din.direct[i] = nb;
+    // Releases the file space of arena pages whose granules have all been
+    // freed since the last checkpoint. Runs at checkpoints, after the data
+    // has been synced and while no command can allocate.
+    void punch_free() {
+        vector<int> pages = data_blocks.take_free_pages();
+        for (size_t i = 0; i < pages.size(); ) {
+            size_t j = i + 1;
+            while (j < pages.size() && pages[j] == pages[j - 1] + 1) ++j;
+            fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      ImageLayout::data_off() + (off_t)pages[i] * BlockStore::PAGE_BYTES,
+                      (off_t)(j - i) * BlockStore::PAGE_BYTES);
+            i = j;
         }
+    }
 
-        if (sin.indirect >= 0) {
-            int nib = alloc_block();
-            if (nib < 0) {
-                for (int i = 0; i < DIRECT_PTRS; ++i)
-                    if (din.direct[i] >= 0) free_block(din.direct[i]);
-                inodes[didx] = Inode();
-                cout << "No space during copy\n";
-                return;
-            }
-
-            din.indirect = nib;
-            int *sptrs = reinterpret_cast<int*>(data_blocks[sin.indirect]);
-            int *dptrs = reinterpret_cast<int*>(data_blocks[nib]);
+    void save_image() {
+        checkpoint();
+    }
 
-            for (int i = 0; i < BLOCK_SIZE / sizeof(int); ++i) {
-                if (sptrs[i] <= 0) break;
-                int nb = alloc_block();
-                if (nb < 0) {
-                    for (int j = 0; j < DIRECT_PTRS; ++j)
-                        if (din.direct[j] >= 0) free_block(din.direct[j]);
-                    free_block(nib);
-                    inodes[didx] = Inode();
-                    cout << "No space during copy\n";
-                    return;
-                }
-                memcpy(data_blocks[nb], data_blocks[sptrs[i]], BLOCK_SIZE);
-                dptrs[i] = nb;
+    // Applies one journal record. With apply == false it only parses, which
+    // is used to find and verify the end of a transaction first.
+    bool replay_record(JournalReader &r, char type, bool apply) {
+        if (type == 'I') {
+            int i = r.get_int();
+            char rec[INODE_RECORD];
+            r.get(rec, sizeof(rec));
+            if (!r.ok || i < 0 || i >= MAX_INODES) return false;
+            Inode ino;
+            decode_inode(rec, ino);
+            if (apply) {
+                if (i >= inodes.size()) inodes.resize(i + 1);
+                inodes[i] = ino;
+                ckpt_inodes.insert(i);
+            }
+        } else if (type == 'B') {
+            int w = r.get_int();
+            uint64_t v = r.get_u(8);
+            uint32_t entries[64];
+            for (uint32_t &e : entries) e = r.get_u(4);
+            if (!r.ok || w < 0 || w >= (int)sb.block_bitmap.words.size()) return false;
+            if (apply) {
+                sb.block_bitmap.words[w] = v;
+                for (int i = 0; i < 64; ++i) data_blocks.set_entry(w * 64 + i, entries[i]);
+                ckpt_words.insert(w);
+            }
+        } else if (type == 'D') {
+            int ino = r.get_int();
+            int parent = r.get_int();
+            string name = r.get_str();
+            if (!r.ok) return false;
+            if (apply) directories[ino] = make_shared<Directory>(parent, name);
+        } else if (type == 'R') {
+            int ino = r.get_int();
+            if (!r.ok) return false;
+            if (apply) directories.erase(ino);
+        } else if (type == 'A' || type == 'X') {
+            int dir = r.get_int();
+            string name = r.get_str();
+            int ino = type == 'A' ? r.get_int() : -1;
+            if (!r.ok) return false;
+            if (apply) {
+                shared_ptr<Directory> &d = directories[dir];
+                if (!d) d = make_shared<Directory>();
+                d->remove(name);
+                if (type == 'A') d->add(name, ino);
             }
+        } else {
+            return false;
         }
+        return true;
+    }
 
-        string parent = abs_dst.substr(0, abs_dst.find_last_of('/'));
-        if (parent.empty()) parent = "/";
-        string name = abs_dst.substr(abs_dst.find_last_of('/') + 1);
-
-        for (auto &entry : directories[parent]) {
-            if (entry.name == name) {
-                cout << "Error: Target '" << name << "' already exists\n";
-                for (int i = 0; i < DIRECT_PTRS && din.direct[i] >= 0; ++i)
-                    free_block(din.direct[i]);
-                if (din.indirect >= 0) {
-                    int *ptrs = reinterpret_cast<int*>(data_blocks[din.indirect]);
-                    for (int i = 0; i < BLOCK_SIZE / sizeof(int); ++i)
-                        if (ptrs[i] > 0) free_block(ptrs[i]);
-                    free_block(din.indirect);
-                }
+    // Calls fn(type, reader) for each record of every complete transaction in
+    // `log`, in order, and returns the number of transactions.
+    template <class F>
+    int for_each_record(const string &log, F fn) {
+        size_t pos = 0;
+        int txns = 0;
+        while (pos < log.size()) {
+            JournalReader scan(log, pos);
+            char type = 0;
+            while (true) {
+                scan.get(&type, 1);
+                if (!scan.ok || type == 'C' || !replay_record(scan, type, false)) break;
+            }
+            if (!scan.ok || type != 'C') break;
+            size_t body_end = scan.pos - 1;
+            uint64_t sum = scan.get_u(8);
+            if (!scan.ok || sum != Journal::checksum(log.data() + pos, body_end - pos)) break;
 
-                inodes[didx] = Inode();
-                return;
+            JournalReader r(log, pos);
+            while (r.pos < body_end) {
+                r.get(&type, 1);
+                fn(type, r);
             }
+            pos = scan.pos;
+            ++txns;
         }
+        return txns;
+    }
 
-        directories[parent].push_back({name, didx});
-        cout << "Copied " << src << " to " << dst << "\n";
+    // Inodes that the journal rewrites on replay.
+    set<int> journal_inodes(const string &log) {
+        set<int> inos;
+        for_each_record(log, [&](char type, JournalReader &r) {
+            if (type == 'I') {
+                size_t at = r.pos;
+                inos.insert(r.get_int());
+                r.pos = at;
+            }
+            replay_record(r, type, false);
+        });
+        return inos;
     }
 
-    void cmd_sum() {
-        cout << "Total blocks: " << sb.total_blocks
-             << " Used: " << (sb.total_blocks - sb.free_blocks)
-             << " Free: " << sb.free_blocks << "\n";
+    void replay_journal(const string &log) {
+        int txns = for_each_record(log, [&](char type, JournalReader &r) { replay_record(r, type, true); });
+        if (txns > 0) ckpt_dirs = true;
+        if (txns == 0 && log.empty()) return;
+        dcache.clear();
+        sb.free_blocks = sb.block_bitmap.count_free();
+        data_blocks.rebuild();
+        rebuild_inode_free_list();
+        checkpoint();
     }
 
-    void cmd_cat(const string &path) {
-        int ino_idx = lookup_inode(path);
-        if (ino_idx < 0) { cout << "File not found\n"; return; }
-        Inode &fin = inodes[ino_idx];
-        int read = 0;
-        for (int i = 0; i < DIRECT_PTRS && read < fin.size; ++i) {
-            int b = fin.direct[i]; 
-            if (b < 0) break;
-            int toRead = min(BLOCK_SIZE, fin.size - read);
-            cout.write(data_blocks[b], toRead);
-            read += toRead;
+    // Runs fn(lo, hi) over [0, n) in pieces of `grain` on the task pool.
+    template <class F>
+    void parallel_for(int n, int grain, F fn) {
+        if (n <= grain) {
+            if (n > 0) fn(0, n);
+            return;
         }
+        TaskPool &tp = task_pool();
+        tp.run([&] {
+            for (int lo = 0; lo < n; lo += grain)
+                tp.spawn([&fn, lo, n, grain] { fn(lo, min(n, lo + grain)); });
+        });
+    }
 
-        if (read < fin.size && fin.indirect >= 0) {
-            int *ptrs = reinterpret_cast<int*>(data_blocks[fin.indirect]);
-            for (int i = 0; i < BLOCK_SIZE / sizeof(int) && read < fin.size; ++i) {
-                int b = ptrs[i]; 
-                if (b <= 0) break;
-                int toRead = min(BLOCK_SIZE, fin.size - read);
-                cout.write(data_blocks[b], toRead);
-                read += toRead;
-            }
+    // Used blocks whose contents no longer match their checksum. Blocks in
+    // bitmap words changed since the last checkpoint, committed or not, have
+    // none yet and are skipped; their number goes to *pending.
+    vector<int> verify_blocks(int *pending = nullptr) {
+        vector<char> skip(sb.block_bitmap.words.size());
+        for (int w : ckpt_words) skip[w] = 1;
+        {
+            lock_guard<mutex> g(txn_mu);
+            for (int w : txn_words) skip[w] = 1;
         }
-        cout << "\n";
+        vector<int> bad;
+        mutex bad_mu;
+        atomic<int> skipped(0);
+        const int RANGE = 1024;
+        parallel_for((NUM_BLOCKS + RANGE - 1) / RANGE, 1, [&](int lo, int hi) {
+            vector<int> mine;
+            int n = 0;
+            for (int b = lo * RANGE; b < min(NUM_BLOCKS, hi * RANGE); ++b) {
+                if (sb.block_bitmap.test(b)) continue;
+                if (skip[b >> 6]) { ++n; continue; }
+                if (data_blocks.crc(b) != block_crc[b]) mine.push_back(b);
+            }
+            skipped += n;
+            lock_guard<mutex> g(bad_mu);
+            bad.insert(bad.end(), mine.begin(), mine.end());
+        });
+        sort(bad.begin(), bad.end());
+        if (pending) *pending = skipped;
+        return bad;
     }
 
-    void save_image(const string &file = "fs.img") {
-        ofstream out(file, ios::binary);
-        out.write((char*)&sb.total_blocks, sizeof(sb.total_blocks));
-        out.write((char*)&sb.free_blocks, sizeof(sb.free_blocks));
+    // Maps `file` as the block device, creating an empty volume if it does
+    // not hold one yet. The header, checksum section, inode table and
+    // directory map are checked against their CRC32Cs first (the inode table
+    // in parallel, by chunk) and a volume that fails is left alone. Data
+    // blocks fault in lazily unless `verify` asks for them to be checked
+    // too; any transactions left in the journal are replayed on top.
+    void load_image(const string &file = "fs.img", bool verify = false) {
+        int fd = open(file.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) { cout << "Cannot open " << file << ", running in memory\n"; return; }
+
+        ImageHeader h = {};
+        char hb[ImageHeader::BYTES] = {};
+        bool fresh = pread(fd, hb, sizeof(hb), 0) <= 0;
+        string why = fresh ? "" : h.decode(hb);
+        string csum, table, raw, dirs, log;
+        if (!fresh && why.empty()) {
+            csum.resize(h.csum_bytes);
+            table.resize((size_t)ImageLayout::csum_pieces(h.inode_count) * 4);
+            raw.resize((size_t)h.inode_count * INODE_RECORD);
+            dirs.resize(h.dir_bytes);
+            if (h.csum_bytes != (uint64_t)ImageLayout::csum_bytes(h.inode_count) ||
+                pread(fd, &csum[0], csum.size(), ImageLayout::csum_off(h.csum_slot)) != (ssize_t)csum.size() ||
+                pread(fd, &table[0], table.size(), ImageLayout::piece_crc_off(h.csum_slot)) != (ssize_t)table.size() ||
+                !check_checksums(csum, table, h.csum_crc))
+                why = "checksum section is damaged";
+            else if (pread(fd, &dirs[0], dirs.size(), h.dir_pos) != (ssize_t)dirs.size() ||
+                     crc32c(dirs.data(), dirs.size()) != h.dir_crc)
+                why = "directory map is damaged";
+            else if (pread(fd, &raw[0], raw.size(), ImageLayout::inode_off()) != (ssize_t)raw.size())
+                why = "inode table is truncated";
+        }
+        if (!fresh && why.empty()) {
+            Journal j;
+            j.open(file + ".journal");
+            log = j.read_all();
+            set<int> inos = journal_inodes(log);
+            // A chunk may differ if the journal rewrites one of its records: a
+            // checkpoint was cut short, and replaying repairs it.
+            const char *stored = &csum[ImageLayout::chunk_crc_off()];
+            atomic<int> bad(0);
+            parallel_for(ImageLayout::inode_chunks(h.inode_count), 64, [&](int lo, int hi) {
+                for (int c = lo; c < hi; ++c) {
+                    int first = c * ImageLayout::INODE_CHUNK;
+                    int end = min(h.inode_count, first + ImageLayout::INODE_CHUNK);
+                    uint32_t crc = crc32c(&raw[(size_t)first * INODE_RECORD], (size_t)(end - first) * INODE_RECORD);
+                    if (crc == get_le(stored + 4 * c, 4)) continue;
+                    auto it = inos.lower_bound(first);
+                    if (it == inos.end() || *it >= end) bad++;
+                }
+            });
+            if (bad > 0) why = "inode table is damaged in " + to_string(bad) + " chunks";
+        }
+        if (!why.empty()) {
+            cout << "Cannot use " << file << " (" << why << "), running in memory\n";
+            close(fd);
+            return;
+        }
+        if (fresh && ftruncate(fd, 0) == 0)
+            ftruncate(fd, ImageLayout::dir_off());
+        if (!data_blocks.attach(fd, ImageLayout::data_off())) {
+            cout << "Cannot map " << file << ", running in memory\n";
+            close(fd);
+            return;
+        }
+        image_fd = fd;
+        journal.open(file + ".journal");
 
-        for (size_t i = 0; i < sb.block_bitmap.size(); ++i) {
-            bool b = sb.block_bitmap[i];
-            out.write((char*)&b, sizeof(b));
+        if (fresh) {
+            journal.truncate();
+            for (int i = 0; i < inodes.size(); ++i) ckpt_inodes.insert(i);
+            for (size_t w = 0; w < sb.block_bitmap.words.size(); ++w) ckpt_words.insert(w);
+            ckpt_dirs = true;
+            txn_inodes.clear();
+            checkpoint();
+            return;
         }
-        for (auto &ino : inodes) out.write((char*)&ino, sizeof(ino));
+        image = h;
 
-        size_t dirCount = directories.size();
-        out.write((char*)&dirCount, sizeof(dirCount));
-        for (const auto& pair : directories) {
-            const string& path = pair.first;
-            const vector<DirEntry>& entries = pair.second;
-            size_t pathLen = path.size();
-            out.write((char*)&pathLen, sizeof(pathLen));
-            out.write(path.c_str(), pathLen);
-            size_t entryCount = entries.size();
-            out.write((char*)&entryCount, sizeof(entryCount));
-            for (const auto& e : entries) {
-                size_t nameLen = e.name.size();
-                out.write((char*)&nameLen, sizeof(nameLen));
-                out.write(e.name.c_str(), nameLen);
-                out.write((char*)&e.inode_idx, sizeof(e.inode_idx));
+        inode_crc.resize(ImageLayout::inode_chunks(h.inode_count));
+        decode_checksums(csum, table, h.csum_slot);
+        sb.free_blocks = sb.block_bitmap.count_free();
+        sb.reset_cursors();
+
+        inodes.resize(h.inode_count);
+        parallel_for(h.inode_count, 4096, [&](int lo, int hi) {
+            for (int i = lo; i < hi; ++i) decode_inode(&raw[(size_t)i * INODE_RECORD], inodes[i]);
+        });
+        rebuild_inode_free_list();
+
+        decode_directories(dirs);
+        txn_inodes.clear();
+
+        replay_journal(log);
+        rebuild_block_refs();
+        rebuild_usage();
+        rebuild_listings();
+        index_blocks();
+
+        if (verify) {
+            vector<int> bad = verify_blocks();
+            if (!bad.empty()) {
+                cout << "Warning: " << bad.size() << " data blocks fail their checksum:";
+                for (size_t i = 0; i < min<size_t>(bad.size(), 16); ++i) cout << " " << bad[i];
+                cout << (bad.size() > 16 ? " ...\n" : "\n");
             }
         }
+    }
 
-        for (int i = 0; i < NUM_BLOCKS; ++i) out.write(data_blocks[i], BLOCK_SIZE);
-        out.close();
+    static StatHist command_hist(string_view cmd) {
+        for (int h = 0; h < HIST_OTHER; ++h)
+            if (cmd == hist_names[h]) return (StatHist)h;
+        return HIST_OTHER;
     }
 
-    void load_image(const string &file = "fs.img") {
-        ifstream in(file, ios::binary);
-        if (!in) return;
-        in.read((char*)&sb.total_blocks, sizeof(sb.total_blocks));
-        in.read((char*)&sb.free_blocks, sizeof(sb.free_blocks));
-        for (size_t i = 0; i < sb.block_bitmap.size(); ++i) {
-            bool b;
-            in.read((char*)&b, sizeof(b));
-            sb.block_bitmap[i] = b;
+    const string &arg(const string_view *tok, int i) {
+        return sess().args[i].assign(tok[i].data(), tok[i].size());
+    }
+
+    // Runs one command line for session `s`; returns false once it asks to
+    // exit. Only the console session's exit saves the volume.
+    bool execute(Session &s, string_view line) {
+        cur_session = &s;
+        string_view tok[6];
+        int n = tokenize(line, tok, 6);
+        s.failed = false;
+        if (n == 0) return true;
+        string_view cmd = tok[0];
+        if (cmd == "exit") {
+            if (&s == &console) save_image();
+            out() << "See You Next Time !\n\n";
+            return false;
+        }
+        StatTimer t(command_hist(cmd));
+        if (cmd == "stats") {
+            cmd_stats(tok[1]);
+            return true;
+        }
+        if (cmd == "fsck") {
+            cmd_fsck();
+            return true;
         }
+        if (cmd == "defrag") {
+            cmd_defrag(arg(tok, 1));
+            return true;
+        }
+        if (cmd == "cat") {
+            int64_t off = 0, len = INT64_MAX;
+            if (!parse_count(tok[2], off) || !parse_count(tok[3], len))
+                err() << "Usage: cat <path> [offset [length]]\n";
+            else
+                cmd_cat(arg(tok, 1), off, len);
+            return true;
+        }
+        shared_lock<OpGate> g(ops);
+        if (cmd == "createDir") {
+            cmd_createDir(arg(tok, 1));
+        } else if (cmd == "deleteDir") {
+            if (tok[1] == "-r") cmd_deleteDir(arg(tok, 2), true);
+            else cmd_deleteDir(arg(tok, 1));
+        } else if (cmd == "changeDir") {
+            cmd_changeDir(arg(tok, 1));
+        } else if (cmd == "dir") {
+            int64_t off = 0, count = INT64_MAX;
+            if (!parse_count(tok[1], off) || !parse_count(tok[2], count))
+                err() << "Usage: dir [offset [count]]\n";
+            else
+                cmd_dir(off, count);
+        } else if (cmd == "createFile") {
+            int sz = 0;
+            uint64_t seed;
+            FillEngine fill = {FillPattern::Letters, next_fill_seed()};
+            if (parse_num(tok[4], seed)) fill.seed = seed;
+            if (tok[3] == "zeros") fill.pattern = FillPattern::Zeros;
+            if (!parse_num(tok[2], sz) || sz < 0)
+                err() << "Usage: createFile <path> <size KB> [letters|zeros [seed]]\n";
+            else if (!tok[3].empty() && tok[3] != "letters" && tok[3] != "zeros")
+                err() << "Unknown fill pattern (use letters or zeros)\n";
+            else
+                cmd_createFile(arg(tok, 1), sz, fill);
+        } else if (cmd == "deleteFile") {
+            cmd_deleteFile(arg(tok, 1));
+        } else if (cmd == "cp") {
+            cmd_cp(arg(tok, 1), arg(tok, 2));
+        } else if (cmd == "sum") {
+            cmd_sum();
+        } else if (cmd == "du") {
+            cmd_du(arg(tok, 1));
+        } else if (cmd == "dedup-stats") {
+            cmd_dedup_stats();
+        } else {
+            err() << "Unknown command\n";
+        }
+        return true;
+    }
 
-        for (auto &ino : inodes) in.read((char*)&ino, sizeof(ino));
+    void print_status(Session &s, long long lineno, string_view line) {
+        string_view tok[1];
+        if (tokenize(line, tok, 1) > 0)
+            *s.out << "@status " << lineno << ' ' << tok[0] << ' '
+                   << (s.failed ? "error" : "ok") << '\n';
+    }
 
-        size_t dirCount;
-        in.read((char*)&dirCount, sizeof(dirCount));
-        directories.clear();
-        for (size_t i = 0; i < dirCount; ++i) {
-            size_t pathLen;
-            in.read((char*)&pathLen, sizeof(pathLen));
-            string path(pathLen, '\0');
-            in.read(&path[0], pathLen);
-            size_t entryCount;
-            in.read((char*)&entryCount, sizeof(entryCount));
-            vector<DirEntry> entries;
-            for (size_t j = 0; j < entryCount; ++j) {
-                size_t nameLen;
-                in.read((char*)&nameLen, sizeof(nameLen));
-                string name(nameLen, '\0');
-                in.read(&name[0], nameLen);
-                int inode_idx;
-                in.read((char*)&inode_idx, sizeof(inode_idx));
-                entries.push_back({name, inode_idx});
-            }
-            directories[path] = entries;
-        }
-
-        for (int i = 0; i < NUM_BLOCKS; ++i) in.read(data_blocks[i], BLOCK_SIZE);
-        in.close();
-    }
-
-    void run() {
+    // Interactive mode prints the banner, a prompt per line and a blank line
+    // after each command, and commits after every command. Batch mode prints
+    // none of that; instead each command is followed by a status line
+    //     @status <line> <command> ok|error
+    // and commits are grouped every opt.commit_every commands.
+    void run(const RunOptions &opt = RunOptions()) {
+        if (!opt.batch) {
         cout << "\n----------------------------------------------------------------------------------------------------------------------------\n";
         cout << "\nWelcome to UnixFS Simulator! Group: Davis Y Jue (20229990180), Gilbert (202269990192), Rafael Reynard Ricardo (202269990184)\n";
         cout << "© DGR Project. All rights reserved.\n";
         cout << "\n----------------------------------------------------------------------------------------------------------------------------\n\n";
-        load_image();
-        string line;
+        }
+        dedup.on = opt.dedup;
+        set_cache_budget((size_t)opt.cache_mb << 20);
+        load_image(opt.image, opt.verify);
+        if (!opt.stats_file.empty()) start_stats_dump(opt.stats_file, opt.stats_every);
+        if (!opt.socket.empty()) {
+            serve(opt.socket);
+            stop_stats_dump(opt.stats_file);
+            return;
+        }
+        LineReader in(opt.in_fd);
+        string_view line;
+        long long lineno = 0;
+        int pending = 0;
         while (true) {
-            cout << "UnixFS " << cwd << " > ";
-            if (!getline(cin, line)) break;
-            string cmd;
-            stringstream ss(line);
-            ss >> cmd;
-            if (cmd == "exit") {
-                save_image();
-                cout << "See You Next Time !\n\n";
+            if (!opt.batch) {
+                cout << "UnixFS " << console.cwd << " > ";
+                cout.flush();
+            }
+            if (!in.next(line)) {
+                if (opt.batch) save_image();
                 break;
-            } else if (cmd == "createDir") {
-                string p; ss >> p; cmd_createDir(p);
-            } else if (cmd == "deleteDir") {
-                string p; ss >> p; cmd_deleteDir(p);
-            } else if (cmd == "changeDir") {
-                string p; ss >> p; cmd_changeDir(p);
-            } else if (cmd == "dir") {
-                cmd_dir();
-            } else if (cmd == "createFile") {
-                string p; int sz; ss >> p >> sz; cmd_createFile(p, sz);
-            } else if (cmd == "deleteFile") {
-                string p; ss >> p; cmd_deleteFile(p);
-            } else if (cmd == "cp") {
-                string s, d; ss >> s >> d; cmd_cp(s, d);
-            } else if (cmd == "sum") {
-                cmd_sum();
-            } else if (cmd == "cat") {
-                string p; ss >> p; cmd_cat(p);
-            } else {
-                cout << "Unknown command\n";
             }
-            cout << "\n";
+            ++lineno;
+            bool more = execute(console, line);
+            if (opt.batch) print_status(console, lineno, line);
+            if (!more) break;
+            if (++pending >= opt.commit_every) {
+                commit();
+                pending = 0;
+            }
+            if (!opt.batch) cout << "\n";
         }
-        
+        stop_stats_dump(opt.stats_file);
+        cout.flush();
+    }
+
+    // One client connection: a session of its own, commands read line by line
+    // and answered in batch format. Each reply is sent once the command is in
+    // the journal.
+    void serve_client(int fd) {
+        FdOutBuf buf(fd);
+        ostream os(&buf);
+        Session s;
+        s.out = &os;
+        s.out_fd = fd;
+        LineReader in(fd, 1 << 16);
+        string_view line;
+        long long lineno = 0;
+        while (in.next(line)) {
+            ++lineno;
+            bool more = execute(s, line);
+            commit_sync();
+            print_status(s, lineno, line);
+            os.flush();
+            if (!more) break;
+        }
+        close(fd);
+    }
+
+    // Accepts clients on a Unix-domain socket, one thread per connection.
+    void serve(const string &path) {
+        signal(SIGPIPE, SIG_IGN);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) { cerr << "Socket path too long\n"; return; }
+        strcpy(addr.sun_path, path.c_str());
+        int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path.c_str());
+        if (lfd < 0 || bind(lfd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 128) < 0) {
+            cerr << "Cannot listen on " << path << ": " << strerror(errno) << "\n";
+            if (lfd >= 0) close(lfd);
+            return;
+        }
+        cout << "Listening on " << path << "\n";
+        cout.flush();
+        while (true) {
+            int fd = accept(lfd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                break;
+            }
+            thread([this, fd] { serve_client(fd); }).detach();
+        }
+        close(lfd);
+        save_image();
     }
 };
 
-int main() {
-    FileSystem fs;
-    fs.run();
+#ifndef UNIXFS_NO_MAIN
+static void usage(const char *prog) {
+    cerr << "usage: " << prog << " [-i image] [-G 1k|4k|64k] [-V] [-D] [-M MB] [-b] [-c N] [-s socket] [-S file [-T secs]] [script|-]\n"
+         << "  -i image  volume file (default fs.img)\n"
+         << "  -G geom   volume geometry: 1k (1KB blocks, 16MB; default), 4k (4KB, 1GB),\n"
+         << "            64k (64KB, 4GB); an image only opens with the geometry it was made with\n"
+         << "  -V        verify every data block against its checksum on load\n"
+         << "  -D        dedup: store identical data blocks once\n"
+         << "  -M MB     buffer cache budget for the volume file (default 256)\n"
+         << "  -b        batch mode: no prompts, one status line per command\n"
+         << "  -c N      batch mode: commit the journal every N commands (default 1024)\n"
+         << "  -s socket serve concurrent clients on this Unix-domain socket\n"
+         << "  -S file   write statistics as JSON to this file every 10 seconds\n"
+         << "  -T secs   interval for -S\n"
+         << "  script    read commands from this file (implies -b); - reads stdin\n";
+}
+
+template <class G>
+static void run_volume(const RunOptions &opt) {
+    FileSystem<G> fs;
+    fs.run(opt);
+}
+
+int main(int argc, char **argv) {
+    RunOptions opt;
+    int commit_every = 1024;
+    const char *script = nullptr;
+    string geometry = "1k";
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "-i" && i + 1 < argc) opt.image = argv[++i];
+        else if (a == "-G" && i + 1 < argc) geometry = argv[++i];
+        else if (a == "-b") opt.batch = true;
+        else if (a == "-V") opt.verify = true;
+        else if (a == "-D") opt.dedup = true;
+        else if (a == "-M" && i + 1 < argc) opt.cache_mb = max(1, atoi(argv[++i]));
+        else if (a == "-c" && i + 1 < argc) commit_every = max(1, atoi(argv[++i]));
+        else if (a == "-s" && i + 1 < argc) { opt.socket = argv[++i]; opt.batch = true; }
+        else if (a == "-S" && i + 1 < argc) opt.stats_file = argv[++i];
+        else if (a == "-T" && i + 1 < argc) opt.stats_every = max(1, atoi(argv[++i]));
+        else if (a == "-" || a[0] != '-') { script = argv[i]; opt.batch = true; }
+        else { usage(argv[0]); return 2; }
+    }
+    if (script && strcmp(script, "-") != 0) {
+        opt.in_fd = open(script, O_RDONLY);
+        if (opt.in_fd < 0) { cerr << "Cannot open " << script << "\n"; return 1; }
+    }
+
+    static char outbuf[1 << 20];
+    if (opt.batch) {
+        opt.commit_every = commit_every;
+        ios::sync_with_stdio(false);
+        cout.rdbuf()->pubsetbuf(outbuf, sizeof(outbuf));
+    }
+
+    if (geometry == "1k") run_volume<Geometry1K>(opt);
+    else if (geometry == "4k") run_volume<Geometry4K>(opt);
+    else if (geometry == "64k") run_volume<Geometry64K>(opt);
+    else { usage(argv[0]); return 2; }
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,1176 @@
+// Tests for the UnixFS engine in test.cpp, and for the workloads of
+// bench.cpp, which brings test.cpp in.
+//
+//   g++ -std=c++17 -O2 -pthread tests.cpp -o tests
+//
+//   tests [--filter text]
+//
+// Each test prints one line, "ok" or "FAIL" with what went wrong, and the
+// exit status is the number of tests that failed. Crash tests run the
+// commands before the crash in a child process that exits without saving,
+// which leaves the image and journal as a kill -9 would, then load the
+// image again in the parent.
+
+#define UNIXFS_BENCH_NO_MAIN
+#include "bench.cpp"
+
+#include <fstream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static int checks_failed;
+
+#define CHECK(cond)                                                                \
+    do {                                                                           \
+        if (!(cond)) {                                                             \
+            cout << "    " << __FILE__ << ":" << __LINE__ << ": " #cond "\n";      \
+            checks_failed++;                                                       \
+        }                                                                          \
+    } while (0)
+
+// Captures what commands print, through the stream and, for cat, straight
+// to the descriptor, in the order a client would see it.
+struct TestSession {
+    int fd;
+    FdOutBuf buf;
+    ostream os;
+    Session s;
+    TestSession() : fd(fileno(tmpfile())), buf(fd), os(&buf) {
+        s.out = &os;
+        s.out_fd = fd;
+        cur_session = &s;
+    }
+    ~TestSession() {
+        close(fd);
+        cur_session = nullptr;
+    }
+
+    // Runs one command line and returns its output.
+    template <class G>
+    string run(FileSystem<G> &fs, const string &line) {
+        ftruncate(fd, 0);
+        lseek(fd, 0, SEEK_SET);
+        fs.execute(s, line);
+        os.flush();
+        off_t n = lseek(fd, 0, SEEK_END);
+        string out(n, '\0');
+        pread(fd, &out[0], n, 0);
+        return out;
+    }
+};
+
+// Runs fn against the image in a child process that then dies without
+// saving or checkpointing.
+template <class G, class F>
+static void crash_after(const string &img, F fn) {
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        {
+            TestSession ts;
+            FileSystem<G> fs;
+            fs.load_image(img);
+            fn(fs, ts);
+            _exit(0);
+        }
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static bool fsck_clean(const string &out) {
+    return out.find("fsck: no problems found") != string::npos;
+}
+
+// Blocks freed by a transaction that never committed must still hold the
+// data the last commit maps, even though the same batch reused them.
+template <class G>
+static void test_crash_reuse_freed() {
+    string img = temp_image();
+    string before;
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        ts.run(fs, "createFile /f 4 letters 1");
+        fs.save_image();
+        before = ts.run(fs, "cat /f");
+    }
+    crash_after<G>(img, [](FileSystem<G> &fs, TestSession &ts) {
+        ts.run(fs, "deleteFile /f");
+        ts.run(fs, "createFile /g 4 letters 2");
+        ts.run(fs, "createFile /h 4 zeros");
+    });
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        CHECK(ts.run(fs, "cat /f") == before);
+        CHECK(fsck_clean(ts.run(fs, "fsck")));
+    }
+    remove_image(img);
+}
+
+// The same, with the delete committed and the crash after the reuse: the
+// freed blocks come back only once the delete is durable.
+template <class G>
+static void test_crash_after_committed_free() {
+    string img = temp_image();
+    crash_after<G>(img, [](FileSystem<G> &fs, TestSession &ts) {
+        ts.run(fs, "createFile /f 4 letters 1");
+        fs.commit();
+        ts.run(fs, "deleteFile /f");
+        fs.commit();
+        ts.run(fs, "createFile /g 4 letters 2");
+        fs.commit();
+    });
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        CHECK(ts.run(fs, "cat /f").find("File not found") != string::npos);
+        CHECK(ts.run(fs, "cat /g").size() >= 4 * (size_t)G::BLOCK_SIZE);
+        CHECK(fsck_clean(ts.run(fs, "fsck")));
+    }
+    remove_image(img);
+}
+
+// A second defrag pass over a volume the first one packed finds nothing
+// left to move.
+template <class G>
+static void test_defrag_settles() {
+    TestSession ts;
+    FileSystem<G> fs;
+    mt19937_64 rng(7);
+    vector<string> live;
+    const int sizes[] = {3, 17, 60, 150, 250};
+    for (int round = 0, n = 0; round < 6; ++round) {
+        for (int i = 0; i < 40; ++i, ++n) {
+            live.push_back("/f" + to_string(n));
+            ts.run(fs, "createFile " + live.back() + " " + to_string(sizes[rng() % 5]) + " letters " + to_string(n));
+        }
+        shuffle(live.begin(), live.end(), rng);
+        for (int i = 0; i < 20; ++i) ts.run(fs, "deleteFile " + live[i]);
+        live.erase(live.begin(), live.begin() + 20);
+    }
+    string first = ts.run(fs, "defrag");
+    CHECK(first.find(" 0 of ") == string::npos);
+    string again = ts.run(fs, "defrag");
+    CHECK(again.find(" 0 of ") != string::npos);
+    CHECK(again.find(" 0 blocks moved, 0KB repacked") != string::npos);
+    CHECK(fsck_clean(ts.run(fs, "fsck")));
+}
+
+// Each block mode decodes back to the bytes that were stored, and put()
+// picks the mode the codec comment says it should.
+template <class G>
+static void test_codec_round_trip() {
+    const int BS = G::BLOCK_SIZE;
+    BlockStore<G> store;
+    mt19937_64 rng(11);
+    vector<string> blocks(4, string(BS, '\0'));
+    for (int i = 0; i < BS / 2; ++i) blocks[BM_LETTERS][i] = 'A' + rng() % 26;
+    for (int i = 0; i < BS; ++i) blocks[BM_LZ][i] = "ab,cd;ef\n"[i % 9];
+    for (int i = 0; i < BS; ++i) blocks[BM_RAW][i] = (char)rng();
+    for (int mode : {BM_ZERO, BM_RAW, BM_LZ, BM_LETTERS}) {
+        int b = 1 + mode;
+        CHECK(store.put(b, blocks[mode].data()));
+        CHECK(BlockStore<G>::mode_of(store.get_entry(b)) == mode);
+        string out(BS, 'x');
+        CHECK(store.read(b, &out[0]));
+        CHECK(out == blocks[mode]);
+        out.assign(BS, 'x');
+        CHECK(store.fetch(b, &out[0]));
+        CHECK(out == blocks[mode]);
+        CHECK(store.fetch(b, &out[0]));
+        CHECK(out == blocks[mode]);
+    }
+}
+
+// Commands committed to the journal but never checkpointed are replayed
+// when the image is loaded again; those after the last commit are lost.
+template <class G>
+static void test_journal_replay() {
+    const char *cmds[] = {
+        "createDir /d",
+        "createFile /d/a 5 letters 3",
+        "createFile /b 2 zeros",
+        "createFile /c 40 letters 4",
+        "cp /d/a /d/e",
+        "deleteFile /c",
+        "createFile /c 9 letters 5",
+    };
+    const char *reads[] = {"cat /d/a", "cat /b", "cat /c", "cat /d/e"};
+    vector<string> expect;
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        for (const char *c : cmds) ts.run(fs, c);
+        for (const char *r : reads) expect.push_back(ts.run(fs, r));
+    }
+    string img = temp_image();
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        fs.save_image();
+    }
+    crash_after<G>(img, [&](FileSystem<G> &fs, TestSession &ts) {
+        for (const char *c : cmds) {
+            ts.run(fs, c);
+            fs.commit();
+        }
+        ts.run(fs, "createFile /lost 3 letters 6");
+    });
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        for (size_t i = 0; i < expect.size(); ++i) CHECK(ts.run(fs, reads[i]) == expect[i]);
+        CHECK(ts.run(fs, "cat /lost").find("File not found") != string::npos);
+        CHECK(fsck_clean(ts.run(fs, "fsck")));
+    }
+    remove_image(img);
+}
+
+// A cached path must not outlive what it went through: a file replaced
+// under the same name, or a directory a ".." path passed through.
+template <class G>
+static void test_dcache_stale_paths() {
+    TestSession ts;
+    FileSystem<G> fs;
+    ts.run(fs, "createDir /d");
+    ts.run(fs, "createDir /d/e");
+    ts.run(fs, "createFile /d/e/f 1 letters 1");
+    string first = ts.run(fs, "cat /d/e/f");
+    CHECK(ts.run(fs, "cat /d/e/f") == first);
+    ts.run(fs, "deleteFile /d/e/f");
+    CHECK(ts.run(fs, "cat /d/e/f").find("File not found") != string::npos);
+    ts.run(fs, "createFile /d/e/f 1 letters 2");
+    string second = ts.run(fs, "cat /d/e/f");
+    CHECK(second.size() == first.size() && second != first);
+
+    ts.run(fs, "createFile /x 1 letters 3");
+    string x = ts.run(fs, "cat /x");
+    CHECK(ts.run(fs, "cat /d/e/../../x") == x);
+    ts.run(fs, "deleteDir -r /d");
+    ts.run(fs, "createDir /d");
+    CHECK(ts.run(fs, "cat /d/e/../../x").find("File not found") != string::npos);
+    CHECK(ts.run(fs, "cat /d/../x") == x);
+}
+
+// A directory with many entries finds each of them, and none it lost.
+template <class G>
+static void test_directory_index() {
+    TestSession ts;
+    FileSystem<G> fs;
+    ts.run(fs, "createDir /w");
+    const int N = 3000;
+    for (int i = 0; i < N; ++i) ts.run(fs, "createFile /w/f" + to_string(i) + " 0");
+    for (int i = 0; i < N; i += 2) ts.run(fs, "deleteFile /w/f" + to_string(i));
+    int found = 0, missing = 0;
+    for (int i = 0; i < N; ++i) {
+        bool gone = ts.run(fs, "cat /w/f" + to_string(i)).find("File not found") != string::npos;
+        (i % 2 ? found : missing) += i % 2 ? !gone : gone;
+    }
+    CHECK(found == N / 2);
+    CHECK(missing == N / 2);
+    CHECK(ts.run(fs, "du /w").find(" " + to_string(N / 2 + 1) + " inodes") != string::npos);
+}
+
+// Ranges read the bytes they name, whether they go through the stream or
+// straight to the descriptor; bad ranges are refused.
+template <class G>
+static void test_cat_ranges() {
+    TestSession ts;
+    FileSystem<G> fs;
+    ts.run(fs, "createFile /f 300 letters 4");
+    string all = ts.run(fs, "cat /f");
+    CHECK(all.size() == 300 * 1024 + 1 && all.back() == '\n');
+    all.pop_back();
+    const int64_t ranges[][2] = {{0, 1}, {5, 3}, {1023, 2}, {1000, 70000}, {70000, 200000},
+                                 {300 * 1024 - 4, 100}, {300 * 1024, 5}, {400000, 1}};
+    for (auto &r : ranges) {
+        string want = r[0] < (int64_t)all.size() ? all.substr(r[0], r[1]) : "";
+        CHECK(ts.run(fs, "cat /f " + to_string(r[0]) + " " + to_string(r[1])) == want + "\n");
+    }
+    CHECK(ts.run(fs, "cat /f 307000") == all.substr(307000) + "\n");
+    for (const char *bad : {"cat /f -5 3", "cat /f zz", "cat /f 5 -1", "cat /f 2 x"}) {
+        CHECK(ts.run(fs, bad).find("Usage: cat") != string::npos);
+        CHECK(ts.s.failed);
+    }
+}
+
+// Runs `script` in batch mode against `img` and returns what it printed.
+template <class G>
+static string run_batch(const string &img, const string &script, int commit_every) {
+    FILE *in = tmpfile();
+    fputs(script.c_str(), in);
+    fflush(in);
+    lseek(fileno(in), 0, SEEK_SET);
+    RunOptions opt;
+    opt.image = img;
+    opt.batch = true;
+    opt.in_fd = fileno(in);
+    opt.commit_every = commit_every;
+    ostringstream os;
+    streambuf *saved = cout.rdbuf(os.rdbuf());
+    {
+        FileSystem<G> fs;
+        fs.run(opt);
+    }
+    cout.rdbuf(saved);
+    fclose(in);
+    return os.str();
+}
+
+static long long field(const string &out, const string &name) {
+    size_t at = out.rfind(name);
+    return at == string::npos ? -1 : atoll(out.c_str() + at + name.size());
+}
+
+// Batch mode reports each command's status, refuses sizes that are not
+// sizes, and keeps sum consistent while freed blocks wait for a commit.
+template <class G>
+static void test_batch_mode() {
+    string img = temp_image();
+    string out = run_batch<G>(img,
+        "createDir /c\n"
+        "createFile /c/a 200 letters 1\n"
+        "cp /c/a /c/b\n"
+        "createFile /x abc\n"
+        "createFile /y -5\n"
+        "createFile /z\n"
+        "deleteDir -r /c\n"
+        "sum\n", 1024);
+    CHECK(out.find("@status 1 createDir ok") != string::npos);
+    CHECK(out.find("@status 3 cp ok") != string::npos);
+    CHECK(out.find("@status 4 createFile error") != string::npos);
+    CHECK(out.find("@status 5 createFile error") != string::npos);
+    CHECK(out.find("@status 6 createFile error") != string::npos);
+    CHECK(out.find("@status 8 sum ok") != string::npos);
+    CHECK(field(out, "Pending free: ") == 201);   // the data and /c's block
+    CHECK(field(out, "Logical: ") == 0);
+    CHECK(field(out, "Physical: ") == 0);
+    CHECK(field(out, "Shared savings: ") == 0);
+
+    out = run_batch<G>(img, "sum\ncat /x\nfsck\n", 1);
+    CHECK(out.find("Pending free") == string::npos);
+    CHECK(field(out, "Used: ") == 0);
+    CHECK(out.find("@status 2 cat error") != string::npos);
+    CHECK(fsck_clean(out));
+    remove_image(img);
+}
+
+// A session whose cwd another session deletes is moved back to the root,
+// even once the directory's inode has been reused.
+template <class G>
+static void test_session_cwd_deleted() {
+    FileSystem<G> fs;
+    TestSession a, b;
+    a.run(fs, "createDir /d");
+    a.run(fs, "changeDir /d");
+    CHECK(a.run(fs, "createFile f 1").find("File created: /d/f") != string::npos);
+    b.run(fs, "deleteDir -r /d");
+    b.run(fs, "createDir /e");
+    b.run(fs, "createDir /e/g");
+    string out = a.run(fs, "createFile h 1");
+    CHECK(out.find("Current directory was deleted, back at /") != string::npos);
+    CHECK(out.find("File created: /h") != string::npos);
+    CHECK(a.run(fs, "cat /e/g/h").find("File not found") != string::npos);
+    CHECK(a.s.cwd == "/" && a.s.cwd_ino.idx == 0);
+}
+
+// Sessions on several threads work side by side while another thread
+// keeps committing; every command succeeds and the volume stays sound.
+template <class G>
+static void test_concurrent_sessions() {
+    string img = temp_image();
+    FileSystem<G> fs;
+    fs.load_image(img);
+    const int THREADS = 6, ROUNDS = 150;
+    atomic<int> failed(0);
+    atomic<bool> done(false);
+    thread committer([&] {
+        while (!done) fs.commit();
+    });
+    vector<thread> workers;
+    for (int t = 0; t < THREADS; ++t)
+        workers.emplace_back([&, t] {
+            TestSession ts;
+            string dir = "/t" + to_string(t);
+            auto run = [&](const string &line) {
+                string out = ts.run(fs, line);
+                if (ts.s.failed) failed++;
+                return out;
+            };
+            run("createDir " + dir);
+            run("changeDir " + dir);
+            for (int i = 0; i < ROUNDS; ++i) {
+                string f = "f" + to_string(i % 10);
+                if (i >= 10) run("deleteFile " + f);
+                run("createFile " + f + " " + to_string(1 + i % 7) + " letters " + to_string(i));
+                if (run("cat " + f + " 0 5").size() != 6) failed++;
+                if (i % 25 == 0) run("cp " + f + " /t" + to_string((t + 1) % THREADS) + "x" + to_string(i));
+                if (i % 30 == 0) run("dir");
+            }
+        });
+    for (thread &w : workers) w.join();
+    done = true;
+    committer.join();
+    CHECK(failed == 0);
+    TestSession ts;
+    CHECK(fsck_clean(ts.run(fs, "fsck")));
+    CHECK(ts.run(fs, "dir").find("[DIR]  t5") != string::npos);
+    remove_image(img);
+}
+
+// Every task runs once, including those spawned by tasks, and threads
+// with nothing to take sleep while one long task runs.
+static void test_task_pool() {
+    TaskPool tp(4);
+    atomic<long> n(0);
+    function<void(int)> f = [&](int depth) {
+        n++;
+        if (depth < 6)
+            for (int k = 0; k < 3; ++k) tp.spawn([&, depth] { f(depth + 1); });
+    };
+    for (int rep = 0; rep < 20; ++rep) tp.run([&] { f(0); });
+    CHECK(n == 20 * 1093);
+
+    auto cpu = [] {
+        rusage r;
+        getrusage(RUSAGE_SELF, &r);
+        return r.ru_utime.tv_sec + r.ru_stime.tv_sec + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1e6;
+    };
+    double before = cpu();
+    tp.run([&] { tp.spawn([] { this_thread::sleep_for(chrono::milliseconds(300)); }); });
+    CHECK(cpu() - before < 0.1);
+}
+
+// A recursive cp copies the whole tree with the same contents.
+template <class G>
+static void test_parallel_cp() {
+    TestSession ts;
+    FileSystem<G> fs;
+    vector<string> files;
+    ts.run(fs, "createDir /a");
+    for (int d = 0; d < 6; ++d) {
+        string dir = "/a/d" + to_string(d);
+        ts.run(fs, "createDir " + dir);
+        ts.run(fs, "createDir " + dir + "/s");
+        for (int i = 0; i < 8; ++i) {
+            files.push_back(dir + (i % 2 ? "/s" : "") + "/f" + to_string(i));
+            ts.run(fs, "createFile " + files.back() + " " + to_string(1 + 13 * i) + " letters " + to_string(d * 8 + i));
+        }
+    }
+    CHECK(ts.run(fs, "cp /a /b").find("Copied /a/d5/s/f7 to /b/d5/s/f7") != string::npos);
+    for (const string &f : files) CHECK(ts.run(fs, "cat " + f) == ts.run(fs, "cat /b" + f.substr(2)));
+    string du_a = ts.run(fs, "du /a"), du_b = ts.run(fs, "du /b");
+    CHECK(du_a.substr(du_a.find(':')) == du_b.substr(du_b.find(':')));
+    CHECK(ts.run(fs, "cp /a /a/d0/s").find("Cannot copy a directory into its subdirectory") != string::npos);
+    CHECK(ts.run(fs, "cat /a/d0/s/a/d0/f0").find("File not found") != string::npos);
+    CHECK(fsck_clean(ts.run(fs, "fsck")));
+}
+
+static string read_file(const string &path) {
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+// Loads img into fs and returns what loading printed.
+template <class G>
+static string load_quietly(FileSystem<G> &fs, const string &img, bool verify = false) {
+    ostringstream os;
+    streambuf *saved = cout.rdbuf(os.rdbuf());
+    fs.load_image(img, verify);
+    cout.rdbuf(saved);
+    return os.str();
+}
+
+// Overflow extent blocks are little-endian like the rest of the image.
+static void test_extent_block_layout() {
+    using EB = ExtentBlock<Geometry1K>;
+    char buf[Geometry1K::BLOCK_SIZE] = {};
+    const Extent ext[2] = {{0x01020304, 5}, {7, 0x0a0b0c}};
+    EB::put(buf, -1, ext, 2);
+    const unsigned char want[] = {0xff, 0xff, 0xff, 0xff, 2, 0, 0, 0,
+                                  4, 3, 2, 1, 5, 0, 0, 0,
+                                  7, 0, 0, 0, 0x0c, 0x0b, 0x0a, 0};
+    CHECK(memcmp(buf, want, sizeof(want)) == 0);
+    EB eb{buf};
+    CHECK(eb.next() == -1 && eb.count() == 2);
+    CHECK(eb.ext(0).start == 0x01020304 && eb.ext(0).len == 5);
+    CHECK(eb.ext(1).start == 7 && eb.ext(1).len == 0x0a0b0c);
+    CHECK(EB::HEADER + EB::CAPACITY * EB::RECORD <= Geometry1K::BLOCK_SIZE);
+}
+
+// A saved image is sparse and loads back; one whose version or geometry
+// does not match is refused and left as it was.
+template <class G>
+static void test_image_format() {
+    string img = temp_image();
+    string before;
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        ts.run(fs, "createDir /d");
+        ts.run(fs, "createFile /d/f 100 letters 9");
+        for (int i = 0; i < 40; ++i) ts.run(fs, "createFile /s" + to_string(i) + " 1");
+        for (int i = 0; i < 40; i += 2) ts.run(fs, "deleteFile /s" + to_string(i));
+        ts.run(fs, "createFile /big 80 letters 3");
+        fs.save_image();
+        before = ts.run(fs, "cat /d/f") + ts.run(fs, "cat /big");
+    }
+    struct stat st;
+    CHECK(stat(img.c_str(), &st) == 0);
+    CHECK((int64_t)st.st_blocks * 512 < G::FS_SIZE / 8);
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        CHECK(load_quietly(fs, img).empty());
+        CHECK(ts.run(fs, "cat /d/f") + ts.run(fs, "cat /big") == before);
+    }
+    string bytes = read_file(img);
+    {
+        FileSystem<Geometry4K> other;
+        CHECK(load_quietly(other, img).find("Cannot use") != string::npos);
+    }
+    CHECK(read_file(img) == bytes);
+    string bumped = bytes;
+    bumped[8]++;
+    ofstream(img, ios::binary) << bumped;
+    {
+        FileSystem<G> fs;
+        CHECK(load_quietly(fs, img).find("Cannot use") != string::npos);
+    }
+    CHECK(read_file(img) == bumped);
+    remove_image(img);
+}
+
+// find_free and run_length agree with a bit-by-bit search on a map
+// whose size is not a whole number of words.
+static void test_block_bitmap() {
+    const int N = 1000;
+    mt19937_64 rng(3);
+    BlockBitmap bm(N);
+    vector<bool> model(N, true);
+    for (int round = 0; round < 200; ++round) {
+        int start = rng() % N, len = 1 + rng() % min(200, N - start);
+        bool take = rng() % 3 != 0;
+        if (take) bm.clear_range(start, len);
+        else bm.set_range(start, len);
+        for (int i = start; i < start + len; ++i) model[i] = !take;
+        CHECK(bm.count_free() == (int)count(model.begin(), model.end(), true));
+        for (int k = 0; k < 20; ++k) {
+            int from = rng() % N, want = -1;
+            for (int i = 0; i < N && want < 0; ++i)
+                if (model[(from + i) % N]) want = (from + i) % N;
+            CHECK(bm.find_free(from) == want);
+            int run = 0;
+            while (from + run < N && run < 100 && model[from + run]) run++;
+            CHECK(bm.run_length(from, 100) == run);
+        }
+    }
+}
+
+// Freed blocks are counted free again and reused: a file larger than any
+// hole is allocated across the holes deleted files left.
+template <class G>
+static void test_alloc_reuse() {
+    TestSession ts;
+    FileSystem<G> fs;
+    const int64_t part = G::NUM_BLOCKS / 8 * (G::BLOCK_SIZE / 1024);   // KB
+    long long used0 = field(ts.run(fs, "sum"), "Used: ");
+    for (int i = 0; i < 8; ++i) ts.run(fs, "createFile /f" + to_string(i) + " " + to_string(part - 1) + " zeros");
+    CHECK(ts.run(fs, "createFile /g " + to_string(2 * part) + " zeros").find("No space") != string::npos);
+    for (int i = 1; i < 8; i += 2) ts.run(fs, "deleteFile /f" + to_string(i));
+    long long used = field(ts.run(fs, "sum"), "Used: ");
+    CHECK(used - used0 == 4 * (part - 1) * 1024 / G::BLOCK_SIZE);
+    ts.run(fs, "createFile /g " + to_string(3 * part) + " zeros");
+    CHECK(!ts.s.failed);
+    string tail = ts.run(fs, "cat /g " + to_string(3 * part * 1024 - 1) + " 10");
+    CHECK(tail.size() == 2);
+    long long grown = field(ts.run(fs, "sum"), "Used: ") - used - 3 * part * 1024 / G::BLOCK_SIZE;
+    CHECK(grown >= 0 && grown <= 2);   // and the block its extent list overflows into
+    CHECK(fsck_clean(ts.run(fs, "fsck")));
+}
+
+// A freed inode is reused before the table grows, under a new generation,
+// so a handle to the file that had it no longer resolves.
+template <class G>
+static void test_inode_reuse() {
+    TestSession ts;
+    FileSystem<G> fs;
+    map<int, uint32_t> old;
+    for (int i = 0; i < 100; ++i) {
+        ts.run(fs, "createFile /f" + to_string(i) + " 1");
+        InodeHandle h = fs.lookup_handle("/f" + to_string(i));
+        old[h.idx] = h.gen;
+    }
+    CHECK(old.size() == 100 && !old.count(0));
+    for (int i = 0; i < 100; ++i) ts.run(fs, "deleteFile /f" + to_string(i));
+    for (int i = 0; i < 100; ++i) {
+        ts.run(fs, "createFile /g" + to_string(i) + " 1");
+        InodeHandle h = fs.lookup_handle("/g" + to_string(i));
+        CHECK(old.count(h.idx) && old[h.idx] != h.gen);
+        shared_lock<shared_mutex> il(fs.inode_lock(h.idx));
+        CHECK(fs.resolve({h.idx, old[h.idx]}) == nullptr);
+        CHECK(fs.resolve(h) != nullptr);
+    }
+    CHECK(fsck_clean(ts.run(fs, "fsck")));
+}
+
+// The arena is one zeroed region that blocks index into, and writes
+// through one pointer are seen through any other.
+static void test_block_arena() {
+    const int BS = Geometry1K::BLOCK_SIZE, N = 4096;
+    BlockArena<Geometry1K> arena(N);
+    CHECK(arena.size() == (size_t)N * BS);
+    CHECK(!arena.is_file_backed() && arena.budget_bytes() == arena.size());
+    const char *base = arena.data();
+    bool zeros = true;
+    for (size_t i = 0; i < arena.size(); i += 257) zeros &= base[i] == 0;
+    CHECK(zeros);
+    for (int b = 0; b < N; b += 97) {
+        char *p = arena.write_at((size_t)b * BS, BS);
+        CHECK(p == base + (size_t)b * BS);
+        memset(p, 'a' + b % 26, BS);
+    }
+    arena.set_budget(0);
+    for (int b = 0; b < N; b += 97) {
+        const char *p = arena.read_at((size_t)b * BS, BS);
+        CHECK(p[0] == 'a' + b % 26 && p[BS - 1] == 'a' + b % 26);
+        if (b + 1 < N) CHECK(p[BS] == 0);
+    }
+}
+
+// Changes made to a loaded image are written back to it, and a later load
+// sees the latest contents, including blocks that were freed and written
+// again.
+template <class G>
+static void test_image_rewrite() {
+    string img = temp_image();
+    string first, second;
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        ts.run(fs, "createFile /a 50 letters 1");
+        ts.run(fs, "createFile /b 20 letters 2");
+        fs.save_image();
+        first = ts.run(fs, "cat /a");
+    }
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        CHECK(load_quietly(fs, img).empty());
+        CHECK(ts.run(fs, "cat /a") == first);
+        ts.run(fs, "deleteFile /a");
+        ts.run(fs, "createFile /c 50 letters 3");
+        fs.save_image();
+        second = ts.run(fs, "cat /c");
+    }
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        CHECK(load_quietly(fs, img).empty());
+        CHECK(ts.run(fs, "cat /a").find("File not found") != string::npos);
+        CHECK(ts.run(fs, "cat /c") == second);
+        CHECK(ts.run(fs, "cat /b").size() == 20 * 1024 + 1);
+        CHECK(fsck_clean(ts.run(fs, "fsck")));
+    }
+    remove_image(img);
+}
+
+// cp shares the source's blocks instead of copying them, and each copy
+// keeps them until the last one is deleted.
+template <class G>
+static void test_cp_shares_blocks() {
+    TestSession ts;
+    FileSystem<G> fs;
+    const long long n = 100 * 1024 / G::BLOCK_SIZE;
+    ts.run(fs, "createFile /a 100 letters 1");
+    string a = ts.run(fs, "cat /a");
+    long long used = field(ts.run(fs, "sum"), "Used: ");
+    ts.run(fs, "cp /a /b");
+    ts.run(fs, "cp /b /c");
+    string sum = ts.run(fs, "sum");
+    CHECK(field(sum, "Used: ") == used);
+    CHECK(field(sum, "Shared savings: ") == 2 * n);
+    ts.run(fs, "deleteFile /a");
+    ts.run(fs, "deleteFile /b");
+    CHECK(ts.run(fs, "cat /c") == a);
+    sum = ts.run(fs, "sum");
+    CHECK(field(sum, "Used: ") == used);
+    CHECK(field(sum, "Shared savings: ") == 0);
+    CHECK(fsck_clean(ts.run(fs, "fsck")));
+    ts.run(fs, "deleteFile /c");
+    CHECK(field(ts.run(fs, "sum"), "Used: ") == used - n);
+}
+
+// A file written into hundreds of one-block holes needs a chain of
+// overflow extent blocks; it reads back like the same file written
+// contiguously, after a reload too, and frees every block when deleted.
+template <class G>
+static void test_fragmented_extents() {
+    const int HOLES = 3 * ExtentBlock<G>::CAPACITY;
+    const string kb = to_string(G::BLOCK_SIZE / 1024);
+    string want;
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        ts.run(fs, "createFile /g " + to_string(HOLES * (G::BLOCK_SIZE / 1024)) + " letters 8");
+        want = ts.run(fs, "cat /g");
+    }
+    string img = temp_image();
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        for (int i = 0; i < 2 * HOLES; ++i) ts.run(fs, "createFile /s" + to_string(i) + " " + kb + " zeros");
+        long long rest = field(ts.run(fs, "sum"), "Free: ");
+        ts.run(fs, "createFile /fill " + to_string(rest * (G::BLOCK_SIZE / 1024)) + " zeros");
+        CHECK(field(ts.run(fs, "sum"), "Free: ") == 0);
+        for (int i = 0; i < 2 * HOLES; i += 2) ts.run(fs, "deleteFile /s" + to_string(i));
+        fs.commit();
+        CHECK(field(ts.run(fs, "sum"), "Free: ") == HOLES);
+        ts.run(fs, "createFile /g " + to_string((HOLES - 4) * (G::BLOCK_SIZE / 1024)) + " letters 8");
+        CHECK(!ts.s.failed);
+        CHECK(field(ts.run(fs, "sum"), "Free: ") <= 1);     // three extent blocks
+        fs.save_image();
+    }
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        CHECK(ts.run(fs, "cat /g") == want.substr(0, (size_t)(HOLES - 4) * G::BLOCK_SIZE) + "\n");
+        CHECK(fsck_clean(ts.run(fs, "fsck")));
+        ts.run(fs, "deleteFile /g");
+        fs.commit();
+        CHECK(field(ts.run(fs, "sum"), "Free: ") == HOLES);
+    }
+    remove_image(img);
+}
+
+// The generator gives the same bytes for a seed whatever the length asked
+// for and whether or not it was built with AVX2, and only letters.
+static void test_fill_engine() {
+    FillEngine f = {FillPattern::Letters, 12345};
+    string whole(4096, '\0');
+    f.fill(&whole[0], whole.size());
+    CHECK(whole.compare(0, 16, "BSMZKJOBCHAVMGUB") == 0);
+    CHECK(hash_bytes(whole.data(), whole.size()) == 0x78d7abedf0b04530ULL);
+    CHECK(all_of(whole.begin(), whole.end(), [](char c) { return c >= 'A' && c <= 'Z'; }));
+    int seen[26] = {};
+    for (char c : whole) seen[c - 'A']++;
+    CHECK(*min_element(seen, seen + 26) > 4096 / 26 / 2);
+    for (size_t n : {1, 7, 31, 32, 33, 40, 63, 64, 100, 1000}) {
+        string part(n + 32, '#');
+        f.fill(&part[0], n);
+        CHECK(part.compare(0, n, whole, 0, n) == 0);
+        CHECK(part.find_first_not_of('#', n) == string::npos);
+    }
+    FillEngine g = {FillPattern::Letters, 12346};
+    string other(4096, '\0');
+    g.fill(&other[0], other.size());
+    CHECK(other != whole);
+    FillEngine z = {FillPattern::Zeros, 12345};
+    z.fill(&other[0], other.size());
+    CHECK(other == string(4096, '\0'));
+}
+
+// createFile with a seed writes the same contents every time, zeros fills
+// with zeros, and both are exactly the size asked for.
+template <class G>
+static void test_create_file_fill() {
+    TestSession ts;
+    FileSystem<G> fs;
+    ts.run(fs, "createFile /a 200 letters 77");
+    ts.run(fs, "createFile /b 200 letters 77");
+    ts.run(fs, "createFile /c 200 letters 78");
+    ts.run(fs, "createFile /z 3 zeros");
+    string a = ts.run(fs, "cat /a");
+    CHECK(a.size() == 200 * 1024 + 1);
+    CHECK(a == ts.run(fs, "cat /b"));
+    CHECK(a != ts.run(fs, "cat /c"));
+    CHECK(ts.run(fs, "cat /z") == string(3 * 1024, '\0') + "\n");
+    TestSession other;
+    FileSystem<G> fs2;
+    other.run(fs2, "createFile /a 200 letters 77");
+    CHECK(other.run(fs2, "cat /a") == a);
+}
+
+// Every generated workload replays without a failed command and leaves a
+// consistent volume, and the replay report counts every command.
+template <class G>
+static void test_bench_workloads() {
+    for (const char *kind : {"churn", "deep", "wide", "large"}) {
+        ostringstream script;
+        streambuf *saved = cout.rdbuf(script.rdbuf());
+        generate(kind, 2000, 5);
+        cout.rdbuf(saved);
+        TestSession ts;
+        FileSystem<G> fs;
+        istringstream in(script.str());
+        int lines = 0, failed = 0;
+        for (string line; getline(in, line); ++lines) {
+            ts.run(fs, line);
+            failed += ts.s.failed;
+        }
+        CHECK(lines >= 2000);
+        CHECK(failed == 0);
+        CHECK(fsck_clean(ts.run(fs, "fsck")));
+
+        string path = temp_image() + ".script";
+        ofstream(path) << script.str();
+        ostringstream report;
+        saved = cout.rdbuf(report.rdbuf());
+        replay<G>(path, "", 64, 16);
+        cout.rdbuf(saved);
+        unlink(path.c_str());
+        string total = report.str().substr(report.str().find("\"name\": \"total\""));
+        CHECK(total.find("\"ops\": " + to_string(lines) + ", \"errors\": 0,") != string::npos);
+    }
+}
+
+// Every value falls in a bucket whose bounds are within 1/16 of it, and
+// percentiles come out of the right buckets.
+static void test_histogram() {
+    mt19937_64 rng(9);
+    for (int i = 0; i < 100000; ++i) {
+        uint64_t v = rng() >> (rng() % 64);
+        int b = Histogram::bucket(v);
+        CHECK(b >= 0 && b < Histogram::BUCKETS);
+        if (b + 1 == Histogram::BUCKETS) continue;
+        CHECK(Histogram::lower(b) <= v && v < Histogram::lower(b + 1));
+        CHECK(Histogram::lower(b + 1) - Histogram::lower(b) <= max<uint64_t>(1, Histogram::lower(b) / 16));
+    }
+    unique_ptr<StatTotals> t(new StatTotals);
+    for (uint64_t v = 1; v <= 10000; ++v) t->buckets[HIST_OTHER][Histogram::bucket(v)]++;
+    CHECK(t->count(HIST_OTHER) == 10000);
+    CHECK(fabs(t->percentile(HIST_OTHER, 0.50) - 5000) < 5000 / 16.0);
+    CHECK(fabs(t->percentile(HIST_OTHER, 0.99) - 9900) < 9900 / 16.0);
+}
+
+// stats counts what the commands since the last reset did.
+template <class G>
+static void test_stats_command() {
+    TestSession ts;
+    FileSystem<G> fs;
+    ts.run(fs, "createFile /old 5");
+    CHECK(ts.run(fs, "stats reset") == "Statistics reset\n");
+    for (int i = 0; i < 3; ++i) ts.run(fs, "createFile /f" + to_string(i) + " 10 letters 1");
+    ts.run(fs, "cat /f0");
+    ts.run(fs, "cat /f1 100 50");
+    ts.run(fs, "deleteFile /old");
+    string js = ts.run(fs, "stats json");
+    CHECK(js.front() == '{' && js.substr(js.size() - 2) == "}\n");
+    CHECK(field(js, "\"blocks_allocated\": ") == 3 * 10 * 1024 / G::BLOCK_SIZE);
+    CHECK(field(js, "\"blocks_freed\": ") == (5 * 1024 + G::BLOCK_SIZE - 1) / G::BLOCK_SIZE);
+    CHECK(field(js, "\"bytes_read\": ") == 10 * 1024 + 50);
+    CHECK(field(js, "\"createFile\": {\"count\": ") == 3);
+    CHECK(field(js, "\"cat\": {\"count\": ") == 2);
+    CHECK(field(js, "\"deleteFile\": {\"count\": ") == 1);
+    string text = ts.run(fs, "stats");
+    CHECK(text.find("Counters:\n") == 0);
+    CHECK(text.find("\n  createFile ") != string::npos);
+    CHECK(ts.run(fs, "stats bogus").find("Usage: stats") != string::npos && ts.s.failed);
+}
+
+// A damaged data block is reported by a verifying load and by fsck; a
+// damaged inode table makes the load refuse the image.
+template <class G>
+static void test_image_checksums() {
+    string img = temp_image();
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        ts.run(fs, "createDir /d");
+        ts.run(fs, "createFile /d/f 20 letters 4");
+        fs.save_image();
+    }
+    string bytes = read_file(img);
+    {
+        FileSystem<G> fs;
+        CHECK(load_quietly(fs, img, true).empty());
+    }
+    off_t data = ImageLayout<G>::data_off();
+    size_t at = bytes.find_first_not_of('\0', data);
+    CHECK(at != string::npos && at < (size_t)(data + G::FS_SIZE));
+    string bad = bytes;
+    bad[at] ^= 0x20;
+    ofstream(img, ios::binary) << bad;
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        CHECK(load_quietly(fs, img, true).find("Warning: 1 data blocks fail their checksum") == 0);
+        CHECK(!fsck_clean(ts.run(fs, "fsck")));
+    }
+    bad = bytes;
+    bad[ImageLayout<G>::inode_off() + INODE_RECORD + 8] ^= 1;    // inode 1's size
+    ofstream(img, ios::binary) << bad;
+    {
+        FileSystem<G> fs;
+        CHECK(load_quietly(fs, img).find("inode table is damaged in 1 chunks") != string::npos);
+    }
+    remove_image(img);
+}
+
+// With dedup on, a file with the same contents as one already stored takes
+// no new blocks, including one written before dedup was turned on, and the
+// shared blocks stay until the last file using them is deleted.
+template <class G>
+static void test_dedup() {
+    TestSession ts;
+    FileSystem<G> fs;
+    const long long n = 50 * 1024 / G::BLOCK_SIZE;
+    ts.run(fs, "createFile /a 50 letters 1");
+    fs.set_dedup(true);
+    ts.run(fs, "stats reset");
+    long long used = field(ts.run(fs, "sum"), "Used: ");
+    ts.run(fs, "createFile /b 50 letters 1");
+    ts.run(fs, "createFile /c 50 letters 1");
+    CHECK(field(ts.run(fs, "sum"), "Used: ") == used);
+    ts.run(fs, "createFile /d 50 letters 2");
+    CHECK(field(ts.run(fs, "sum"), "Used: ") == used + n);
+    string st = ts.run(fs, "dedup-stats");
+    CHECK(st.find("Dedup: on, " + to_string(2 * n) + " blocks indexed") != string::npos);
+    CHECK(st.find(to_string(2 * n) + " duplicates") != string::npos);
+    CHECK(st.find("Shared: " + to_string(n) + " indexed blocks hold " + to_string(3 * n) + " references") != string::npos);
+    string a = ts.run(fs, "cat /a");
+    ts.run(fs, "deleteFile /a");
+    ts.run(fs, "deleteFile /b");
+    CHECK(ts.run(fs, "cat /c") == a);
+    CHECK(field(ts.run(fs, "sum"), "Used: ") == used + n);
+    CHECK(fsck_clean(ts.run(fs, "fsck")));
+    ts.run(fs, "deleteFile /c");
+    CHECK(field(ts.run(fs, "sum"), "Used: ") == used);
+}
+
+// Block counts, sizes and the image follow the geometry the volume was
+// built with.
+template <class G>
+static void test_geometry() {
+    string img = temp_image();
+    const long long per_file = (10 * 1024 + G::BLOCK_SIZE - 1) / G::BLOCK_SIZE;
+    string a;
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.load_image(img);
+        string sum = ts.run(fs, "sum");
+        CHECK(field(sum, "Total blocks: ") == G::NUM_BLOCKS);
+        long long used = field(sum, "Used: ");
+        ts.run(fs, "createFile /a 10 letters 1");
+        ts.run(fs, "createFile /b 10 letters 2");
+        CHECK(field(ts.run(fs, "sum"), "Used: ") == used + 2 * per_file);
+        a = ts.run(fs, "cat /a");
+        CHECK(a.size() == 10 * 1024 + 1);
+        fs.save_image();
+    }
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        CHECK(load_quietly(fs, img).empty());
+        CHECK(ts.run(fs, "cat /a") == a);
+        CHECK(fsck_clean(ts.run(fs, "fsck")));
+    }
+    remove_image(img);
+}
+
+// With a buffer cache far smaller than the data, files still read back
+// whole, frames are evicted, and what stays resident keeps to the budget.
+template <class G>
+static void test_small_cache() {
+    string img = temp_image();
+    vector<string> want;
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.set_cache_budget(256 << 10);
+        fs.load_image(img);
+        for (int i = 0; i < 4; ++i) {
+            ts.run(fs, "createFile /f" + to_string(i) + " 2000 letters " + to_string(i));
+            want.push_back(ts.run(fs, "cat /f" + to_string(i)));
+        }
+        fs.save_image();
+    }
+    {
+        TestSession ts;
+        FileSystem<G> fs;
+        fs.set_cache_budget(256 << 10);
+        fs.load_image(img);
+        ts.run(fs, "stats reset");
+        for (int round = 0; round < 2; ++round)
+            for (int i = 3; i >= 0; --i) CHECK(ts.run(fs, "cat /f" + to_string(i)) == want[i]);
+        CHECK(ts.run(fs, "cat /f2 1000000 10") == want[2].substr(1000000, 10) + "\n");
+        string js = ts.run(fs, "stats json");
+        CHECK(field(js, "\"buffer_evictions\": ") > 0);
+        CHECK(field(js, "\"budget_bytes\": ") == 256 << 10);
+        CHECK(field(js, "\"resident_bytes\": ") <= 256 << 10);
+        CHECK(fsck_clean(ts.run(fs, "fsck")));
+    }
+    remove_image(img);
+}
+
+// du totals follow every change below a directory, and a recursive
+// delete reports and releases everything under it.
+template <class G>
+static void test_du_totals() {
+    TestSession ts;
+    FileSystem<G> fs;
+    auto du = [&](const string &path, const char *what) { return field(ts.run(fs, "du " + path), what); };
+    ts.run(fs, "createDir /t");
+    ts.run(fs, "createDir /t/a");
+    ts.run(fs, "createDir /t/a/b");
+    ts.run(fs, "createFile /t/x 3 letters 1");
+    ts.run(fs, "createFile /t/a/y 5 letters 2");
+    ts.run(fs, "createFile /t/a/b/z 7 letters 3");
+    ts.run(fs, "createFile /t/a/b/w 0");
+    CHECK(du("/t", ": ") == 15 * 1024);
+    CHECK(du("/t", "), ") == 7);
+    CHECK(du("/t/a", ": ") == 12 * 1024);
+    CHECK(du("/t/a/b/z", ": ") == 7 * 1024);
+    CHECK(du("/", " in ") == field(ts.run(fs, "sum"), "Used: "));
+    ts.run(fs, "cp /t/a/b/z /t/c");
+    CHECK(du("/t", ": ") == 22 * 1024);
+    ts.run(fs, "changeDir /t/a");
+    ts.run(fs, "deleteFile b/z");
+    CHECK(du("/t", ": ") == 15 * 1024);
+    CHECK(du("b", "), ") == 2);
+    ts.run(fs, "changeDir /");
+    long long used = field(ts.run(fs, "sum"), "Used: ");
+    long long blocks = du("/t/a", " in ");
+    string out = ts.run(fs, "deleteDir -r /t/a");
+    CHECK(out == "Directory deleted: /t/a (1 directories, 2 files below)\n");
+    CHECK(du("/t", ": ") == 10 * 1024);
+    CHECK(du("/t", "), ") == 3);
+    CHECK(field(ts.run(fs, "sum"), "Used: ") == used - blocks);
+    CHECK(ts.run(fs, "du /t/a").find("File not found") != string::npos);
+}
+
+// dir lists subdirectories, then files, each in the order they were
+// created, and pages through them; bad page arguments are refused.
+template <class G>
+static void test_dir_pages() {
+    TestSession ts;
+    FileSystem<G> fs;
+    ts.run(fs, "createDir /p");
+    ts.run(fs, "changeDir /p");
+    ts.run(fs, "createFile f0 1");
+    ts.run(fs, "createDir d0");
+    for (int i = 1; i < 10; ++i) ts.run(fs, "createFile f" + to_string(i) + " " + to_string(i));
+    ts.run(fs, "createDir d1");
+    ts.run(fs, "deleteFile f2");
+    ts.run(fs, "createFile f10 0");
+    auto names = [&](const string &cmd) {
+        istringstream in(ts.run(fs, cmd));
+        string all, line;
+        while (getline(in, line))
+            if (line[0] == '[') all += line.substr(7, line.find(' ', 7) - 7) + " ";
+            else all += "| " + line;
+        return all;
+    };
+    CHECK(names("dir") == "d0 d1 f0 f1 f3 f4 f5 f6 f7 f8 f9 f10 ");
+    CHECK(names("dir 3 4") == "f1 f3 f4 f5 | Entries 3 to 7 of 12");
+    CHECK(names("dir 10 5") == "f9 f10 | Entries 10 to 12 of 12");
+    CHECK(names("dir 20") == "| Entries 12 to 12 of 12");
+    CHECK(names("dir 0 0") == "| Entries 0 to 0 of 12");
+    CHECK(ts.run(fs, "dir 4 1").find("f3                   size = 3072B, created = ") != string::npos);
+    for (const char *bad : {"dir -1 2", "dir x", "dir 2 -3", "dir 2 y"}) {
+        CHECK(ts.run(fs, bad) == "Usage: dir [offset [count]]\n");
+        CHECK(ts.s.failed);
+    }
+}
+
+// defrag leaves no file in more than one run, except where blocks are
+// shared with a copy, and changes no contents.
+template <class G>
+static void test_defrag_contents() {
+    TestSession ts;
+    FileSystem<G> fs;
+    for (int i = 0; i < 60; ++i) ts.run(fs, "createFile /s" + to_string(i) + " 2 letters " + to_string(i));
+    long long rest = field(ts.run(fs, "sum"), "Free: ");
+    ts.run(fs, "createFile /fill " + to_string(rest * (G::BLOCK_SIZE / 1024)) + " zeros");
+    for (int i = 0; i < 60; i += 2) ts.run(fs, "deleteFile /s" + to_string(i));
+    for (int i = 0; i < 3; ++i) ts.run(fs, "createFile /g" + to_string(i) + " 16 letters " + to_string(100 + i));
+    ts.run(fs, "cp /g1 /h");
+    ts.run(fs, "deleteFile /fill");
+    vector<string> names = {"/g0", "/g1", "/g2", "/h", "/s1", "/s59"};
+    vector<string> want;
+    for (const string &n : names) want.push_back(ts.run(fs, "cat " + n));
+    CHECK(field(ts.run(fs, "stats json"), "\"fragmented_files\": ") == 4);
+    ts.run(fs, "defrag");
+    CHECK(field(ts.run(fs, "stats json"), "\"fragmented_files\": ") == 2);   // /g1 and /h share theirs
+    for (size_t i = 0; i < names.size(); ++i) CHECK(ts.run(fs, "cat " + names[i]) == want[i]);
+    CHECK(fsck_clean(ts.run(fs, "fsck")));
+}
+
+struct Test { const char *name; void (*fn)(); };
+
+static const Test all_tests[] = {
+    {"block_bitmap", test_block_bitmap},
+    {"alloc_reuse", test_alloc_reuse<Geometry1K>},
+    {"inode_reuse", test_inode_reuse<Geometry1K>},
+    {"block_arena", test_block_arena},
+    {"image_rewrite", test_image_rewrite<Geometry1K>},
+    {"cp_shares_blocks", test_cp_shares_blocks<Geometry1K>},
+    {"fragmented_extents", test_fragmented_extents<Geometry1K>},
+    {"fill_engine", test_fill_engine},
+    {"create_file_fill", test_create_file_fill<Geometry1K>},
+    {"bench_workloads", test_bench_workloads<Geometry1K>},
+    {"histogram", test_histogram},
+    {"stats_command", test_stats_command<Geometry1K>},
+    {"image_checksums", test_image_checksums<Geometry1K>},
+    {"dedup", test_dedup<Geometry1K>},
+    {"geometry_1k", test_geometry<Geometry1K>},
+    {"geometry_4k", test_geometry<Geometry4K>},
+    {"geometry_64k", test_geometry<Geometry64K>},
+    {"cp_shares_blocks_4k", test_cp_shares_blocks<Geometry4K>},
+    {"fragmented_extents_4k", test_fragmented_extents<Geometry4K>},
+    {"journal_replay_4k", test_journal_replay<Geometry4K>},
+    {"small_cache", test_small_cache<Geometry1K>},
+    {"du_totals", test_du_totals<Geometry1K>},
+    {"dir_pages", test_dir_pages<Geometry1K>},
+    {"defrag_contents", test_defrag_contents<Geometry1K>},
+    {"crash_reuse_freed", test_crash_reuse_freed<Geometry1K>},
+    {"crash_after_committed_free", test_crash_after_committed_free<Geometry1K>},
+    {"defrag_settles", test_defrag_settles<Geometry1K>},
+    {"codec_round_trip_1k", test_codec_round_trip<Geometry1K>},
+    {"codec_round_trip_4k", test_codec_round_trip<Geometry4K>},
+    {"journal_replay", test_journal_replay<Geometry1K>},
+    {"dcache_stale_paths", test_dcache_stale_paths<Geometry1K>},
+    {"directory_index", test_directory_index<Geometry1K>},
+    {"cat_ranges", test_cat_ranges<Geometry1K>},
+    {"batch_mode", test_batch_mode<Geometry1K>},
+    {"session_cwd_deleted", test_session_cwd_deleted<Geometry1K>},
+    {"concurrent_sessions", test_concurrent_sessions<Geometry1K>},
+    {"task_pool", test_task_pool},
+    {"parallel_cp", test_parallel_cp<Geometry1K>},
+    {"extent_block_layout", test_extent_block_layout},
+    {"image_format", test_image_format<Geometry1K>},
+};
+
+int main(int argc, char **argv) {
+    string filter;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--filter" && i + 1 < argc) filter = argv[++i];
+        else { cerr << "usage: " << argv[0] << " [--filter text]\n"; return 2; }
+    }
+    int failed = 0;
+    for (const Test &t : all_tests) {
+        if (!filter.empty() && string(t.name).find(filter) == string::npos) continue;
+        int before = checks_failed;
+        t.fn();
+        bool ok = checks_failed == before;
+        cout << (ok ? "ok   " : "FAIL ") << t.name << "\n";
+        failed += !ok;
+    }
+    return failed;
+}